@@ -0,0 +1,70 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+#
+# Traversal benchmark: runs zfs-tpm-list from $1 (default: out/) under libzfs-shim.so (see the top of contrib/libzfs-shim.cpp)
+# over synthetic pools, and writes wall-clock and peak RSS figures to $BENCH_REPORT, one JSON object per line:
+#   {"tool":"zfs-tpm-list -r","datasets":1000000,"latency_ns":0,"runs":3,"p50_ms":1234.5,"maxrss_kib":56789}
+#
+# Needs GNU time(1); no root, ZFS, or TPM.
+#
+# BENCH_DATASETS    datasets in the pool              (default: 1000 10000 100000 1000000)
+# BENCH_LATENCY_NS  injected per-ioctl latencies      (default: 0)
+# BENCH_LIST_FLAGS  zfs-tpm-list flags, ,-separated   (default: -r -Hr -r,-j,4)
+# BENCH_RUNS        runs per measurement              (default: 3)
+# BENCH_REPORT      where the report goes             (default: $1/bench-scale.json)
+
+
+set -eu
+
+bindir="$(realpath "${1:-out}")"
+: "${BENCH_DATASETS:=1000 10000 100000 1000000}"
+: "${BENCH_LATENCY_NS:=0}"
+: "${BENCH_LIST_FLAGS:=-r -Hr -r,-j,4}"
+: "${BENCH_RUNS:=3}"
+: "${BENCH_REPORT:=$bindir/bench-scale.json}"
+
+[ -x /usr/bin/time ] || { echo "$0: /usr/bin/time not found" >&2; exit 1; }
+[ -e "$bindir/libzfs-shim.so" ] || { echo "$0: $bindir/libzfs-shim.so not found; make $bindir/libzfs-shim.so" >&2; exit 1; }
+
+samples="$(mktemp "${TMPDIR:-/tmp}/tzpfms-bench-scale.XXXXXXXXXX")"
+trap 'rm -f "$samples" "$samples.time"' EXIT INT TERM
+
+
+for datasets in $BENCH_DATASETS; do
+	for latency in $BENCH_LATENCY_NS; do
+		for flags in $BENCH_LIST_FLAGS; do
+			flags="$(echo "$flags" | tr , ' ')"
+			r=0
+			while [ "$r" -lt "$BENCH_RUNS" ]; do
+				# shellcheck disable=SC2086
+				LD_PRELOAD="$bindir/libzfs-shim.so" TZPFMS_SHIM_DATASETS="$datasets" TZPFMS_SHIM_LATENCY_NS="$latency" \
+					/usr/bin/time -f '%e\t%M' -o "$samples.time" "$bindir/zfs-tpm-list" $flags > /dev/null
+				printf 'zfs-tpm-list %s\t%s\t%s\t%s\n' "$flags" "$datasets" "$latency" "$(cat "$samples.time")" >> "$samples"
+				r=$(( r + 1 ))
+			done
+		done
+	done
+done
+
+
+# Nearest-rank median time and largest RSS per (tool, datasets, latency)
+sort -t "$(printf '\t')" -k1,1 -k2,2n -k3,3n -k4,4n "$samples" | awk -F '\t' '
+	function flush() {
+		if(!n)
+			return
+		printf "{\"tool\":\"%s\",\"datasets\":%d,\"latency_ns\":%d,\"runs\":%d,\"p50_ms\":%.1f,\"maxrss_kib\":%d}\n", tool, datasets, latency, n, v[int((n - 1) * 0.50) + 1] * 1000, rss
+		n = 0
+		rss = 0
+	}
+	$1 != tool || $2 != datasets || $3 != latency {
+		flush()
+		tool = $1; datasets = $2; latency = $3
+	}
+	{
+		v[++n] = $4
+		if($5 > rss)
+			rss = $5
+	}
+	END { flush() }
+' > "$BENCH_REPORT"
+cat "$BENCH_REPORT"
@@ -0,0 +1,191 @@
+#!/bin/sh
+# SPDX-License-Identifier: MIT
+#
+# End-to-end latency benchmark: runs the binaries in $1 (default: out/) against swtpm (TPM2; TPM1.2 via tcsd)
+# and file-vdev pools with N encrypted roots, and writes p50/p95 figures to $BENCH_REPORT, one JSON object per line:
+#   {"tool":"zfs-tpm2-load-key -r","backend":"TPM2","datasets":8,"pcrs":"sha256:7","runs":10,"p50_ms":123.4,"p95_ms":156.7}
+# followed by the TPM2 commands each single-dataset zfs-tpm2-load-key unseal took (from TZPFMS_TRACE, see passphrase.h):
+#   {"check":"tpm2_unseal","datasets":8,"pcrs":"sha256:7","unseals":10,"round_trips_per_unseal":9.0,"pcr_reads":0}
+# An unseal that reads PCRs fails the run: the policy session has the TPM check them itself.
+#
+# Needs root, ZFS, and swtpm (+ swtpm_setup and tcsd for TPM1.X, which is skipped otherwise).
+# Don't run it on a machine with a TPM: the tzpfms binaries would pick that up before swtpm (see backend-tpm2.h).
+#
+# BENCH_DATASETS   dataset counts                     (default: 1 8 32)
+# BENCH_RUNS       runs per measurement               (default: 10)
+# BENCH_TPM2_PCRS  -P arguments for the TPM2 back-end  (default: none sha256:7 sha1:0,7+sha256:0,7)
+# BENCH_TPM1X_PCRS -P arguments for the TPM1.X back-end (default: none 7 0,7)
+# BENCH_REPORT     where the report goes               (default: $1/bench.json)
+# BENCH_KEEP       if nonempty, leave the work directory around
+
+
+set -eu
+
+bindir="$(realpath "${1:-out}")"
+: "${BENCH_DATASETS:=1 8 32}"
+: "${BENCH_RUNS:=10}"
+: "${BENCH_TPM2_PCRS:=none sha256:7 sha1:0,7+sha256:0,7}"
+: "${BENCH_TPM1X_PCRS:=none 7 0,7}"
+: "${BENCH_REPORT:=$bindir/bench.json}"
+
+for t in zfs zpool swtpm; do
+	command -v "$t" > /dev/null || { echo "$0: $t not found" >&2; exit 1; }
+done
+[ "$(id -u)" -eq 0 ] || { echo "$0: need root for zpool create" >&2; exit 1; }
+for d in /dev/tpmrm0 /dev/tpm0; do
+	[ -e "$d" ] && { echo "$0: $d exists, and would be used instead of swtpm" >&2; exit 1; }
+done
+
+
+work="$(mktemp -d "${TMPDIR:-/tmp}/tzpfms-bench.XXXXXXXXXX")"
+pool="tzpfms-bench-$$"
+samples="$work/samples"
+checks="$work/checks"
+: > "$samples"
+: > "$checks"
+cleanup() {
+	zpool destroy -f "$pool" 2> /dev/null || :
+	for p in "$work"/*.pid; do
+		[ -e "$p" ] && kill "$(cat "$p")" 2> /dev/null || :
+	done
+	[ -n "${BENCH_KEEP:-}" ] || rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# No prompts: empty passphrases for the sealed objects and the TPM hierarchies
+export TZPFMS_PASSPHRASE_HELPER='printf ""'
+export TZPFMSD_SOCKET=''
+# Picked up by newer tpm2-tss; older ones try localhost:2321 after the device nodes anyway
+export TSS2_TCTI='swtpm:host=localhost,port=2321'
+export TSS2_LOG='all+NONE'
+
+
+now_ns() { date +%s%N; }
+
+# sample tool backend datasets pcrs command...
+sample() {
+	tool="$1" backend="$2" datasets="$3" pcrs="$4"
+	shift 4
+	start="$(now_ns)"
+	"$@" > /dev/null
+	end="$(now_ns)"
+	printf '%s\t%s\t%s\t%s\t%s\n' "$tool" "$backend" "$datasets" "$pcrs" "$(( (end - start) / 1000 ))" >> "$samples"
+}
+
+# make_pool count: count encryption roots under $pool, with passphrase keys
+make_pool() {
+	zpool destroy -f "$pool" 2> /dev/null || :
+	rm -f "$work/vdev"
+	truncate -s 512M "$work/vdev"
+	zpool create -f -m none -O canmount=off "$pool" "$work/vdev"
+	i=0
+	while [ "$i" -lt "$1" ]; do
+		echo 'benchpassphrase' | zfs create -o encryption=on -o keyformat=passphrase -o keylocation=prompt -o canmount=off "$pool/enc$i"
+		i=$(( i + 1 ))
+	done
+}
+
+roots() {
+	zfs list -Ho name -d1 "$pool" | sed 1d
+}
+
+# bench_backend backend prefix pcrs count
+bench_backend() {
+	backend="$1" prefix="$2" pcrs="$3" count="$4"
+	make_pool "$count"
+
+	pflag=''
+	[ "$pcrs" = 'none' ] || pflag="-P $pcrs"
+	for ds in $(roots); do
+		# shellcheck disable=SC2086
+		sample "$prefix-change-key" "$backend" "$count" "$pcrs" "$bindir/$prefix-change-key" $pflag "$ds"
+	done
+
+	# Only for the single-dataset load: the counters are per-process, and -r unseals in parallel
+	trace=''
+	[ "$backend" = 'TPM2' ] && trace="$work/trace"
+	: > "$work/trace"
+	r=0
+	while [ "$r" -lt "$BENCH_RUNS" ]; do
+		zfs unload-key -r "$pool"
+		sample "$prefix-load-key -r" "$backend" "$count" "$pcrs" "$bindir/$prefix-load-key" -r "$pool"
+		zfs unload-key "$pool/enc0"
+		sample "$prefix-load-key" "$backend" "$count" "$pcrs" env TZPFMS_TRACE="$trace" "$bindir/$prefix-load-key" "$pool/enc0"
+		sample "$prefix-load-key -n" "$backend" "$count" "$pcrs" "$bindir/$prefix-load-key" -n "$pool/enc0"
+		sample 'zfs-tpm-list -r' "$backend" "$count" "$pcrs" "$bindir/zfs-tpm-list" -r "$pool"
+		r=$(( r + 1 ))
+	done
+
+	for ds in $(roots); do
+		printf 'benchpassphrase\n' | sample "$prefix-clear-key" "$backend" "$count" "$pcrs" "$bindir/$prefix-clear-key" "$ds"
+	done
+
+	[ -n "$trace" ] || return 0
+	awk -v datasets="$count" -v pcrs="$pcrs" '
+		function field(name) { return match($0, "\"" name "\":[0-9]+") ? substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3) : 0 }
+		/"phase":"tpm2_unseal"/ { ++unseals; trips += field("tpm_round_trips"); reads += field("tpm_pcr_reads") }
+		END {
+			printf "{\"check\":\"tpm2_unseal\",\"datasets\":%d,\"pcrs\":\"%s\",\"unseals\":%d,\"round_trips_per_unseal\":%.1f,\"pcr_reads\":%d}\n",
+			       datasets, pcrs, unseals, unseals ? trips / unseals : 0, reads
+			exit !unseals || reads
+		}
+	' "$trace" >> "$checks" || { echo "$0: $prefix-load-key: no tpm2_unseal traced, or it read PCRs:" >&2; tail -n1 "$checks" >&2; exit 1; }
+}
+
+
+# TPM2: swtpm's TCP server on the port tpm2-tss falls back to
+mkdir "$work/tpm2"
+swtpm socket --tpm2 --tpmstate dir="$work/tpm2" --server type=tcp,port=2321 --ctrl type=tcp,port=2322 \
+             --flags not-need-init,startup-clear --daemon --pid file="$work/swtpm2.pid"
+for count in $BENCH_DATASETS; do
+	for pcrs in $BENCH_TPM2_PCRS; do
+		bench_backend TPM2 zfs-tpm2 "$pcrs" "$count"
+	done
+done
+kill "$(cat "$work/swtpm2.pid")"
+rm "$work/swtpm2.pid"
+
+
+# TPM1.2: owned with well-known secrets (as zfs-tpm1x-change-key(8) expects), tcsd talking to it over TCP
+if command -v swtpm_setup > /dev/null && command -v tcsd > /dev/null; then
+	mkdir "$work/tpm1x"
+	swtpm_setup --tpmstate "$work/tpm1x" --createek --take-ownership --owner-well-known --srk-well-known > /dev/null
+	swtpm socket --tpmstate dir="$work/tpm1x" --server type=tcp,port=6545 --ctrl type=tcp,port=6546 \
+	             --flags not-need-init,startup-clear --daemon --pid file="$work/swtpm1x.pid"
+
+	printf 'port = 30003\nsystem_ps_file = %s\n' "$work/tpm1x/system.data" > "$work/tcsd.conf"
+	chown tss: "$work/tcsd.conf" 2> /dev/null || :
+	chmod 0600 "$work/tcsd.conf"
+	TCSD_USE_TCP_DEVICE=1 TCSD_TCP_DEVICE_PORT=6545 tcsd -f -c "$work/tcsd.conf" &
+	echo "$!" > "$work/tcsd.pid"
+	sleep 1
+
+	for count in $BENCH_DATASETS; do
+		for pcrs in $BENCH_TPM1X_PCRS; do
+			bench_backend TPM1.X zfs-tpm1x "$pcrs" "$count"
+		done
+	done
+else
+	echo "$0: swtpm_setup or tcsd not found; skipping TPM1.X" >&2
+fi
+
+
+# Nearest-rank percentiles per (tool, backend, datasets, pcrs)
+sort -t "$(printf '\t')" -k1,1 -k2,2 -k3,3n -k4,4 -k5,5n "$samples" | awk -F '\t' '
+	function flush() {
+		if(!n)
+			return
+		p50 = v[int((n - 1) * 0.50) + 1]
+		p95 = v[int((n - 1) * 0.95) + 1]
+		printf "{\"tool\":\"%s\",\"backend\":\"%s\",\"datasets\":%d,\"pcrs\":\"%s\",\"runs\":%d,\"p50_ms\":%.1f,\"p95_ms\":%.1f}\n", tool, backend, datasets, pcrs, n, p50 / 1000, p95 / 1000
+		n = 0
+	}
+	$1 != tool || $2 != backend || $3 != datasets || $4 != pcrs {
+		flush()
+		tool = $1; backend = $2; datasets = $3; pcrs = $4
+	}
+	{ v[++n] = $5 }
+	END { flush() }
+' > "$BENCH_REPORT"
+cat "$checks" >> "$BENCH_REPORT"
+cat "$BENCH_REPORT"
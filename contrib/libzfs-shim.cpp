@@ -0,0 +1,273 @@
+/* SPDX-License-Identifier: MIT */
+// LD_PRELOAD stand-in for the parts of libzfs that zfs-tpm-list and for_all_datasets() use, over a generated tree instead of /dev/zfs:
+//   make out/libzfs-shim.so && LD_PRELOAD=out/libzfs-shim.so TZPFMS_SHIM_DATASETS=1000000 out/zfs-tpm-list -r
+// contrib/bench-scale.sh does this for 10^3..10^6 datasets.
+//
+// Each pool is a complete TZPFMS_SHIM_FANOUT-ary tree, which is never materialised: dataset i's children are fanout * i + 1..fanout * i + fanout,
+// named .../ds0, .../ds1, ..., and its parent is (i - 1) / fanout; the shim's footprint doesn't grow with the tree, so what's measured is tzpfms'.
+//
+// TZPFMS_SHIM_POOLS       pools, named shim0, shim1, ...                                    (default: 1)
+// TZPFMS_SHIM_DATASETS    datasets per pool, including the root                             (default: 1000)
+// TZPFMS_SHIM_FANOUT      children per dataset                                              (default: 10)
+// TZPFMS_SHIM_ROOT_EVERY  every Nth dataset is an encryption root; 0 for no encryption at all (default: 1)
+// TZPFMS_SHIM_LATENCY_NS  slept on each call that'd be an ioctl in libzfs                    (default: 0)
+//
+// Encryption roots have TPM2 props, TPM1.X props, and no props, in turn; every other one has its key loaded.
+// Nothing else is implemented: lzc_*() and the rest of zfs_crypto_*() still go to the real thing (and fail without the module).
+
+
+#include <libzfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utility>
+
+#include "../src/parse.hpp"
+#include "../src/zfs.hpp"
+
+
+struct shim_config {
+	size_t pools;
+	size_t datasets;
+	size_t fanout;
+	size_t root_every;
+	timespec latency;
+};
+
+static const shim_config & config() {
+	static const shim_config cfg = [] {
+		shim_config cfg{1, 1000, 10, 1, {}};
+		auto var = [](const char * name, size_t & out) {
+			if(auto val = getenv(name); val && !parse_uint(val, out))
+				fprintf(stderr, "libzfs-shim: %s=%s: %s\n", name, val, strerror(errno)), exit(1);
+		};
+		var("TZPFMS_SHIM_POOLS", cfg.pools);
+		var("TZPFMS_SHIM_DATASETS", cfg.datasets);
+		var("TZPFMS_SHIM_FANOUT", cfg.fanout);
+		var("TZPFMS_SHIM_ROOT_EVERY", cfg.root_every);
+
+		size_t latency_ns{};
+		var("TZPFMS_SHIM_LATENCY_NS", latency_ns);
+		cfg.latency = {static_cast<time_t>(latency_ns / 1'000'000'000), static_cast<long>(latency_ns % 1'000'000'000)};
+		return cfg;
+	}();
+	return cfg;
+}
+
+static void simulate_ioctl() {
+	if(config().latency.tv_sec || config().latency.tv_nsec)
+		nanosleep(&config().latency, nullptr);
+}
+
+
+struct libzfs_handle {
+	boolean_t print_on_error;
+};
+
+struct zfs_handle {
+	libzfs_handle_t * libz;
+	size_t idx;             // in the pool's tree
+	nvlist_t * user_props;  // on first zfs_get_user_props()
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+};
+
+static zfs_handle_t * new_handle(libzfs_handle_t * libz, const char * name, size_t idx) {
+	auto ret = reinterpret_cast<zfs_handle_t *>(calloc(1, sizeof(zfs_handle_t)));
+	if(!ret)
+		return fprintf(stderr, "Couldn't allocate dataset handle: %s\n", strerror(errno)), nullptr;
+	ret->libz = libz;
+	ret->idx  = idx;
+	strncpy(ret->name, name, sizeof(ret->name) - 1);
+	return ret;
+}
+
+
+static size_t depth(size_t idx) {
+	size_t ret{};
+	for(; idx; idx = (idx - 1) / config().fanout)
+		++ret;
+	return ret;
+}
+
+/// false if not encrypted
+static bool encryption_root(size_t idx, size_t & root) {
+	if(!config().root_every)
+		return false;
+	while(idx % config().root_every)
+		idx = (idx - 1) / config().fanout;
+	root = idx;
+	return true;
+}
+
+static void ancestor_name(const zfs_handle_t * of, size_t ancestor, char * into) {
+	strcpy(into, of->name);
+	for(auto up = depth(of->idx) - depth(ancestor); up; --up)
+		*strrchr(into, '/') = '\0';
+}
+
+
+libzfs_handle_t * libzfs_init() {
+	config();
+	simulate_ioctl();
+	return reinterpret_cast<libzfs_handle_t *>(calloc(1, sizeof(libzfs_handle_t)));
+}
+
+void libzfs_fini(libzfs_handle_t * libz) {
+	free(libz);
+}
+
+void libzfs_print_on_error(libzfs_handle_t * libz, boolean_t print) {
+	libz->print_on_error = print;
+}
+
+
+/// shimN[/dsK]...
+zfs_handle_t * zfs_open(libzfs_handle_t * libz, const char * path, int) {
+	simulate_ioctl();
+	auto nonexistent = [&]() -> zfs_handle_t * {
+		if(libz->print_on_error)
+			fprintf(stderr, "cannot open '%s': dataset does not exist\n", path);
+		return nullptr;
+	};
+
+	if(strncmp(path, "shim", strlen("shim")) || strlen(path) >= ZFS_MAX_DATASET_NAME_LEN)
+		return nonexistent();
+	char * cur{};
+	auto pool = strtoull(path + strlen("shim"), &cur, 10);
+	if(cur == path + strlen("shim") || pool >= config().pools)
+		return nonexistent();
+
+	size_t idx{};
+	while(*cur == '/') {
+		if(strncmp(cur + 1, "ds", strlen("ds")))
+			return nonexistent();
+		char * end{};
+		auto child = strtoull(cur + 1 + strlen("ds"), &end, 10);
+		if(end == cur + 1 + strlen("ds") || child >= config().fanout || (idx = config().fanout * idx + 1 + child) >= config().datasets)
+			return nonexistent();
+		cur = end;
+	}
+	if(*cur)
+		return nonexistent();
+
+	return new_handle(libz, path, idx);
+}
+
+void zfs_close(zfs_handle_t * dataset) {
+	nvlist_free(dataset->user_props);
+	free(dataset);
+}
+
+zfs_handle_t * zfs_handle_dup(zfs_handle_t * dataset) {
+	return new_handle(dataset->libz, dataset->name, dataset->idx);
+}
+
+const char * zfs_get_name(const zfs_handle_t * dataset) {
+	return dataset->name;
+}
+
+libzfs_handle_t * zfs_get_handle(zfs_handle_t * dataset) {
+	return dataset->libz;
+}
+
+
+int zfs_iter_root(libzfs_handle_t * libz, zfs_iter_f func, void * data) {
+	for(size_t pool = 0; pool < config().pools; ++pool) {
+		simulate_ioctl();
+		char name[ZFS_MAX_DATASET_NAME_LEN];
+		snprintf(name, sizeof(name), "shim%zu", pool);
+		auto dataset = new_handle(libz, name, 0);
+		if(!dataset)
+			return -1;
+		if(auto err = func(dataset, data))
+			return err;
+	}
+	return 0;
+}
+
+/// One ioctl per child, and one more for the ESRCH at the end
+int zfs_iter_filesystems(zfs_handle_t * dataset, zfs_iter_f func, void * data) {
+	for(size_t child = 0; child < config().fanout; ++child) {
+		auto idx = config().fanout * dataset->idx + 1 + child;
+		if(idx >= config().datasets)
+			break;
+
+		simulate_ioctl();
+		char name[ZFS_MAX_DATASET_NAME_LEN];
+		if(snprintf(name, sizeof(name), "%s/ds%zu", dataset->name, child) >= static_cast<int>(sizeof(name)))
+			continue;
+		auto child_dataset = new_handle(dataset->libz, name, idx);
+		if(!child_dataset)
+			return -1;
+		if(auto err = func(child_dataset, data))
+			return err;
+	}
+	simulate_ioctl();
+	return 0;
+}
+
+
+// The rest come out of the properties cached in the handle, so aren't ioctls
+
+int zfs_crypto_get_encryption_root(zfs_handle_t * dataset, boolean_t * is_encroot, char * buf) {
+	size_t root;
+	if(!encryption_root(dataset->idx, root)) {
+		*is_encroot = B_FALSE;
+		if(buf)
+			*buf = '\0';
+		return 0;
+	}
+
+	*is_encroot = root == dataset->idx ? B_TRUE : B_FALSE;
+	if(buf)
+		ancestor_name(dataset, root, buf);
+	return 0;
+}
+
+uint64_t zfs_prop_get_int(zfs_handle_t * dataset, zfs_prop_t prop) {
+	size_t root;
+	switch(prop) {
+		case ZFS_PROP_KEYSTATUS:
+			if(!encryption_root(dataset->idx, root))
+				return ZFS_KEYSTATUS_NONE;
+			return (root / config().root_every) % 2 ? ZFS_KEYSTATUS_AVAILABLE : ZFS_KEYSTATUS_UNAVAILABLE;
+		default:
+			return 0;
+	}
+}
+
+
+static int add_userprop(nvlist_t * props, const char * name, const char * value, const char * source) {
+	nvlist_t * prop{};
+	quickscope_wrapper prop_deleter{[&] { nvlist_free(prop); }};
+	TRY_NVL("allocate property", nvlist_alloc(&prop, NV_UNIQUE_NAME, 0));
+	TRY_NVL("add property value", nvlist_add_string(prop, "value", value));
+	TRY_NVL("add property source", nvlist_add_string(prop, "source", source));
+	TRY_NVL("add property", nvlist_add_nvlist(props, name, prop));
+	return 0;
+}
+
+/// Inherited by the whole encryption root, like zfs-tpm*-change-key leaves them
+nvlist_t * zfs_get_user_props(zfs_handle_t * dataset) {
+	if(dataset->user_props)
+		return dataset->user_props;
+
+	nvlist_t * props{};
+	if(nvlist_alloc(&props, NV_UNIQUE_NAME, 0))
+		return nullptr;
+	quickscope_wrapper props_deleter{[&] { nvlist_free(props); }};
+
+	size_t root;
+	if(encryption_root(dataset->idx, root))
+		if(auto kind = (root / config().root_every) % 3; kind != 2) {
+			char source[ZFS_MAX_DATASET_NAME_LEN];
+			ancestor_name(dataset, root, source);
+			char key[2 + 8 + 1];
+			snprintf(key, sizeof(key), "0x%zX", 0x81000000 + root % 0x800000);
+			if(add_userprop(props, PROPNAME_BACKEND, kind ? "TPM1.X" : "TPM2", source) || add_userprop(props, PROPNAME_KEY, kind ? "00:00" : key, source))
+				return nullptr;
+		}
+
+	return dataset->user_props = std::exchange(props, nullptr);
+}
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include <initializer_list>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../main.hpp"
+#include "../parse.hpp"
+#include "../tpm1x.hpp"
+#include "../tpm2.hpp"
+
+
+/// Count every allocation in the process; glibc's malloc() et al. are reachable under these names, so we can stand in front of them
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t nmemb, size_t size);
+extern "C" void * __libc_realloc(void * ptr, size_t size);
+extern "C" void __libc_free(void * ptr);
+
+static size_t allocations;
+
+extern "C" void * malloc(size_t size) noexcept {
+	return ++allocations, __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t nmemb, size_t size) noexcept {
+	return ++allocations, __libc_calloc(nmemb, size);
+}
+
+extern "C" void * realloc(void * ptr, size_t size) noexcept {
+	return ++allocations, __libc_realloc(ptr, size);
+}
+
+/// glibc's own calls realloc() internally, which we wouldn't see
+extern "C" void * reallocarray(void * ptr, size_t nmemb, size_t size) noexcept {
+	size_t bytes;
+	if(__builtin_mul_overflow(nmemb, size, &bytes))
+		return errno = ENOMEM, nullptr;
+	return realloc(ptr, bytes);
+}
+
+extern "C" void free(void * ptr) noexcept {
+	__libc_free(ptr);
+}
+
+
+static uint64_t now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+
+/// The parsers all tokenise in-place, so input is copied into a scratch buffer for each run; the copy is timed too, but never allocates.
+/// The first run is checked for errors, the rest are just timed
+template <class F>
+static int bench(const char * name, const char * input, size_t iterations, F && func) {
+	auto input_len = strlen(input) + 1;
+	auto scratch   = TRY_PTR("allocate scratch buffer", static_cast<char *>(malloc(input_len)));
+	quickscope_wrapper scratch_deleter{[&] { free(scratch); }};
+
+	memcpy(scratch, input, input_len);
+	if(auto err = func(scratch))
+		return fprintf(stderr, "%s: failed on %s\n", name, input), err;
+
+	auto start_allocations = allocations;
+	auto start             = now_ns();
+	for(size_t i = 0; i < iterations; ++i) {
+		memcpy(scratch, input, input_len);
+		func(scratch);
+	}
+	auto duration = now_ns() - start;
+
+	printf("%-32s %5zu B %10.1f ns/op %6.2f allocs/op\n", name, input_len - 1, static_cast<double>(duration) / iterations,
+	       static_cast<double>(allocations - start_allocations) / iterations);
+	return 0;
+}
+
+
+/// Upper-case, as we write them
+static char * hex(char * buf, const uint8_t * data, size_t len) {
+	for(size_t i = 0; i < len; ++i)
+		buf += sprintf(buf, "%02" PRIX8 "", data[i]);
+	return buf;
+}
+
+/// `parent:sealed`, as zfs-tpm1x-change-key writes it
+static void tpm1x_handle_prop(char * buf, const uint8_t * parent, size_t parent_len, const uint8_t * sealed, size_t sealed_len) {
+	auto cur = hex(buf, parent, parent_len);
+	*cur++   = ':';
+	*hex(cur, sealed, sealed_len) = '\0';
+}
+
+
+/// A sealed object like tpm2_seal() makes, with the wrapping key and a policy digest in it
+static tpm2_sealed sample_sealed() {
+	tpm2_sealed sealed{};
+	sealed.primary   = tpm2_primary::rsa;
+	sealed.priv.size = 222;
+	for(size_t i = 0; i < sealed.priv.size; ++i)
+		sealed.priv.buffer[i] = i * 37;
+
+	auto && area                                  = sealed.pub.publicArea;
+	area.type                                     = TPM2_ALG_KEYEDHASH;
+	area.nameAlg                                  = TPM2_ALG_SHA256;
+	area.objectAttributes                         = TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT;
+	area.authPolicy.size                          = 32;
+	area.parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_NULL;
+	area.unique.keyedHash.size                    = 32;
+	for(uint8_t i = 0; i < 32; ++i)
+		area.authPolicy.buffer[i] = i, area.unique.keyedHash.buffer[i] = ~i;
+	return sealed;
+}
+
+
+int main(int argc, char ** argv) {
+	size_t iterations = 100'000;
+	return do_bare_main_nolibz(
+	    argc, argv, "n:", "[-n iterations]", "",
+	    [&](auto) {
+		    if(!parse_uint(optarg, iterations) || (!iterations && (errno = EINVAL)))
+			    return fprintf(stderr, "-n %s: %s\n", optarg, strerror(errno)), __LINE__;
+		    return 0;
+	    },
+	    [&] {
+		    if(*(argv + optind))
+			    return fprintf(stderr, "Usage: %s [-hV] [-n iterations]\n", argv[0]), __LINE__;
+
+
+		    /// Worst cases: every hash bank with every PCR spelled out, every TPM1.X PCR in reverse (each one inserted at the front),
+		    /// and TPM1.X blobs for a 2048-bit parent key and a sealed object of the same order (~3.5 KB of hex altogether)
+		    static const char * const banks[]{"sha1", "sha256", "sha384", "sha512", "sm3_256", "sha3_256", "sha3_384", "sha3_512"};
+		    char all_banks[sizeof(banks) / sizeof(*banks) * (1 + 8 + 24 * 3)], *cur = all_banks;
+		    for(auto bank : banks) {
+			    cur += sprintf(cur, "%s%s", cur == all_banks ? "" : "+", bank);
+			    for(uint8_t pcr = 0; pcr < 24; ++pcr)
+				    cur += sprintf(cur, "%c%" PRIu8 "", pcr ? ',' : ':', pcr);
+		    }
+
+		    char tpm1x_pcrs_rev[230 * 4], *pcrs_cur = tpm1x_pcrs_rev;
+		    for(int pcr = 229; pcr >= 0; --pcr)
+			    pcrs_cur += sprintf(pcrs_cur, "%s%d", pcr == 229 ? "" : ",", pcr);
+
+		    uint8_t noise[1024];
+		    for(size_t i = 0; i < sizeof(noise); ++i)
+			    noise[i] = i * 37 + 11;
+		    char tpm1x_typical[(559 + 313) * 2 + 1 + 1], tpm1x_large[(1024 + 750) * 2 + 1 + 1];
+		    tpm1x_handle_prop(tpm1x_typical, noise, 559, noise + 100, 313);
+		    tpm1x_handle_prop(tpm1x_large, noise, 1024, noise + 200, 750);
+
+
+		    /// Property values as tpm2_unparse_prop() writes them; round-tripping them through tpm2_parse_prop() must be lossless
+		    auto sealed = sample_sealed();
+		    TPML_PCR_SELECTION pcrs{};
+		    char * blob_prop{};
+		    char * blob_prop_all_banks{};
+		    char * reprop{};
+		    quickscope_wrapper props_deleter{[&] { free(blob_prop), free(blob_prop_all_banks), free(reprop); }};
+		    TRY_MAIN(tpm2_unparse_prop(sealed, pcrs, &blob_prop));
+		    {
+			    auto all_banks_dup = TRY_PTR("copy PCR list", strdup(all_banks));
+			    quickscope_wrapper all_banks_dup_deleter{[&] { free(all_banks_dup); }};
+			    TRY_MAIN(tpm2_parse_pcrs(all_banks_dup, pcrs));
+		    }
+		    TRY_MAIN(tpm2_unparse_prop(sealed, pcrs, &blob_prop_all_banks));
+
+		    for(auto prop : {blob_prop, blob_prop_all_banks}) {
+			    auto prop_dup = TRY_PTR("copy property", strdup(prop));
+			    quickscope_wrapper prop_dup_deleter{[&] { free(prop_dup); }};
+
+			    tpm2_sealed resealed;
+			    TPML_PCR_SELECTION repcrs{};
+			    TRY_MAIN(tpm2_parse_prop("bench", prop_dup, resealed, &repcrs));
+			    free(reprop), reprop = nullptr;
+			    TRY_MAIN(tpm2_unparse_prop(resealed, repcrs, &reprop));
+			    if(strcmp(prop, reprop))
+				    return fprintf(stderr, "Round-trip mismatch:\n  %s\n  %s\n", prop, reprop), __LINE__;
+		    }
+
+		    for(auto handle_s : {tpm1x_typical, tpm1x_large}) {
+			    auto handle_s_dup = TRY_PTR("copy handle", strdup(handle_s));
+			    quickscope_wrapper handle_s_dup_deleter{[&] { free(handle_s_dup); }};
+
+			    tpm1x_handle handle{};
+			    TRY_MAIN(tpm1x_parse_handle("bench", handle_s_dup, handle));
+			    auto rehandle_s = TRY_PTR("allocate handle", static_cast<char *>(malloc(strlen(handle_s) + 1)));
+			    quickscope_wrapper rehandle_s_deleter{[&] { free(rehandle_s); }};
+			    tpm1x_handle_prop(rehandle_s, handle.parent_key_blob, handle.parent_key_blob_len, handle.sealed_object_blob, handle.sealed_object_blob_len);
+			    if(strcmp(handle_s, rehandle_s))
+				    return fprintf(stderr, "Round-trip mismatch:\n  %s\n  %s\n", handle_s, rehandle_s), __LINE__;
+		    }
+
+
+		    /// Known answer: PolicyGetDigest after tpm2_policypcr -l sha256:7 with a zeroed PCR 7, in a fresh trial session
+		    {
+			    char zeroed_pcr7[] = "sha256:7=0000000000000000000000000000000000000000000000000000000000000000";
+			    static const uint8_t trial_digest[]{0x8b, 0x56, 0x82, 0xd8, 0x1b, 0x29, 0x43, 0x5d, 0x08, 0xd7, 0x92, 0x78, 0x15, 0x06, 0x11, 0xdc,
+			                                        0x7e, 0x59, 0x23, 0xb2, 0xfe, 0xfc, 0xce, 0x68, 0x4a, 0x09, 0x57, 0x7b, 0x40, 0x13, 0x0a, 0x8b};
+			    TPML_PCR_SELECTION pcrs{};
+			    tpm2_pcr_values expected{};
+			    TPM2B_DIGEST policy_digest{};
+			    TRY_MAIN(tpm2_parse_pcrs(zeroed_pcr7, pcrs, &expected));
+			    TRY_MAIN(tpm2_pcr_policy(pcrs, expected, policy_digest));
+			    if(policy_digest.size != sizeof(trial_digest) || memcmp(policy_digest.buffer, trial_digest, sizeof(trial_digest)))
+				    return fprintf(stderr, "tpm2_pcr_policy(sha256:7): doesn't match the trial session digest\n"), __LINE__;
+		    }
+
+		    [[maybe_unused]] static volatile uint64_t sink;
+		    TRY_MAIN(bench("parse_uint<uint32_t>", "0x81000001", iterations, [&](char * input) {
+			    uint32_t out;
+			    auto ok = parse_uint(input, out);
+			    sink    = out;
+			    return ok ? 0 : __LINE__;
+		    }));
+		    TRY_MAIN(bench("parse_uint<uint64_t>", "18446744073709551615", iterations, [&](char * input) {
+			    uint64_t out;
+			    auto ok = parse_uint(input, out);
+			    sink    = out;
+			    return ok ? 0 : __LINE__;
+		    }));
+
+		    TRY_MAIN(bench("tpm2_parse_pcrs", "sha256:7", iterations, [&](char * input) {
+			    TPML_PCR_SELECTION out{};
+			    return tpm2_parse_pcrs(input, out);
+		    }));
+		    TRY_MAIN(bench("tpm2_parse_pcrs (8 banks)", all_banks, iterations, [&](char * input) {
+			    TPML_PCR_SELECTION out{};
+			    return tpm2_parse_pcrs(input, out);
+		    }));
+
+		    TRY_MAIN(bench("tpm2_parse_prop (handle)", "0x81000001;sha256:7", iterations, [&](char * input) {
+			    tpm2_sealed out;
+			    TPML_PCR_SELECTION out_pcrs{};
+			    return tpm2_parse_prop("bench", input, out, &out_pcrs);
+		    }));
+		    TRY_MAIN(bench("tpm2_parse_prop (blobs)", blob_prop, iterations, [&](char * input) {
+			    tpm2_sealed out;
+			    TPML_PCR_SELECTION out_pcrs{};
+			    return tpm2_parse_prop("bench", input, out, &out_pcrs);
+		    }));
+		    TRY_MAIN(bench("tpm2_parse_prop (blobs, 8 banks)", blob_prop_all_banks, iterations, [&](char * input) {
+			    tpm2_sealed out;
+			    TPML_PCR_SELECTION out_pcrs{};
+			    return tpm2_parse_prop("bench", input, out, &out_pcrs);
+		    }));
+
+		    TRY_MAIN(bench("tpm2_unparse_prop (blobs)", "", iterations, [&](char *) {
+			    char * out{};
+			    auto err = tpm2_unparse_prop(sealed, TPML_PCR_SELECTION{}, &out);
+			    return free(out), err;
+		    }));
+		    TRY_MAIN(bench("tpm2_unparse_prop (blobs, 8 banks)", "", iterations, [&](char *) {
+			    char * out{};
+			    auto err = tpm2_unparse_prop(sealed, pcrs, &out);
+			    return free(out), err;
+		    }));
+
+		    TRY_MAIN(bench("tpm1x_parse_handle", tpm1x_typical, iterations, [&](char * input) {
+			    tpm1x_handle out{};
+			    return tpm1x_parse_handle("bench", input, out);
+		    }));
+		    TRY_MAIN(bench("tpm1x_parse_handle (large)", tpm1x_large, iterations, [&](char * input) {
+			    tpm1x_handle out{};
+			    return tpm1x_parse_handle("bench", input, out);
+		    }));
+
+		    TRY_MAIN(bench("tpm1x_parse_pcrs", "0,7", iterations, [&](char * input) {
+			    uint32_t * out{};
+			    size_t out_len{};
+			    auto err = tpm1x_parse_pcrs(input, out, out_len);
+			    return free(out), err;
+		    }));
+		    TRY_MAIN(bench("tpm1x_parse_pcrs (229..0)", tpm1x_pcrs_rev, iterations, [&](char * input) {
+			    uint32_t * out{};
+			    size_t out_len{};
+			    auto err = tpm1x_parse_pcrs(input, out, out_len);
+			    return free(out), err;
+		    }));
+
+		    return 0;
+	    });
+}
@@ -13,9 +13,9 @@ zfs-tpm-list -H "$DSET" | while read -r _ backend keystatus coherent; do
 	}
 
 	case "$backend" in
-		TPM1.X) unlock='zfs-tpm1x-load-key'; deps='trousers.service' ;;
-		TPM2)   unlock='zfs-tpm2-load-key';  deps=                   ;;
-		*)      unlock=;                     deps=                   ;;
+		TPM1.X) unlock='zfs-tpm1x-load-key'; deps='trousers.service'; flags=   ;;
+		TPM2)   unlock='zfs-tpm2-load-key';  deps=;                   flags=-C ;;
+		*)      unlock=;                     deps=;                   flags=   ;;
 	esac
 
 	command -v "$unlock" >/dev/null || {
@@ -28,7 +28,9 @@ zfs-tpm-list -H "$DSET" | while read -r _ backend keystatus coherent; do
 
 	# shellcheck disable=2016
 	[ -z "$TZPFMS_PASSPHRASE_HELPER" ] && export TZPFMS_PASSPHRASE_HELPER='exec systemd-ask-password --id="tzpfms:$2" "$1:"'
-	exec "$unlock" "$DSET"
+	# All instances are started at once: let one of them unseal everything over one TPM connection
+	# shellcheck disable=2086
+	exec "$unlock" $flags "$DSET"
 done
 
 # Dataset doesn't exist, fall through
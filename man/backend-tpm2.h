@@ -2,12 +2,19 @@
 .
 .Sh TPM2 back-end configuration
 .Ss Environment variables
-.Bl -tag -compact -width "TSS2_LOG"
+.Bl -tag -compact -width "TZPFMSD_SOCKET"
 .It Ev TSS2_LOG
 Any of:
 .Sy NONE , ERROR , WARNING , INFO , DEBUG , TRACE .
 Default:
 .Sy WARNING .
+.It Ev TZPFMSD_SOCKET
+Where to look for
+.Xr tzpfmsd 8 ;
+if it's not listening there, the TPM is used directly.
+Set to empty to always use the TPM directly.
+Default:
+.Pa /run/tzpfms/tzpfmsd.sock .
 .El
 .
 .Ss TPM selection
@@ -24,6 +31,17 @@ then
 will be tried, in order
 .Pq see Xr ESYS_CONTEXT 3 .
 .
+.Ss Primary key cache
+Creating the primary key sealed objects are created under can take seconds;
+the first time it's created, it's also saved to
+.Pa /run/tzpfms/primary- Ns Ar SHA-256-of-template Ns Pa .ctx
+and loaded from there afterward.
+The TPM refuses to load it after it's reset or the owner hierarchy is cleared, in which case it's just created anew.
+Creating it needs the owner hierarchy's authorisation, so, if there is a passphrase set on it,
+the first unseal of a sealed object stored in the property
+.Pq cf. Nm zfs-tpm2-change-key Fl N
+after every boot prompts for it.
+.
 .Ss See also
 The tpm2-tss git repository at
 .Lk https:/\&/github.com/tpm2-software/tpm2-tss
@@ -33,4 +33,98 @@ a diagnostic is issued and the normal prompt is used as fall-back.
 If it fails for any other reason, the prompting is aborted.
 .
 TZPFMS_PASSPHRASE_HELPER_MAN{}
+.
+.It Ev TZPFMS_PASSPHRASE_COPROCESS
+If set and nonempty, it's run via
+.Pa /bin/ Ns Nm sh Fl c
+once, on the first prompt, and answers that and every later one, taking precedence over
+.Ev TZPFMS_PASSPHRASE_HELPER .
+This saves starting a process per prompt when setting passphrases, retrying, or operating on many datasets.
+.Pp
+Its standard input and output streams are both the same
+.Dv AF_UNIX
+stream socket.
+Each request is the four helper arguments above, each as a native-endian 32-bit length followed by that many bytes.
+The response is the passphrase, likewise, used as-is; a length of
+.Sy 0xFFFFFFFF
+refuses the prompt, aborting it.
+The socket is closed at exit, and the coprocess should then exit;
+if it's still running a second later, it's sent
+.Dv SIGTERM ,
+and, if it's still running a second after that,
+.Dv SIGKILL .
+.Pp
+If the coprocess doesn't exist
+.Pq the shell exits with Sy 127 ,
+a diagnostic is issued and
+.Ev TZPFMS_PASSPHRASE_HELPER
+or the normal prompt is used as fall-back.
+If it exits or hangs up for any other reason, the prompting is aborted.
+.
+.It Ev TZPFMS_PASSPHRASE_CACHE
+If set to a number of seconds, passphrases for existing TPM objects
+.Pq sealed keys, hierarchies, the SRK
+that worked are kept in the user keyring
+.Pq Xr keyrings 7
+for that long, as
+.Li user
+keys named
+.Li tzpfms: Ns Ar what-for .
+Before prompting, the one for the same object is tried, once;
+if the TPM rejects it as wrong, it's dropped from the cache.
+Each success resets the timeout.
+.Pp
+A wrong cached passphrase counts towards the TPM's dictionary attack lock-out, like a wrong one typed in,
+so one object's passphrase is never tried for another.
+Clear the cache with
+.Nm keyctl Cm purge Fl p Li user tzpfms: .
+Linux only.
+.
+.It Ev TZPFMS_KEY_CACHE
+If set to a number of seconds, unsealed wrapping keys are kept in the user keyring for that long, as
+.Li user
+keys named
+.Li tzpfms-key: Ns Ar dataset Ns Li \&: Ns Ar SHA-256 of sealed object ,
+and the
+.Nm load-key
+programs use them instead of the TPM.
+The sealed object is the TPM1.X blobs, or the TPM2 object's name, not its handle, since persistent handles get reused;
+reading a persistent object's name takes a TPM round-trip, but if all keys are cached and sealed in blobs, the TPM isn't touched at all.
+A cached key is checked first
+.Pq with a no-op key load ;
+if the dataset doesn't take it, it's invalidated and the key is unsealed by the TPM instead.
+Each unseal resets the timeout.
+The
+.Nm change-key
+and
+.Nm clear-key
+programs invalidate all of the dataset's cached keys, whether or not
+.Ev TZPFMS_KEY_CACHE
+is set for them.
+.Pp
+The wrapping keys are then only as safe as the user keyring
+.Pq usually root's .
+Linux only.
+.
+.It Ev TZPFMS_TRACE
+If set and nonempty, a JSON object is appended to this file, one per line, for each timed phase
+.Pq TPM and TSS calls, the passphrase helper and coprocess, Xr libzfs 3 No and Xr libzfs_core 3 calls :
+.Bd -literal -compact -offset Ds
+{"pid":1234,"phase":"Esys_Unseal","start_ns":5816029837,"duration_ns":41739005,
+ "tpm_round_trips":1,"tpm_command_bytes":59,"tpm_response_bytes":55,"tpm_pcr_reads":0}
+.Ed
+.Li start_ns
+is on the
+.Dv CLOCK_MONOTONIC
+clock; the
+.Li tpm_*
+counters are the TPM2 commands (and their sizes, and how many of them were
+.Li TPM2_PCR_Read )
+sent during the phase, and always
+.Sy 0
+for TPM1.X.
+Each in-process TPM2 unseal is a
+.Li tpm2_unseal
+phase.
+Phases nest, and the file may be shared by many processes.
 .El
@@ -0,0 +1,70 @@
+.\" SPDX-License-Identifier: MIT
+.
+.Dd
+.Dt TZPFMSD 8
+.Os
+.
+.Sh NAME
+.Nm tzpfmsd
+.Nd keep a TPM2 context warm for tzpfms
+.Sh SYNOPSIS
+.Nm
+.Op Fl t Ar idle-timeout
+.
+.Sh DESCRIPTION
+Connects to the TPM, starts it, and opens an HMAC session once, then serves
+.Xr zfs-tpm2-change-key 8 ,
+.Xr zfs-tpm2-load-key 8 ,
+and
+.Xr zfs-tpm2-clear-key 8
+over a
+.Dv SOCK_SEQPACKET
+socket, so that an unlock only costs the TPM commands actually needed to unseal the key.
+The PCR policy session and the primary key are likewise started on first use and kept.
+.Pp
+Those binaries use
+.Nm
+whenever it's listening, and fall back to doing the work themselves otherwise.
+Only processes with the same user ID as
+.Nm
+are served, one at a time;
+a client that isn't greeted within three seconds
+.Pq because Nm No is serving another, maybe one sitting at a prompt, or its socket is up but it isn't
+also does the work itself.
+.Pp
+Errors are written to the client's standard error stream, and passphrase prompts are forwarded to the client,
+which answers them as it would without
+.Nm
+.Pq including with Ev TZPFMS_PASSPHRASE_HELPER .
+After each request, the owner hierarchy passphrase, if any, is forgotten.
+.Pp
+.Xr zfs-tpm-list 8
+doesn't talk to the TPM, and the TPM1.X back-end already goes through
+.Xr tcsd 8 ,
+so neither is served.
+.Pp
+If started by
+.Xr systemd.socket 5
+.Pq cf. Pa tzpfmsd.socket ,
+the socket is inherited; otherwise it's created at
+.Ev TZPFMSD_SOCKET ,
+or
+.Pa /run/tzpfms/tzpfmsd.sock .
+.
+.Sh OPTIONS
+.Bl -tag -compact -width "-t idle-timeout"
+.It Fl t Ar idle-timeout
+Exit after no client connected for
+.Ar idle-timeout
+seconds.
+Socket activation will start
+.Nm
+again on the next connection.
+Default:
+.Sy 0 ,
+never exit.
+.El
+.
+#include "backend-tpm2.h"
+.
+#include "common.h"
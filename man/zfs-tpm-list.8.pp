@@ -13,6 +13,7 @@
 .Op Fl r Ns \&| Ns Fl d Ar depth
 .Op Fl a Ns \&| Ns Fl b Ar back-end
 .Op Fl u Ns \&| Ns Fl l
+.Op Fl j Ar jobs
 .Oo Ar filesystem Ns \&| Ns Ar volume Oc Ns …
 .
 .Sh DESCRIPTION
@@ -80,6 +81,23 @@ List only encryption roots with the specified
 List only encryption roots whose keys are unavailable.
 .It Fl l
 List only encryption roots whose keys are available.
+.Pp
+.It Fl j Ar jobs
+Walk the datasets on up to
+.Ar jobs
+threads, each with its own
+.Xr libzfs 3
+handle: every pool
+.Pq or specified dataset
+and each of its direct children's subtrees are listed separately,
+then printed in the same order as without
+.Fl j .
+Worth it on systems with many pools or large trees, where walking them one by one dominates.
+Output is only produced once everything's been walked, even with
+.Fl H .
+Defaults to
+.Sy 0
+(everything on the one thread).
 .El
 .
 .Sh EXAMPLES
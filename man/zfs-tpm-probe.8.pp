@@ -0,0 +1,94 @@
+.\" SPDX-License-Identifier: MIT
+.
+.Dd
+.Dt ZFS-TPM-PROBE 8
+.Os
+.
+.Sh NAME
+.Nm zfs-tpm-probe
+.Nd measure TPM command latencies
+.Sh SYNOPSIS
+.Nm
+.Op Fl n Ar iterations
+.Op Fl b Ar back-end
+.
+.Sh DESCRIPTION
+Runs the commands the
+.Nm tzpfms
+suite uses
+.Ar iterations
+times each, and prints their latencies
+.Pq minimum, median, 95th percentile, and maximum, in milliseconds
+per back-end.
+Firmware and discrete TPMs differ wildly here,
+so this is the thing to look at when picking
+.Fl G
+and
+.Fl N
+for
+.Xr zfs-tpm2-change-key 8 ,
+or when budgeting for how long unlocking will take at boot.
+.Pp
+For
+.Sy TPM2 ,
+these are
+.Li StartAuthSession ,
+.Li CreatePrimary
+for both primary key templates
+.Pq if the TPM can't make an ECC one, that's noted and the rest are still timed ,
+.Li Create
+and
+.Li Load
+of a sealed object like
+.Xr zfs-tpm2-change-key 8
+makes,
+.Li Unseal ,
+.Li EvictControl
+to persist it and evict it again,
+.Li PCR_Read
+of PCRs 0-7 in each allocated bank, and
+.Li GetRandom .
+The primary key cache isn't used.
+.Pp
+For
+.Sy TPM1.X ,
+these are opening a context and loading the SRK,
+.Li TPM_GetRandom ,
+.Li TPM_PcrRead ,
+.Li Key_CreateKey
+and
+.Li Key_LoadKey
+of a sealant key,
+.Li Data_Seal ,
+and
+.Li Data_Unseal .
+.Pp
+Only successful commands are counted.
+Every
+.Sy TPM2
+iteration writes the TPM's non-volatile memory twice, so don't go overboard with
+.Fl n .
+.
+.Sh OPTIONS
+.Bl -tag -compact -width "-n iterations"
+.It Fl n Ar iterations
+Run each command this many times.
+Default: 10.
+.It Fl b Ar back-end
+Only probe this back-end,
+.Sy TPM2
+or
+.Sy TPM1.X .
+Otherwise, both are probed, and it's not an error for one of them to be unavailable.
+.El
+.
+#include "passphrase.h"
+.
+#include "backend-tpm2.h"
+.
+#include "backend-tpm1x.h"
+.
+#include "common.h"
+.
+.Sh SEE ALSO
+.Xr tpm2_getcap 1
@@ -10,7 +10,8 @@
 .Sh SYNOPSIS
 .Nm
 .Op Fl n
-.Ar dataset
+.Op Fl j Ar jobs
+.Fl a Ns \&| Ns Oo Fl r Oc Ar dataset Ns …
 .
 .Sh DESCRIPTION
 After verifying
@@ -25,6 +26,11 @@ will unseal the key and load it into
 The user is first prompted for the SRK passphrase, set when taking ownership, if not "well-known" (all zeroes);
 then for the additional passphrase, set when creating the key, if one was set.
 .Pp
+If more than one encryption root is to be unlocked, all keys are unsealed over the same TPM context with the SRK loaded once,
+and a summary is printed at the end, like
+.Nm zfs Cm load-key Fl a
+does.
+.Pp
 See
 .Xr zfs-tpm1x-change-key 8
 for a detailed description.
@@ -37,6 +43,23 @@ Equivalent to
 .Nm zfs Cm load-key Ns 's
 .Fl n
 option.
+.It Fl r
+Load keys for all
+.Sy TPM1.X Ns -back-ended
+encryption roots with unavailable keys at or under each
+.Ar dataset .
+.It Fl a
+Load keys for all
+.Sy TPM1.X Ns -back-ended
+encryption roots with unavailable keys on the system.
+.It Fl j Ar jobs
+Load the keys on up to
+.Ar jobs
+threads while the next ones are being unsealed, instead of one after another.
+Unsealing (and prompting) always happens in order, on one thread.
+Defaults to
+.Sy 0
+(everything on the one thread).
 .El
 .
 #include "passphrase.h"
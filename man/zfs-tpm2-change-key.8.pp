@@ -11,10 +11,13 @@
 .Nm
 .Op Fl b Ar backup-file
 .Oo
-.Fl P Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Oc Ns …
+.Fl P Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Ns Oo Ns Cm \&, Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Ns Oo Ns Cm \&, Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Oc Ns … Oc Ns …
 .Op Fl A
 .Oc
-.Ar dataset
+.Op Fl G Cm rsa Ns \&| Ns Cm ecc
+.Op Fl N
+.Op Fl j Ar jobs
+.Fl a Ns \&| Ns Oo Fl r Oc Ar dataset Ns …
 .
 .Sh DESCRIPTION
 To normalise
@@ -38,12 +41,17 @@ was previously encrypted with
 .Nm tzpfms
 and the
 .Sy TPM2
-back-end was used, the previous key will be freed from the TPM.
+back-end was used, the previous key will be freed from the TPM once the new one has replaced it;
+if the key can't be changed, the previous one is left, and the properties point at it again.
 Otherwise, or in case of an error, data required for manual intervention will be printed to the standard error stream.
+.Xr zfs-tpm2-gc 8
+can also free persistent objects left behind this way.
 .Pp
 Next, a new wrapping key is generated on the TPM, optionally backed up
 .Pq see Sx OPTIONS ,
-and sealed to a persistent object on the TPM under the owner hierarchy;
+and sealed to a persistent object on the TPM
+.Pq or, with Fl N , to an object stored in the property
+under the owner hierarchy;
 if there is a passphrase set on the owner hierarchy, the user is prompted for it;
 the user is always prompted for an optional passphrase to protect the sealed object with.
 .Pp
@@ -53,7 +61,7 @@ The following properties are set on
 .It
 .Li xyz.nabijaczleweli:tzpfms.backend Ns = Ns Sy TPM2
 .It
-.Li xyz.nabijaczleweli:tzpfms.key Ns = Ns Ar persistent-object-ID Ns Op Cm ;\& Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Oc Ns …
+.Li xyz.nabijaczleweli:tzpfms.key Ns = Ns Ar persistent-object-ID Ns \&| Ns Ar private-blob Ns Cm \&: Ns Ar public-blob Ns Op Cm ;\& Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Oc Ns … Ns Op Cm ;ecc
 .El
 .Pp
 .Li tzpfms.backend
@@ -64,10 +72,16 @@ tools
 .Pq namely Xr zfs-tpm2-change-key 8 , Xr zfs-tpm2-load-key 8 , and Xr zfs-tpm2-clear-key 8 .
 .Pp
 .Li tzpfms.key
-is an integer representing the sealed object, optionally followed by a semicolon and PCR list as specified with
+is an integer representing the sealed object
+.Pq or, with Fl N , the object itself ,
+optionally followed by a semicolon and PCR list as specified with
 .Fl P ,
 normalised to be
-.Nm tpm-tools Ns -toolchain-compatible ;
+.Nm tpm-tools Ns -toolchain-compatible ,
+and by
+.Qq Li ;ecc
+if the object was created under an ECC primary key
+.Pq see Fl G ;
 if needed, it can be passed to
 .Nm tpm2_unseal Fl c Ev ${tzpfms.key Ns Cm %% Ns Li ;* Ns Ev }\&
 with
@@ -76,6 +90,9 @@ or
 .Fl p Qq Li pcr:\& Ns Ev ${tzpfms.key Ns Cm # Ns Li *; Ns Ev }\& ,
 as the case may be, or equivalent, for back-up
 .Pq see Sx OPTIONS .
+Objects stored in the property can likewise be un-hexed and loaded with
+.Nm tpm2_load Fl r Ar private Fl u Ar public
+under the same primary key first.
 If you have a sealed key you can access with that or equivalent tool and set both of these properties, it will funxion seamlessly.
 .Pp
 Finally, the equivalent of
@@ -84,6 +101,12 @@ is performed with the new key.
 If an error occurred, best effort is made to clean up the persistent object and properties,
 or to issue a note for manual intervention into the standard error stream.
 .Pp
+If more than one encryption root is to be rotated, the primary key is only created once,
+the PCRs are only read once,
+and all new keys are sealed over the same TPM connection and sessions;
+a summary is printed at the end.
+An error with one encryption root doesn't stop the others.
+.Pp
 A final verification should be made by running
 .Nm zfs-tpm2-load-key Fl n Ar dataset .
 If that command succeeds, all is well,
@@ -97,10 +120,27 @@ can be used to free the TPM persistent object and go back to using a passphrase.
 .
 .Sh OPTIONS
 .Bl -tag -compact -width "-b backup-file"
+.It Fl r
+Change keys for all
+.Sy TPM2 Ns -back-ended
+encryption roots with available keys at or under each
+.Ar dataset .
+.It Fl a
+Change keys for all
+.Sy TPM2 Ns -back-ended
+encryption roots with available keys on the system.
+.It Fl j Ar jobs
+Change the keys on up to
+.Ar jobs
+threads while the next ones are being sealed, instead of one after another.
+Sealing (and prompting) always happens in order, on one thread.
+.Pp
+.
 .It Fl b Ar backup-file
 Save a back-up of the key to
 .Ar backup-file ,
 which must not exist beforehand.
+Only valid for a single encryption root.
 This back-up
 .Em must
 be stored securely, off-site.
@@ -108,7 +148,7 @@ In case of a catastrophic event, the key can be loaded by running
 .Dl Nm zfs Cm load-key Ar dataset Li < Ar backup-file
 .Pp
 .
-.It Fl P Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Ns Cm \&, Ns Ar PCR Oc Ns … Oc Ns …
+.It Fl P Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Ns Oo Ns Cm \&, Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Oc Ns … Ns Oo Cm + Ns Ar algorithm Ns Cm \&: Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Ns Oo Ns Cm \&, Ns Ar PCR Ns Oo Cm = Ns Ar value Oc Oc Ns … Oc Ns …
 Bind the key to space- or comma-separated
 .Ar PCR Ns s
 within their corresponding hashing
@@ -136,6 +176,16 @@ or
 .Qq Sy sha3-512 ,
 and must be supported by the TPM.
 .Pp
+Each
+.Ar PCR
+may also be given the
+.Ar value
+it's expected to have, in hex, as long as the
+.Ar algorithm Ns 's
+digest; then they all must be.
+The wrapping key is then sealed to those values instead of the current ones, and the policy is computed without asking the TPM,
+so a key can be sealed ahead of time for the next boot, with a new kernel or firmware whose measurements are known, say.
+.Pp
 .
 .It Fl A
 With
@@ -148,6 +198,30 @@ with the PCR policy \(em the wrapping key can be unsealed
 passphraseless with the right PCRs
 .Em or
 with the passphrase, and this is usually not the intent.
+.
+.It Fl G Cm rsa Ns \&| Ns Cm ecc
+Create the sealed object under an RSA 2048-bit
+.Pq the default
+or ECC NIST P-256 primary key in the owner hierarchy.
+Generating the RSA primary key can take seconds on slow firmware TPMs; the ECC one is usually much faster.
+.Xr zfs-tpm-probe 8
+times both.
+Non-default choices are recorded in the
+.Li xyz.nabijaczleweli:tzpfms.key
+property, as
+.Qq Li ;ecc .
+.
+.It Fl N
+Don't persist the sealed object on the TPM, and store it in the
+.Li xyz.nabijaczleweli:tzpfms.key
+property instead, as hex-encoded private and public parts
+.Pq the contents of Nm tpm2_create Fl r No and Fl u ;
+it's loaded under the primary key each time it's unsealed.
+That primary key has to be created anew after every boot, the first time anything is unsealed
+.Pq see Sx Primary key cache ;
+if there is a passphrase set on the owner hierarchy, that unseal prompts for it.
+TPMs usually only have space for a handful of persistent objects, so this is the only way to have more than a handful of datasets on one;
+persisting is also a comparatively slow NV write.
 .El
 .
 #include "passphrase.h"
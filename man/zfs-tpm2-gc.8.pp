@@ -0,0 +1,75 @@
+.\" SPDX-License-Identifier: MIT
+.
+.Dd
+.Dt ZFS-TPM2-GC 8
+.Os
+.
+.Sh NAME
+.Nm zfs-tpm2-gc
+.Nd free TPM2 persistent objects no dataset uses
+.Sh SYNOPSIS
+.Nm
+.Op Fl n Ns \&| Ns Fl f
+.Op Ar handle Ns …
+.
+.Sh DESCRIPTION
+Collects the persistent object IDs from the
+.Li xyz.nabijaczleweli:tzpfms.key
+properties of all datasets, then lists every other persistent object in the owner hierarchy that looks like a sealed object
+.Pq a keyed-hash object with no scheme and nothing but the fixed-TPM, fixed-parent, and user-with-auth attributes .
+If any
+.Sy TPM2 Ns -back-ended
+dataset's property can't be parsed, nothing is freed.
+Datasets with the property but a different
+.Pq or no
+.Li xyz.nabijaczleweli:tzpfms.backend
+keep the persistent object it names, too.
+.Pp
+By default, nothing is freed.
+With
+.Ar handle Ns s ,
+only those are freed, if they're in the list;
+with
+.Fl f ,
+all of them are.
+.Pp
+This cleans up after
+.Xr zfs-tpm2-change-key 8
+and
+.Xr zfs-tpm2-clear-key 8
+runs that were interrupted, or that couldn't free the previous object,
+since TPMs usually only have space for a handful of persistent objects.
+.Pp
+The TPM doesn't record what created an object, so anything that looks like a sealed object is fair game;
+this includes ones made with
+.Nm tpm2_create
+and persisted with
+.Nm tpm2_evictcontrol ,
+and ones used by datasets in pools that aren't imported.
+Look over the list before freeing anything.
+.Pp
+.Nm
+waits for running
+.Xr zfs-tpm2-change-key 8 Ns s ,
+which persist the object before setting the property, to finish, and they wait for it
+.Pq via Pa /run/tzpfms/tpm2-gc.lock .
+If it can't be locked, nothing is freed, and only listing the objects succeeds.
+.
+.Sh OPTIONS
+.Bl -tag -compact -width "-n"
+.It Fl n
+Only list the objects that would be freed.
+This is the default.
+.It Fl f
+Free all of them.
+.El
+.
+#include "passphrase.h"
+.
+#include "backend-tpm2.h"
+.
+#include "common.h"
+.
+.Sh SEE ALSO
+.Xr tpm2_getcap 1 ,
+.Xr tpm2_evictcontrol 1
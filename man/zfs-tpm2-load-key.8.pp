@@ -10,7 +10,9 @@
 .Sh SYNOPSIS
 .Nm
 .Op Fl n
-.Ar dataset
+.Op Fl j Ar jobs
+.Op Fl C
+.Fl a Ns \&| Ns Oo Fl r Oc Ar dataset Ns …
 .
 .Sh DESCRIPTION
 After verifying
@@ -23,6 +25,15 @@ unseals the key and loads it into
 .Ar dataset .
 .Pp
 The user is prompted for the additional passphrase, set when creating the key, if one was set.
+If the sealed object is stored in the property
+.Pq cf. Nm zfs-tpm2-change-key Fl N
+and the primary key it's loaded under isn't cached yet, as on the first unseal after every boot,
+the user is also prompted for the owner hierarchy's passphrase, if there is one.
+.Pp
+If more than one encryption root is to be unlocked, all keys are unsealed over the same TPM connection and sessions,
+and a summary is printed at the end, like
+.Nm zfs Cm load-key Fl a
+does.
 .Pp
 See
 .Xr zfs-tpm2-change-key 8
@@ -36,6 +47,41 @@ Equivalent to
 .Nm zfs Cm load-key Ns 's
 .Fl n
 option.
+.Pp
+.It Fl r
+Load keys for all
+.Sy TPM2 Ns -back-ended
+encryption roots with unavailable keys at or under each
+.Ar dataset .
+.It Fl a
+Load keys for all
+.Sy TPM2 Ns -back-ended
+encryption roots with unavailable keys on the system.
+.It Fl j Ar jobs
+Load the keys on up to
+.Ar jobs
+threads while the next ones are being unsealed, instead of one after another.
+Unsealing (and prompting) always happens in order, on one thread.
+Defaults to
+.Sy 0
+(everything on the one thread).
+.It Fl C
+Coalesce with other instances started with
+.Fl C
+at the same time: the first one to take the lock on
+.Pa /run/tzpfms/tpm2-load-key.lock
+becomes the leader, and the rest hand their encryption roots to it over
+.Pa /run/tzpfms/tpm2-load-key.sock
+and return its verdict, so the TPM is only opened once.
+Messages about each follower's dataset go to the follower's standard output and error streams,
+but passphrases are prompted for by the leader.
+The leader waits for new followers for a quarter of a second after it's done.
+.Pp
+This is used by the
+.Xr zfs-mount-generator 8
+integration, since every
+.Sy zfs-load-key@ Ns Ar dataset Ns Sy .service
+is started in parallel.
 .El
 .
 #include "passphrase.h"
@@ -0,0 +1,247 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include <algorithm>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+
+#include "../fd.hpp"
+#include "../main.hpp"
+#include "../parse.hpp"
+#include "../tzpfmsd.hpp"
+
+
+/// sd_listen_fds(3)
+#define SD_LISTEN_FDS_START 3
+
+
+/// The client currently being served, for prompts
+static int client = -1;
+
+
+/// Either take the socket from systemd, or make it ourselves
+static int tzpfmsd_listen(int & listener) {
+	if(auto pid = getenv("LISTEN_PID"), fds = getenv("LISTEN_FDS"); pid && fds) {
+		pid_t listen_pid;
+		unsigned listen_fds;
+		if(parse_uint(pid, listen_pid) && listen_pid == getpid() && parse_uint(fds, listen_fds)) {
+			unsetenv("LISTEN_PID"), unsetenv("LISTEN_FDS"), unsetenv("LISTEN_FDNAMES");
+			if(listen_fds != 1)
+				return fprintf(stderr, "Need exactly one socket, got %u.\n", listen_fds), __LINE__;
+
+			listener = SD_LISTEN_FDS_START;
+			TRY("set CLOEXEC on socket", fcntl(listener, F_SETFD, FD_CLOEXEC));
+			return 0;
+		}
+	}
+
+
+	auto path = getenv("TZPFMSD_SOCKET") ?: TZPFMSD_SOCKET;
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if(!*path || strlen(path) >= sizeof(addr.sun_path))
+		return fprintf(stderr, "Socket path \"%s\" empty or too long.\n", path), __LINE__;
+	strcpy(addr.sun_path, path);
+
+	if(auto slash = strrchr(addr.sun_path, '/'); slash && slash != addr.sun_path) {
+		*slash = '\0';
+		if(mkdir(addr.sun_path, 0700) == -1 && errno != EEXIST)
+			TRY("create socket directory", -1);
+		*slash = '/';
+	}
+
+	listener = TRY("create socket", socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+	unlink(addr.sun_path);  // stale, since we're not socket-activated
+	TRY("bind socket", bind(listener, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)));
+	TRY("restrict socket", chmod(addr.sun_path, 0600));
+	TRY("listen on socket", listen(listener, SOMAXCONN));
+	return 0;
+}
+
+
+/// passphrase_forwarder: ask the client to prompt and send the result back
+static int prompt_client(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
+	tzpfmsd_reply rep{};
+	rep.kind   = tzpfmsd_reply_kind::prompt;
+	rep.again  = again;
+	rep.newkey = newkey;
+	strncpy(rep.whom, whom, sizeof(rep.whom) - 1);
+	TRY("send prompt to client", send(client, &rep, sizeof(rep), MSG_NOSIGNAL));
+
+	tzpfmsd_passphrase pass{};
+	quickscope_wrapper pass_deleter{[&] { explicit_bzero(&pass, sizeof(pass)); }};
+	if(TRY("read passphrase from client", recv(client, &pass, sizeof(pass), 0)) != sizeof(pass))
+		return fprintf(stderr, "Client hung up or sent malformed passphrase.\n"), __LINE__;
+	TRY_MAIN(pass.err);
+	if(pass.len > sizeof(pass.passphrase))
+		return fprintf(stderr, "Client sent malformed passphrase.\n"), __LINE__;
+
+	len_out = pass.len;
+	buf     = nullptr;
+	if(len_out) {
+		buf = TRY_PTR("allocate passphrase", static_cast<uint8_t *>(malloc(len_out)));
+		memcpy(buf, pass.passphrase, len_out);
+	}
+	return 0;
+}
+
+
+/// Serve client until it hangs up; errors in the requests themselves go to the client
+static int serve(tpm2_conn & tpm2) {
+	/// A client is a batch (one zfs-tpm2-change-key run, say), so each one reads the PCRs and persistent objects anew
+	tpm2_pcr_policies pcr_policies{};
+	tpm2_persistent_objects persistent_objects{};
+	tpm2.pcr_policies       = &pcr_policies;
+	tpm2.persistent_objects = &persistent_objects;
+	quickscope_wrapper batch_deleter{[&] {
+		tpm2_persistent_objects_close(tpm2.ctx, persistent_objects);
+		tpm2.pcr_policies = nullptr, tpm2.persistent_objects = nullptr;
+	}};
+
+	for(;;) {
+		tzpfmsd_request req{};
+		quickscope_wrapper req_deleter{[&] { explicit_bzero(&req, sizeof(req)); }};
+
+		iovec iov{&req, sizeof(req)};
+		alignas(cmsghdr) char cmsg_buf[CMSG_SPACE(sizeof(int))]{};
+		msghdr msg{};
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+
+		auto rd = TRY("read request", recvmsg(client, &msg, MSG_CMSG_CLOEXEC));
+		if(!rd)
+			return 0;
+
+		int client_err = -1;
+		if(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(&client_err, CMSG_DATA(cmsg), sizeof(client_err));
+		quickscope_wrapper client_err_deleter{[&] {
+			if(client_err != -1)
+				close(client_err);
+		}};
+		/// The PCR selection is walked (by tpm2_pcr_policies_find() and tpm2_read_pcrs_digest()) before anything marshals it
+		if(rd != sizeof(req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || client_err == -1 || req.data_len > sizeof(req.data) ||
+		   req.pcr_policy.size > sizeof(req.pcr_policy.buffer) || (req.sealed.primary != tpm2_primary::rsa && req.sealed.primary != tpm2_primary::ecc) ||
+		   req.pcrs.count > sizeof(req.pcrs.pcrSelections) / sizeof(*req.pcrs.pcrSelections) ||
+		   std::any_of(req.pcrs.pcrSelections, req.pcrs.pcrSelections + req.pcrs.count, [](auto && sel) { return sel.sizeofSelect > sizeof(sel.pcrSelect); }))
+			return fprintf(stderr, "Malformed request.\n"), __LINE__;
+		req.dataset[sizeof(req.dataset) - 1] = '\0';
+
+
+		tzpfmsd_reply rep{};
+		quickscope_wrapper rep_deleter{[&] { explicit_bzero(&rep, sizeof(rep)); }};
+		rep.kind = tzpfmsd_reply_kind::done;
+		{
+			/// Everything we'd normally print goes to the client instead
+			fflush(stderr);
+			auto stderr_saved = TRY("dup() stderr", dup(2));
+			quickscope_wrapper stderr_saved_deleter{[=] { close(stderr_saved); }};
+			TRY("dup2() onto stderr", dup2(client_err, 2));
+			quickscope_wrapper stderr_restorer{[=] {
+				fflush(stderr);
+				dup2(stderr_saved, 2);
+			}};
+
+			switch(req.op) {
+				case tzpfmsd_op::generate_rand:
+					rep.err = tpm2_generate_rand(tpm2, rep.data, req.data_len);
+					break;
+				case tzpfmsd_op::seal: {
+					/// A policy for expected PCR values is only good for this request; the client's remembering it
+					tpm2_pcr_policies expected{};
+					auto batch = tpm2.pcr_policies;
+					quickscope_wrapper batch_restorer{[&] { tpm2.pcr_policies = batch; }};
+					if(req.pcr_policy.size)
+						tpm2_pcr_policies_add(tpm2.pcr_policies = &expected, req.pcrs, req.pcr_policy);
+
+					rep.sealed.primary = req.sealed.primary;
+					rep.err            = tpm2_seal(req.dataset, tpm2, rep.sealed, req.persistent, req.pcrs, req.allow_PCR_or_pass, req.data, req.data_len);
+				}
+					break;
+				case tzpfmsd_op::unseal:
+					rep.err = tpm2_unseal(req.dataset, tpm2, req.sealed, req.pcrs, rep.data, req.data_len);
+					break;
+				case tzpfmsd_op::free_persistent:
+					rep.err = tpm2_free_persistent(tpm2, req.sealed.handle);
+					break;
+				case tzpfmsd_op::sealed_name: {
+					TPM2B_NAME name{};
+					if(!(rep.err = tpm2_sealed_name(&tpm2, req.sealed, name)))
+						memcpy(rep.data, &name, sizeof(name));
+				}
+					break;
+				case tzpfmsd_op::hello:
+					break;
+				default:
+					rep.err = (fprintf(stderr, "Unknown tzpfmsd request %d.\n", static_cast<int>(req.op)), __LINE__);
+			}
+
+			/// Don't let the next client use this one's owner passphrase
+			const TPM2B_AUTH no_auth{};
+			Esys_TR_SetAuth(tpm2.ctx, ESYS_TR_RH_OWNER, &no_auth);
+		}
+
+		TRY("send reply", send(client, &rep, sizeof(rep), MSG_NOSIGNAL));
+	}
+}
+
+
+int main(int argc, char ** argv) {
+	unsigned idle_timeout{};
+	/// Never touches libzfs, so it can come up before the zfs module does
+	return do_bare_main_nolibz(
+	    argc, argv, "t:", "[-t idle-timeout]", "",
+	    [&](auto) {
+		    if(!parse_uint(optarg, idle_timeout) || (idle_timeout > INT_MAX / 1000 && (errno = ERANGE)))
+			    return fprintf(stderr, "-t %s: %s\n", optarg, strerror(errno)), __LINE__;
+		    return 0;
+	    },
+	    [&] {
+		    int listener;
+		    TRY_MAIN(tzpfmsd_listen(listener));
+		    quickscope_wrapper listener_deleter{[=] { close(listener); }};
+
+		    signal(SIGPIPE, SIG_IGN);
+		    passphrase_forwarder = prompt_client;
+
+		    /// The context, HMAC session, policy session, and primary key stay up for as long as we do
+		    return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
+			    tpm2_conn tpm2{-1, tpm2_ctx, tpm2_session, ESYS_TR_NONE, {ESYS_TR_NONE, ESYS_TR_NONE}, nullptr, nullptr};
+			    quickscope_wrapper tpm2_deleter{[&] { tpm2_conn_flush(tpm2); }};
+
+			    for(;;) {
+				    pollfd pfd{listener, POLLIN, 0};
+				    if(!TRY("wait for clients", poll(&pfd, 1, idle_timeout ? static_cast<int>(idle_timeout * 1000) : -1)))
+					    return 0;  // Idle for long enough; socket activation will bring us back up when needed
+
+				    if((client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) == -1) {
+					    if(errno == EINTR || errno == ECONNABORTED)
+						    continue;
+					    TRY("accept client", -1);
+				    }
+				    quickscope_wrapper client_deleter{[&] { close(std::exchange(client, -1)); }};
+
+				    ucred cred{};
+				    socklen_t cred_len = sizeof(cred);
+				    TRY("get client credentials", getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len));
+				    if(cred.uid != geteuid()) {
+					    fprintf(stderr, "Rejecting client PID %ld with UID %ld.\n", static_cast<long>(cred.pid), static_cast<long>(cred.uid));
+					    continue;
+				    }
+
+				    serve(tpm2);
+			    }
+		    });
+	    });
+}
@@ -3,9 +3,11 @@
 
 #include "../main.hpp"
 #include "../parse.hpp"
+#include "../pipeline.hpp"
 #include "../zfs.hpp"
 
 #include <algorithm>
+#include <atomic>
 
 
 #define TZPFMS_BACKEND_MAX_LEN 16
@@ -23,7 +25,7 @@ struct output_line {
 	static const char * const coherent_display[2];
 
 
-	char name[ZFS_MAX_DATASET_NAME_LEN + 1];
+	size_t name;  // into the names arena; unused with -H
 	char backend[TZPFMS_BACKEND_MAX_LEN + 1];
 	bool key_available : 1;
 	bool coherent : 1;
@@ -40,18 +42,108 @@ const char * const output_line::key_available_display[2]{"unavailable", key_avai
 const char * const output_line::coherent_display[2]{"no", "yes"};
 
 
+/// Both buffers grow geometrically, and names are packed back-to-back instead of taking ZFS_MAX_DATASET_NAME_LEN each
+struct output_lines {
+	output_line * lines;
+	size_t lines_len, lines_cap;
+	char * names;
+	size_t names_len, names_cap;
+
+	int push(const char * name, output_line line) {
+		auto name_len = strlen(name) + 1;
+		if(this->names_len + name_len > this->names_cap) {
+			this->names_cap = std::max(this->names_cap ? this->names_cap * 2 : 4096, this->names_len + name_len);
+			this->names     = TRY_PTR("allocate name buffer", reinterpret_cast<char *>(realloc(this->names, this->names_cap)));
+		}
+		line.name = this->names_len;
+		memcpy(this->names + this->names_len, name, name_len);
+		this->names_len += name_len;
+
+		if(this->lines_len == this->lines_cap)
+			this->lines = TRY_PTR("allocate line buffer", reinterpret_cast<output_line *>(reallocarray(
+			                                                  this->lines, this->lines_cap = this->lines_cap ? this->lines_cap * 2 : 64, sizeof(output_line))));
+		this->lines[this->lines_len++] = line;
+		return 0;
+	}
+};
+
+/// With -j, each top-level dataset and each of their children's subtrees is listed separately (and in parallel);
+/// concatenating them in this order gives the same order as listing them in one go
+struct list_unit {
+	char name[ZFS_MAX_DATASET_NAME_LEN];
+	size_t maxdepth;  // SIZE_MAX for unlimited
+	output_lines out;
+};
+
+
+/// Split the datasets for_all_datasets() would list into list_units: the top-level datasets themselves, then their children with one less depth
+static int split_units(libzfs_handle_t * libz, char ** datasets, size_t maxdepth, list_unit *& units, size_t & units_len) {
+	size_t units_cap{};
+	auto add_unit = [&](const char * name, size_t unit_maxdepth) {
+		if(units_len == units_cap)
+			units = TRY_PTR("allocate output buffer",
+			                reinterpret_cast<list_unit *>(reallocarray(units, units_cap = units_cap ? units_cap * 2 : 16, sizeof(list_unit))));
+		memset(&units[units_len], 0, sizeof(list_unit));
+		strncpy(units[units_len].name, name, sizeof(list_unit::name) - 1);
+		units[units_len++].maxdepth = unit_maxdepth;
+		return 0;
+	};
+
+	struct top_data {
+		decltype(add_unit) & add;
+		size_t maxdepth;
+	};
+	auto top = [](zfs_handle_t * dataset, void * data_p) {
+		auto & data = *static_cast<top_data *>(data_p);
+		quickscope_wrapper dataset_deleter{[&] { zfs_close(dataset); }};
+		TRY_MAIN(data.add(zfs_get_name(dataset), 0));
+		if(!data.maxdepth)
+			return 0;
+
+		return zfs_iter_filesystems(
+		    dataset,
+		    [](zfs_handle_t * child, void * data_p) {
+			    auto & data = *static_cast<top_data *>(data_p);
+			    quickscope_wrapper child_deleter{[&] { zfs_close(child); }};
+			    return data.add(zfs_get_name(child), data.maxdepth == SIZE_MAX ? SIZE_MAX : data.maxdepth - 1);
+		    },
+		    data_p);
+	};
+
+	/// Same depth defaults as for_all_datasets()
+	if(!*datasets) {
+		top_data data{add_unit, (maxdepth == MAXDEPTH_UNSET) ? SIZE_MAX : maxdepth};
+		switch(auto err = zfs_iter_root(libz, top, &data)) {
+			case -1:
+				TRY("iterate root datasets", err);
+				__builtin_unreachable();
+			default:
+				return err;
+		}
+	} else {
+		top_data data{add_unit, (maxdepth == MAXDEPTH_UNSET) ? 0 : maxdepth};
+		for(; *datasets; ++datasets)
+			if(auto dataset = zfs_open(libz, *datasets, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME))  // else error printed by libzfs; continue, like zfs(8) list
+				TRY_MAIN(top(dataset, &data));
+		return 0;
+	}
+}
+
+
 int main(int argc, char ** argv) {
 	bool human                      = true;
 	bool print_nontzpfms            = false;
 	size_t maxdepth                 = MAXDEPTH_UNSET;
 	const char * backend_restrixion = nullptr;
 	auto key_loadedness_restrixion  = key_loadedness::none;
+	size_t jobs{};
 	return do_bare_main(
-	    argc, argv, "Hrd:ab:ul", "[-H] [-r|-d max] [-a|-b back-end] [-u|-l]", "[filesystem|volume]…",
+	    argc, argv, "Hrd:ab:ulj:", "[-H] [-r|-d max] [-a|-b back-end] [-u|-l] [-j jobs]", "[filesystem|volume]…",
 	    [&](auto arg) {
 		    switch(arg) {
 			    case 'H':
 				    human = false;
+				    setvbuf(stdout, nullptr, _IOLBF, 0);  // rows are streamed as they're found, so they mustn't sit in a full buffer when piped
 				    break;
 			    case 'r':
 				    maxdepth = SIZE_MAX;
@@ -72,16 +164,30 @@ int main(int argc, char ** argv) {
 			    case 'l':
 				    key_loadedness_restrixion = key_loadedness::loaded;
 				    break;
+			    case 'j':
+				    if(!parse_uint(optarg, jobs))
+					    return fprintf(stderr, "-j %s: %s\n", optarg, strerror(errno)), __LINE__;
+				    break;
 		    }
 		    return 0;
 	    },
 	    [&](auto libz) {
-		    output_line * lines{};
-		    size_t lines_len{};
-		    quickscope_wrapper lines_deleter{[&] { free(lines); }};
+		    size_t max_name_len          = 0;
+		    size_t max_backend_len       = 0;
+		    size_t max_key_available_len = 0;
+		    size_t max_coherent_len      = 0;
+		    auto separator               = "\t";
 
+		    auto println = [&](auto name, auto backend, auto key_available, auto coherent) {
+			    printf("%-*s%s%-*s%s%-*s%s%-*s\n",                                         //
+			           static_cast<int>(max_name_len), name, separator,                    //
+			           static_cast<int>(max_backend_len), backend, separator,              //
+			           static_cast<int>(max_key_available_len), key_available, separator,  //
+			           static_cast<int>(max_coherent_len), coherent);
+		    };
 
-		    TRY_MAIN(for_all_datasets(libz, argv + optind, maxdepth, [&](auto dataset) {
+		    /// Only included lines are kept. With -H (and no -j), nothing is aligned or reordered, so lines are printed as we go and into is unused
+		    auto list = [&](output_lines & into, zfs_handle_t * dataset) {
 			    boolean_t dataset_is_root;
 			    TRY("get encryption root", zfs_crypto_get_encryption_root(dataset, &dataset_is_root, nullptr));
 			    if(!dataset_is_root)
@@ -91,24 +197,67 @@ int main(int argc, char ** argv) {
 			    TRY_MAIN(lookup_userprop(dataset, PROPNAME_BACKEND, backend));
 			    TRY_MAIN(lookup_userprop(dataset, PROPNAME_KEY, handle));
 
-			    ++lines_len;
-			    lines = TRY_PTR("allocate line buffer", reinterpret_cast<output_line *>(realloc(lines, sizeof(output_line) * lines_len)));
-
-			    auto & cur_line = lines[lines_len - 1];
-			    strncpy(cur_line.name, zfs_get_name(dataset), ZFS_MAX_DATASET_NAME_LEN);
+			    output_line cur_line{};
 			    strncpy(cur_line.backend, (backend && strlen(backend) <= TZPFMS_BACKEND_MAX_LEN) ? backend : "\0", TZPFMS_BACKEND_MAX_LEN);
 			    // Tristate available/unavailable/none, but it's gonna be either available or unavailable on envryption roots, so
 			    cur_line.key_available = zfs_prop_get_int(dataset, ZFS_PROP_KEYSTATUS) == ZFS_KEYSTATUS_AVAILABLE;
 			    cur_line.coherent      = !!backend == !!handle;
 
-			    return 0;
-		    }));
+			    if(!cur_line.included(print_nontzpfms, backend_restrixion, key_loadedness_restrixion))
+				    return 0;
+			    if(!human && !jobs)
+				    return println(zfs_get_name(dataset), cur_line.backend_display(), output_line::key_available_display[cur_line.key_available],
+				                   output_line::coherent_display[cur_line.coherent]),
+				           0;
+			    return into.push(zfs_get_name(dataset), cur_line);
+		    };
+
+
+		    list_unit * units{};
+		    size_t units_len{};
+		    quickscope_wrapper units_deleter{[&] {
+			    for(size_t i = 0; i < units_len; ++i) {
+				    free(units[i].out.lines);
+				    free(units[i].out.names);
+			    }
+			    free(units);
+		    }};
+		    if(!jobs) {
+			    units_len = 1;
+			    units     = TRY_PTR("allocate output buffer", reinterpret_cast<list_unit *>(calloc(1, sizeof(list_unit))));
+			    TRY_MAIN(for_all_datasets(libz, argv + optind, maxdepth, [&](auto dataset) { return list(units[0].out, dataset); }));
+		    } else
+			    TRY_MAIN(split_units(libz, argv + optind, maxdepth, units, units_len));
+
+		    if(jobs) {
+			    /// libzfs handles aren't thread-safe, so each worker gets its own
+			    auto worker_libz = TRY_PTR("allocate worker libzfs list", reinterpret_cast<libzfs_handle_t **>(calloc(jobs, sizeof(libzfs_handle_t *))));
+			    quickscope_wrapper worker_libz_deleter{[&] {
+				    for(size_t i = 0; i < jobs; ++i)
+					    if(worker_libz[i])
+						    libzfs_fini(worker_libz[i]);
+				    free(worker_libz);
+			    }};
+
+			    std::atomic<int> err{};
+			    TRY_MAIN(pipeline<bool>(
+			        units_len, jobs, [](size_t, bool &) { return 0; },
+			        [&](size_t worker, size_t i, bool &) {
+				        if(auto e = [&] {
+					           if(!worker_libz[worker]) {
+						           worker_libz[worker] = TRY_PTR("initialise libzfs", libzfs_init());
+						           libzfs_print_on_error(worker_libz[worker], B_TRUE);
+					           }
+
+					           char * unit_dataset[]{units[i].name, nullptr};
+					           return for_all_datasets(worker_libz[worker], unit_dataset, units[i].maxdepth, [&](auto dataset) { return list(units[i].out, dataset); });
+				           }())
+					        err = e;
+			        }));
+			    TRY_MAIN(err.load());
+		    }
+
 
-		    size_t max_name_len          = 0;
-		    size_t max_backend_len       = 0;
-		    size_t max_key_available_len = 0;
-		    size_t max_coherent_len      = 0;
-		    auto separator               = "\t";
 		    if(human) {
 			    max_name_len          = strlen("NAME");
 			    max_backend_len       = strlen("BACK-END");
@@ -116,26 +265,20 @@ int main(int argc, char ** argv) {
 			    max_coherent_len      = strlen("COHERENT");
 			    separator             = "  ";
 
-			    for(auto cur = lines; cur != lines + lines_len; ++cur)
-				    if(cur->included(print_nontzpfms, backend_restrixion, key_loadedness_restrixion)) {
-					    max_name_len          = std::max(max_name_len, strlen(cur->name));
+			    for(auto unit = units; unit != units + units_len; ++unit)
+				    for(auto cur = unit->out.lines; cur != unit->out.lines + unit->out.lines_len; ++cur) {
+					    max_name_len          = std::max(max_name_len, strlen(unit->out.names + cur->name));
 					    max_backend_len       = std::max(max_backend_len, strlen(cur->backend_display()));
 					    max_key_available_len = std::max(max_key_available_len, strlen(output_line::key_available_display[cur->key_available]));
 				    }
 		    }
 
-		    auto println = [&](auto name, auto backend, auto key_available, auto coherent) {
-			    printf("%-*s%s%-*s%s%-*s%s%-*s\n",                                         //
-			           static_cast<int>(max_name_len), name, separator,                    //
-			           static_cast<int>(max_backend_len), backend, separator,              //
-			           static_cast<int>(max_key_available_len), key_available, separator,  //
-			           static_cast<int>(max_coherent_len), coherent);
-		    };
 		    if(human)
 			    println("NAME", "BACK-END", "KEYSTATUS", "COHERENT");
-		    for(auto cur = lines; cur != lines + lines_len; ++cur)
-			    if(cur->included(print_nontzpfms, backend_restrixion, key_loadedness_restrixion))
-				    println(cur->name, cur->backend_display(), output_line::key_available_display[cur->key_available], output_line::coherent_display[cur->coherent]);
+		    for(auto unit = units; unit != units + units_len; ++unit)
+			    for(auto cur = unit->out.lines; cur != unit->out.lines + unit->out.lines_len; ++cur)
+				    println(unit->out.names + cur->name, cur->backend_display(), output_line::key_available_display[cur->key_available],
+				            output_line::coherent_display[cur->coherent]);
 
 		    return 0;
 	    });
@@ -0,0 +1,346 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../main.hpp"
+#include "../parse.hpp"
+#include "../tpm1x.hpp"
+#include "../tpm2.hpp"
+
+
+#define WRAPPING_KEY_LEN 32
+
+
+/// Samples are kept per command, in the order commands were first timed, and only for successful calls
+struct latency_table {
+	struct row {
+		char what[32];
+		uint64_t * samples;
+		size_t samples_len;
+	};
+
+	row * rows;
+	size_t rows_len;
+	size_t iterations;
+
+	~latency_table() {
+		for(auto cur = this->rows; cur != this->rows + this->rows_len; ++cur)
+			free(cur->samples);
+		free(this->rows);
+	}
+
+	row * find(const char * what) {
+		for(auto cur = this->rows; cur != this->rows + this->rows_len; ++cur)
+			if(!strcmp(cur->what, what))
+				return cur;
+
+		auto new_rows = reinterpret_cast<row *>(reallocarray(this->rows, this->rows_len + 1, sizeof(row)));
+		if(!new_rows)
+			return nullptr;
+		this->rows = new_rows;
+
+		auto ret = &this->rows[this->rows_len];
+		*ret     = {};
+		strncpy(ret->what, what, sizeof(ret->what) - 1);
+		if(!(ret->samples = reinterpret_cast<uint64_t *>(calloc(this->iterations, sizeof(uint64_t)))))
+			return nullptr;
+		++this->rows_len;
+		return ret;
+	}
+
+	template <class F>
+	auto time(const char * what, F && func) -> decltype(func()) {
+		timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		auto ret = func();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if(!ret)
+			if(auto cur = this->find(what); cur && cur->samples_len < this->iterations)
+				cur->samples[cur->samples_len++] = (end.tv_sec - start.tv_sec) * 1'000'000'000ull + end.tv_nsec - start.tv_nsec;
+		return ret;
+	}
+
+	/// Nearest-rank percentiles, in milliseconds
+	void print(const char * backend) {
+		printf("%s\n%-24s%6s%10s%10s%10s%10s\n", backend, "COMMAND", "N", "MIN", "P50", "P95", "MAX");
+		for(auto cur = this->rows; cur != this->rows + this->rows_len; ++cur) {
+			if(!cur->samples_len)
+				continue;
+			std::sort(cur->samples, cur->samples + cur->samples_len);
+			auto ms = [&](double rank) { return cur->samples[static_cast<size_t>((cur->samples_len - 1) * rank)] / 1'000'000.; };
+			printf("%-24s%6zu%10.2f%10.2f%10.2f%10.2f\n", cur->what, cur->samples_len, ms(0), ms(.5), ms(.95), ms(1));
+		}
+	}
+};
+
+
+static int probe_tpm2(size_t iterations) {
+	latency_table table{nullptr, 0, iterations};
+	return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
+		/// Only the banks the TPM has any PCRs allocated in
+		TPML_PCR_SELECTION banks{};
+		{
+			TPMS_CAPABILITY_DATA * cap{};
+			TPMI_YES_NO more;
+			TRY_TPM2("read PCR banks", Esys_GetCapability(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, TPM2_CAP_PCRS, 0, 1, &more, &cap));
+			quickscope_wrapper cap_deleter{[&] { Esys_Free(cap); }};
+
+			for(auto bank = cap->data.assignedPCR.pcrSelections; bank != cap->data.assignedPCR.pcrSelections + cap->data.assignedPCR.count; ++bank)
+				if(std::any_of(bank->pcrSelect, bank->pcrSelect + bank->sizeofSelect, [](auto b) { return b; })) {
+					auto && into      = banks.pcrSelections[banks.count++];
+					into.hash         = bank->hash;
+					into.sizeofSelect = bank->sizeofSelect;
+					into.pcrSelect[0] = bank->pcrSelect[0];  // PCRs 0-7: as many as one PCR_Read returns
+				}
+		}
+
+		const TPM2B_DATA no_metadata{};
+		const TPML_PCR_SELECTION no_pcrs{};
+		const TPM2B_SENSITIVE_CREATE primary_sens{};
+		auto create_primary = [&](tpm2_primary primary, const char * what, ESYS_TR & handle) {
+			const auto pub = tpm2_primary_template(primary);
+			return try_or_passphrase("create primary encryption key", "TPM2 owner hierarchy", tpm2_ctx, TPM2_RC_BAD_AUTH, ESYS_TR_RH_OWNER, [&] {
+				return table.time(what, [&] {
+					return Esys_CreatePrimary(tpm2_ctx, ESYS_TR_RH_OWNER, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &primary_sens, &pub, &no_metadata, &no_pcrs,
+					                          &handle, nullptr, nullptr, nullptr, nullptr);
+				});
+			});
+		};
+
+		/// Same as tpm2_seal() makes without PCRs or a passphrase
+		TPM2B_SENSITIVE_CREATE secret_sens{};
+		secret_sens.sensitive.data.size = WRAPPING_KEY_LEN;
+		TRY_MAIN(tpm2_generate_rand(tpm2_ctx, secret_sens.sensitive.data.buffer, secret_sens.sensitive.data.size));
+		TPM2B_PUBLIC secret_pub{};
+		secret_pub.publicArea.type                                     = TPM2_ALG_KEYEDHASH;
+		secret_pub.publicArea.nameAlg                                  = TPM2_ALG_SHA256;
+		secret_pub.publicArea.objectAttributes                         = TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT | TPMA_OBJECT_USERWITHAUTH;
+		secret_pub.publicArea.parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_NULL;
+
+
+		/// Not every TPM does ECC P-256; if it can't, say so once and time the rest
+		bool ecc_supported = true;
+		for(size_t i = 0; i < iterations; ++i) {
+			{
+				ESYS_TR session = ESYS_TR_NONE;
+				quickscope_wrapper session_deleter{[&] { Esys_FlushContext(tpm2_ctx, session); }};
+				TRY_TPM2("start session", table.time("StartAuthSession", [&] {
+					return Esys_StartAuthSession(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, nullptr, TPM2_SE_HMAC,
+					                             &tpm2_session_key, TPM2_ALG_SHA256, &session);
+				}));
+			}
+
+			if(ecc_supported) {
+				ESYS_TR primary = ESYS_TR_NONE;
+				quickscope_wrapper primary_deleter{[&] { Esys_FlushContext(tpm2_ctx, primary); }};
+				if(create_primary(tpm2_primary::ecc, "CreatePrimary (ECC)", primary))
+					ecc_supported = false, fprintf(stderr, "ECC primary keys unsupported; not timing them.\n");
+			}
+
+			ESYS_TR primary = ESYS_TR_NONE;
+			quickscope_wrapper primary_deleter{[&] { Esys_FlushContext(tpm2_ctx, primary); }};
+			TRY_MAIN(create_primary(tpm2_primary::rsa, "CreatePrimary (RSA)", primary));
+
+			TPM2B_PRIVATE * priv{};
+			TPM2B_PUBLIC * pub{};
+			quickscope_wrapper sealant_deleter{[&] { Esys_Free(pub), Esys_Free(priv); }};
+			TRY_TPM2("create key seal", table.time("Create", [&] {
+				return Esys_Create(tpm2_ctx, primary, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &secret_sens, &secret_pub, &no_metadata, &no_pcrs, &priv, &pub,
+				                   nullptr, nullptr, nullptr);
+			}));
+
+			ESYS_TR sealed = ESYS_TR_NONE;
+			quickscope_wrapper sealed_deleter{[&] { Esys_FlushContext(tpm2_ctx, sealed); }};
+			TRY_TPM2("load key seal",
+			         table.time("Load", [&] { return Esys_Load(tpm2_ctx, primary, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, priv, pub, &sealed); }));
+
+			{
+				TPM2B_SENSITIVE_DATA * unsealed{};
+				quickscope_wrapper unsealed_deleter{[&] { Esys_Free(unsealed); }};
+				TRY_TPM2("unseal wrapping key",
+				         table.time("Unseal", [&] { return Esys_Unseal(tpm2_ctx, sealed, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &unsealed); }));
+			}
+
+			/// Persist the object and evict it straight away; this is two NV writes
+			{
+				auto lock = tpm2_lock_persistent();
+				quickscope_wrapper lock_deleter{[=] {
+					if(lock != -1)
+						close(lock);
+				}};
+
+				TPMI_DH_PERSISTENT handle;
+				TRY_MAIN(tpm2_find_unused_persistent_non_platform(tpm2_ctx, handle));
+
+				/// Once persisted, it's evicted on the way out whatever happens, so a failed iteration doesn't leak an NV slot
+				ESYS_TR persistent = ESYS_TR_NONE;
+				auto evict         = [&] {
+					ESYS_TR evicted;
+					auto err = Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, persistent, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, 0, &evicted);
+					if(err == TPM2_RC_SUCCESS)
+						persistent = ESYS_TR_NONE;
+					return err;
+				};
+				quickscope_wrapper persistent_deleter{[&] {
+					if(persistent != ESYS_TR_NONE)
+						evict();
+				}};
+				TRY_MAIN(try_or_passphrase("persist key seal", "TPM2 owner hierarchy", tpm2_ctx, TPM2_RC_BAD_AUTH, ESYS_TR_RH_OWNER, [&] {
+					return table.time("EvictControl (persist)", [&] {
+						return Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, sealed, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, handle, &persistent);
+					});
+				}));
+
+				TRY_TPM2("unpersist key seal", table.time("EvictControl (evict)", evict));
+			}
+
+			for(auto bank = banks.pcrSelections; bank != banks.pcrSelections + banks.count; ++bank) {
+				char what[sizeof(latency_table::row::what)];
+				if(auto name = tpm2_hash_alg_name(bank->hash))
+					snprintf(what, sizeof(what), "PCR_Read (%s)", name);
+				else
+					snprintf(what, sizeof(what), "PCR_Read (0x%04" PRIX16 ")", bank->hash);
+
+				TPML_PCR_SELECTION selection{};
+				selection.count            = 1;
+				selection.pcrSelections[0] = *bank;
+
+				UINT32 update_count;
+				TPML_PCR_SELECTION * out_sel{};
+				TPML_DIGEST * out_val{};
+				quickscope_wrapper out_deleter{[&] { Esys_Free(out_val), Esys_Free(out_sel); }};
+				TRY_TPM2("read PCRs", table.time(what, [&] {
+					return Esys_PCR_Read(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &selection, &update_count, &out_sel, &out_val);
+				}));
+			}
+
+			{
+				TPM2B_DIGEST * rand{};
+				quickscope_wrapper rand_deleter{[&] { Esys_Free(rand); }};
+				TRY_TPM2("get random data from TPM",
+				         table.time("GetRandom", [&] { return Esys_GetRandom(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, WRAPPING_KEY_LEN, &rand); }));
+			}
+		}
+
+		table.print("TPM2");
+		return 0;
+	});
+}
+
+
+static int probe_tpm1x(size_t iterations) {
+	latency_table table{nullptr, 0, iterations};
+
+	/// Tspi_Context_Connect() and loading the SRK, and closing it all after
+	for(size_t i = 0; i < iterations; ++i)
+		TRY_MAIN(table.time("session", [] { return with_tpm1x_session([](auto, auto, auto) { return 0; }); }));
+
+	return with_tpm1x_session([&](auto ctx, auto srk, auto srk_policy) {
+		TSS_HTPM tpm_h{};
+		TRY_TPM1X("extract TPM from context", Tspi_Context_GetTpmObject(ctx, &tpm_h));
+
+		for(size_t i = 0; i < iterations; ++i) {
+			uint8_t * wrap_key{};
+			quickscope_wrapper wrap_key_deleter{[&] { Tspi_Context_FreeMemory(ctx, wrap_key); }};
+			TRY_TPM1X("get random data from TPM", table.time("TPM_GetRandom", [&] { return Tspi_TPM_GetRandom(tpm_h, WRAPPING_KEY_LEN, &wrap_key); }));
+
+			{
+				BYTE * val{};
+				uint32_t val_len{};
+				quickscope_wrapper val_deleter{[&] { Tspi_Context_FreeMemory(ctx, val); }};
+				TRY_TPM1X("read PCR 0", table.time("TPM_PcrRead", [&] { return Tspi_TPM_PcrRead(tpm_h, 0, &val_len, &val); }));
+			}
+
+
+			/// Same as zfs-tpm1x-change-key without a passphrase
+			TSS_HOBJECT parent_key{};
+			TRY_TPM1X("prepare sealant key",
+			          Tspi_Context_CreateObject(ctx, TSS_OBJECT_TYPE_RSAKEY, TSS_KEY_SIZE_2048 | TSS_KEY_VOLATILE | TSS_KEY_NOT_MIGRATABLE, &parent_key));
+			quickscope_wrapper parent_key_deleter{[&] {
+				Tspi_Key_UnloadKey(parent_key);
+				Tspi_Context_CloseObject(ctx, parent_key);
+			}};
+
+			TSS_HPOLICY parent_key_policy{};
+			TRY_TPM1X("create sealant key policy", Tspi_Context_CreateObject(ctx, TSS_OBJECT_TYPE_POLICY, TSS_POLICY_USAGE, &parent_key_policy));
+			TRY_TPM1X("assign policy to sealant key", Tspi_Policy_AssignToObject(parent_key_policy, parent_key));
+			quickscope_wrapper parent_key_policy_deleter{[&] {
+				Tspi_Policy_FlushSecret(parent_key_policy);
+				Tspi_Context_CloseObject(ctx, parent_key_policy);
+			}};
+			TRY_TPM1X("assign default sealant key secret",
+			          Tspi_Policy_SetSecret(parent_key_policy, TSS_SECRET_MODE_SHA1, sizeof(parent_key_secret), (BYTE *)parent_key_secret));
+
+			TRY_MAIN(try_policy_or_passphrase("create sealant key (did you take ownership?)", "SRK", srk_policy,
+			                                  [&] { return table.time("Key_CreateKey", [&] { return Tspi_Key_CreateKey(parent_key, srk, 0); }); }));
+			TRY_TPM1X("load sealant key", table.time("Key_LoadKey", [&] { return Tspi_Key_LoadKey(parent_key, srk); }));
+
+
+			TSS_HOBJECT sealed_object{};
+			TSS_HPOLICY sealed_object_policy{};
+			TRY_MAIN(tpm1x_prep_sealed_object(ctx, sealed_object, sealed_object_policy));
+			quickscope_wrapper sealed_object_deleter{[&] {
+				Tspi_Policy_FlushSecret(sealed_object_policy);
+				Tspi_Context_CloseObject(ctx, sealed_object_policy);
+				Tspi_Context_CloseObject(ctx, sealed_object);
+			}};
+
+			TRY_TPM1X("seal wrapping key data",
+			          table.time("Data_Seal", [&] { return Tspi_Data_Seal(sealed_object, parent_key, WRAPPING_KEY_LEN, wrap_key, TSS_HOBJECT{}); }));
+
+			uint8_t * unsealed{};
+			uint32_t unsealed_len{};
+			quickscope_wrapper unsealed_deleter{[&] { Tspi_Context_FreeMemory(ctx, unsealed); }};
+			TRY_TPM1X("unseal wrapping key", table.time("Data_Unseal", [&] { return Tspi_Data_Unseal(sealed_object, parent_key, &unsealed_len, &unsealed); }));
+		}
+
+		table.print("TPM1.X");
+		return 0;
+	});
+}
+
+
+int main(int argc, char ** argv) {
+	size_t iterations               = 10;
+	const char * backend_restrixion = nullptr;
+	return do_bare_main_nolibz(
+	    argc, argv, "n:b:", "[-n iterations] [-b back-end]", "",
+	    [&](auto o) {
+		    switch(o) {
+			    case 'n':
+				    if(!parse_uint(optarg, iterations) || (!iterations && (errno = EINVAL)))
+					    return fprintf(stderr, "-n %s: %s\n", optarg, strerror(errno)), __LINE__;
+				    return 0;
+			    case 'b':
+				    if(strcmp(optarg, "TPM2") && strcmp(optarg, "TPM1.X"))
+					    return fprintf(stderr, "-b %s: unknown back-end (want TPM2 or TPM1.X)\n", optarg), __LINE__;
+				    return backend_restrixion = optarg, 0;
+			    default:
+				    __builtin_unreachable();
+		    }
+	    },
+	    [&] {
+		    if(*(argv + optind))
+			    return fprintf(stderr, "Usage: %s [-hV] [-n iterations] [-b back-end]\n", argv[0]), __LINE__;
+
+		    /// Without -b, a back-end that's not there is fine, so long as the other one is
+		    int tpm2_err{}, tpm1x_err{};
+		    if(!backend_restrixion || !strcmp(backend_restrixion, "TPM2"))
+			    tpm2_err = probe_tpm2(iterations);
+		    if(!backend_restrixion || !strcmp(backend_restrixion, "TPM1.X")) {
+			    if(!backend_restrixion)
+				    putchar('\n');
+			    tpm1x_err = probe_tpm1x(iterations);
+		    }
+
+		    if(backend_restrixion)
+			    return tpm2_err ?: tpm1x_err;
+		    return (tpm2_err && tpm1x_err) ? tpm2_err : 0;
+	    });
+}
@@ -68,7 +68,7 @@ int main(int argc, char ** argv) {
 
 					    BYTE * val{};
 					    uint32_t val_len{};
-					    TRY_TPM1X(buf, Tspi_TPM_PcrRead(tpm_h, pcrs[i], &val_len, &val));
+					    TRY_TPM1X(buf, TRACE("Tspi_TPM_PcrRead", Tspi_TPM_PcrRead(tpm_h, pcrs[i], &val_len, &val)));
 					    quickscope_wrapper bound_pcrs_deleter{[&] { Tspi_Context_FreeMemory(ctx, val); }};
 
 					    snprintf(buf, sizeof(buf), "save PCR %" PRIu32 " value", pcrs[i]);
@@ -120,9 +120,9 @@ int main(int argc, char ** argv) {
 			    }
 
 			    TRY_MAIN(try_policy_or_passphrase("create sealant key (did you take ownership?)", "SRK", srk_policy,
-			                                      [&] { return Tspi_Key_CreateKey(parent_key, srk, 0); }));
+			                                      [&] { return TRACE("Tspi_Key_CreateKey", Tspi_Key_CreateKey(parent_key, srk, 0)); }));
 
-			    TRY_TPM1X("load sealant key", Tspi_Key_LoadKey(parent_key, srk));
+			    TRY_TPM1X("load sealant key", TRACE("Tspi_Key_LoadKey", Tspi_Key_LoadKey(parent_key, srk)));
 
 
 			    TSS_HOBJECT sealed_object{};
@@ -135,7 +135,7 @@ int main(int argc, char ** argv) {
 			    }};
 
 
-			    TRY_TPM1X("seal wrapping key data", Tspi_Data_Seal(sealed_object, parent_key, WRAPPING_KEY_LEN, wrap_key, bound_pcrs));
+			    TRY_TPM1X("seal wrapping key data", TRACE("Tspi_Data_Seal", Tspi_Data_Seal(sealed_object, parent_key, WRAPPING_KEY_LEN, wrap_key, bound_pcrs)));
 
 
 			    uint8_t * parent_key_blob{};
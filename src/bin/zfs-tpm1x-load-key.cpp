@@ -11,7 +11,8 @@
 #include <string.h>
 
 #include "../fd.hpp"
-#include "../main.hpp"
+#include "../main_multi.hpp"
+#include "../parse.hpp"
 #include "../tpm1x.hpp"
 #include "../zfs.hpp"
 
@@ -21,64 +22,126 @@
 
 int main(int argc, char ** argv) {
 	auto noop = false;
-	return do_main(
-	    argc, argv, "n", "[-n]", [&](auto) { noop = true; },
-	    [&](auto dataset) {
+	size_t jobs{};
+	return do_multi_main(
+	    argc, argv, THIS_BACKEND, ZFS_KEYSTATUS_UNAVAILABLE, "nj:", "[-n] [-j jobs]",
+	    [&](auto o) {
+		    switch(o) {
+			    case 'n':
+				    return noop = true, 0;
+			    case 'j':
+				    if(!parse_uint(optarg, jobs))
+					    return fprintf(stderr, "-j %s: %s\n", optarg, strerror(errno)), __LINE__;
+				    return 0;
+			    default:
+				    __builtin_unreachable();
+		    }
+	    },
+	    [&](auto datasets, auto datasets_len) {
 		    /// Vaguely based on tpmUnsealFile(3) from src:tpm-tools.
 
-		    char * handle_s{};
-		    TRY_MAIN(parse_key_props(dataset, THIS_BACKEND, handle_s));
-
-		    tpm1x_handle handle{};
-		    TRY_MAIN(tpm1x_parse_handle(zfs_get_name(dataset), handle_s, handle));
-
+		    auto handles = TRY_PTR("allocate handle list", reinterpret_cast<char **>(calloc(datasets_len, sizeof(char *))));  // nullptr if broken
+		    quickscope_wrapper handles_deleter{[&] { free(handles); }};
+
+		    struct cached_wrap_key {
+			    bool cached;
+			    uint8_t key[WRAPPING_KEY_LEN];
+		    };
+		    auto cached_keys = TRY_PTR("allocate cached key list", reinterpret_cast<cached_wrap_key *>(calloc(datasets_len, sizeof(cached_wrap_key))));
+		    quickscope_wrapper cached_keys_deleter{[&] {
+			    explicit_bzero(cached_keys, datasets_len * sizeof(cached_wrap_key));
+			    free(cached_keys);
+		    }};
+
+		    int err{};
+		    size_t parsed{}, cached{};
+		    for(size_t i = 0; i < datasets_len; ++i)
+			    if(auto e = parse_key_props(datasets[i], THIS_BACKEND, handles[i]))
+				    err = e, handles[i] = nullptr;
+			    else {
+				    ++parsed;
+				    if((cached_keys[i].cached = cached_key(zfs_get_name(datasets[i]), handles[i], strlen(handles[i]), cached_keys[i].key)))
+					    ++cached;
+			    }
 
-		    uint8_t wrap_key[WRAPPING_KEY_LEN]{};
-		    TRY_MAIN(with_tpm1x_session([&](auto ctx, auto srk, auto srk_policy) {
-			    TSS_HOBJECT parent_key{};
-			    TRY_MAIN(try_policy_or_passphrase("load sealant key from blob (did you take ownership?)", "TPM1.X SRK", srk_policy, [&] {
-				    return Tspi_Context_LoadKeyByBlob(ctx, srk, handle.parent_key_blob_len, handle.parent_key_blob, &parent_key);
-			    }));
-			    quickscope_wrapper parent_key_deleter{[&] { Tspi_Key_UnloadKey(parent_key); }};
-
-			    TSS_HPOLICY parent_key_policy{};
-			    TRY_TPM1X("create sealant key policy", Tspi_Context_CreateObject(ctx, TSS_OBJECT_TYPE_POLICY, TSS_POLICY_USAGE, &parent_key_policy));
-			    TRY_TPM1X("assign policy to sealant key", Tspi_Policy_AssignToObject(parent_key_policy, parent_key));
-			    quickscope_wrapper parent_key_policy_deleter{[&] {
-				    Tspi_Policy_FlushSecret(parent_key_policy);
-				    Tspi_Context_CloseObject(ctx, parent_key_policy);
-			    }};
-			    TRY_TPM1X("assign default sealant key secret",
-			              Tspi_Policy_SetSecret(parent_key_policy, TSS_SECRET_MODE_SHA1, sizeof(parent_key_secret), (BYTE *)parent_key_secret));
-
-
-			    TSS_HOBJECT sealed_object{};
-			    TSS_HPOLICY sealed_object_policy{};
-			    TRY_MAIN(tpm1x_prep_sealed_object(ctx, sealed_object, sealed_object_policy));
-
-			    TRY_TPM1X("load sealed object from blob", Tspi_SetAttribData(sealed_object, TSS_TSPATTRIB_ENCDATA_BLOB, TSS_TSPATTRIB_ENCDATABLOB_BLOB,
-			                                                                 handle.sealed_object_blob_len, handle.sealed_object_blob));
-
-			    char what_for[ZFS_MAX_DATASET_NAME_LEN + 20 + 1];
-			    snprintf(what_for, sizeof(what_for), "%s TPM1.X wrapping key", zfs_get_name(dataset));
-
-			    uint8_t * loaded_wrap_key{};
-			    uint32_t loaded_wrap_key_len{};
-			    TRY_MAIN(try_policy_or_passphrase("unseal wrapping key", what_for, parent_key_policy,
-			                                      [&] { return Tspi_Data_Unseal(sealed_object, parent_key, &loaded_wrap_key_len, &loaded_wrap_key); }));
-			    if(loaded_wrap_key_len != sizeof(wrap_key)) {
-				    fprintf(stderr, "Wrong sealed data length (%" PRIu32 " != %zu): ", loaded_wrap_key_len, sizeof(wrap_key));
-				    for(auto i = 0u; i < loaded_wrap_key_len; ++i)
-					    fprintf(stderr, "%02hhX", loaded_wrap_key[i]);
-				    fprintf(stderr, "\n");
+		    auto from_cache = [&](size_t i, uint8_t * wrap_key) {
+			    if(!handles[i])
 				    return __LINE__;
-			    }
+			    return memcpy(wrap_key, cached_keys[i].key, WRAPPING_KEY_LEN), 0;
+		    };
+
+
+		    /// All unseals share the TSS context and the SRK, and happen on this thread (they may prompt); the keys are loaded in parallel with -j.
+		    /// If all keys are cached, the TPM isn't touched at all
+		    size_t loaded{};
+		    if(parsed > cached)
+			    TRY_MAIN(with_tpm1x_session([&](auto ctx, auto srk, auto srk_policy) {
+				    auto unseal = [&](size_t i, uint8_t * wrap_key) {
+					    if(!handles[i] || cached_keys[i].cached)
+						    return from_cache(i, wrap_key);
+
+					    tpm1x_handle handle{};
+					    TRY_MAIN(tpm1x_parse_handle(zfs_get_name(datasets[i]), handles[i], handle));
+
+
+					    TSS_HOBJECT parent_key{};
+					    TRY_MAIN(try_policy_or_passphrase("load sealant key from blob (did you take ownership?)", "TPM1.X SRK", srk_policy, [&] {
+						    return TRACE("Tspi_Context_LoadKeyByBlob",
+						                 Tspi_Context_LoadKeyByBlob(ctx, srk, handle.parent_key_blob_len, handle.parent_key_blob, &parent_key));
+					    }));
+					    quickscope_wrapper parent_key_deleter{[&] { Tspi_Key_UnloadKey(parent_key); }};
+
+					    TSS_HPOLICY parent_key_policy{};
+					    TRY_TPM1X("create sealant key policy", Tspi_Context_CreateObject(ctx, TSS_OBJECT_TYPE_POLICY, TSS_POLICY_USAGE, &parent_key_policy));
+					    TRY_TPM1X("assign policy to sealant key", Tspi_Policy_AssignToObject(parent_key_policy, parent_key));
+					    quickscope_wrapper parent_key_policy_deleter{[&] {
+						    Tspi_Policy_FlushSecret(parent_key_policy);
+						    Tspi_Context_CloseObject(ctx, parent_key_policy);
+					    }};
+					    TRY_TPM1X("assign default sealant key secret",
+					              Tspi_Policy_SetSecret(parent_key_policy, TSS_SECRET_MODE_SHA1, sizeof(parent_key_secret), (BYTE *)parent_key_secret));
+
+
+					    TSS_HOBJECT sealed_object{};
+					    TSS_HPOLICY sealed_object_policy{};
+					    TRY_MAIN(tpm1x_prep_sealed_object(ctx, sealed_object, sealed_object_policy));
+
+					    TRY_TPM1X("load sealed object from blob", Tspi_SetAttribData(sealed_object, TSS_TSPATTRIB_ENCDATA_BLOB, TSS_TSPATTRIB_ENCDATABLOB_BLOB,
+					                                                                 handle.sealed_object_blob_len, handle.sealed_object_blob));
+
+					    char what_for[ZFS_MAX_DATASET_NAME_LEN + 20 + 1];
+					    snprintf(what_for, sizeof(what_for), "%s TPM1.X wrapping key", zfs_get_name(datasets[i]));
+
+					    uint8_t * loaded_wrap_key{};
+					    uint32_t loaded_wrap_key_len{};
+					    quickscope_wrapper loaded_wrap_key_deleter{[&] { Tspi_Context_FreeMemory(ctx, loaded_wrap_key); }};  // Don't pile up over many datasets
+					    TRY_MAIN(try_policy_or_passphrase("unseal wrapping key", what_for, parent_key_policy, [&] {
+						    return TRACE("Tspi_Data_Unseal", Tspi_Data_Unseal(sealed_object, parent_key, &loaded_wrap_key_len, &loaded_wrap_key));
+					    }));
+					    if(loaded_wrap_key_len != WRAPPING_KEY_LEN) {
+						    fprintf(stderr, "Wrong sealed data length (%" PRIu32 " != %d): ", loaded_wrap_key_len, WRAPPING_KEY_LEN);
+						    for(auto j = 0u; j < loaded_wrap_key_len; ++j)
+							    fprintf(stderr, "%02hhX", loaded_wrap_key[j]);
+						    fprintf(stderr, "\n");
+						    return __LINE__;
+					    }
+
+					    memcpy(wrap_key, loaded_wrap_key, WRAPPING_KEY_LEN);
+					    cache_key(zfs_get_name(datasets[i]), handles[i], strlen(handles[i]), wrap_key);
+					    return 0;
+				    };
+
+				    if(auto e = load_keys(datasets, datasets_len, jobs, noop, loaded, unseal))
+					    err = e;
+				    return 0;
+			    }));
+		    else if(parsed)
+			    if(auto e = load_keys(datasets, datasets_len, jobs, noop, loaded, from_cache))
+				    err = e;
 
-			    memcpy(wrap_key, loaded_wrap_key, sizeof(wrap_key));
-			    return 0;
-		    }));
 
-		    TRY_MAIN(load_key(dataset, wrap_key, noop));
-		    return 0;
+		    if(datasets_len != 1)
+			    printf("%zu / %zu key(s) successfully %s\n", loaded, datasets_len, noop ? "verified" : "loaded");
+		    return err;
 	    });
 }
@@ -5,13 +5,14 @@
 // #include <sys/zio_crypt.h>
 #define WRAPPING_KEY_LEN 32
 
+#include <atomic>
 #include <inttypes.h>
 #include <stdio.h>
 
 #include "../fd.hpp"
-#include "../main.hpp"
+#include "../main_multi.hpp"
 #include "../parse.hpp"
-#include "../tpm2.hpp"
+#include "../tzpfmsd.hpp"
 #include "../zfs.hpp"
 
 
@@ -21,23 +22,37 @@
 int main(int argc, char ** argv) {
 	const char * backup{};
 	TPML_PCR_SELECTION pcrs{};
+	tpm2_pcr_values expected_pcrs{};
 	bool allow_PCR_or_pass{};
-	return do_main(
-	    argc, argv, "b:P:A", "[-b backup-file] [-P algorithm:PCR[,PCR]…[+algorithm:PCR[,PCR]…]… [-A]]",
+	tpm2_primary primary{};
+	auto persistent = true;
+	size_t jobs{};
+	return do_multi_main(
+	    argc, argv, THIS_BACKEND, ZFS_KEYSTATUS_AVAILABLE, "b:P:AG:Nj:",
+	    "[-b backup-file] [-P algorithm:PCR[=value][,PCR[=value]]…[+algorithm:PCR[=value][,PCR[=value]]…]… [-A]] [-G rsa|ecc] [-N] [-j jobs]",
 	    [&](auto o) {
 		    switch(o) {
 			    case 'b':
 				    return backup = optarg, 0;
 			    case 'P':
-				    return tpm2_parse_pcrs(optarg, pcrs);
+				    return tpm2_parse_pcrs(optarg, pcrs, &expected_pcrs);
 			    case 'A':
 				    return allow_PCR_or_pass = true, 0;
+			    case 'G':
+				    return tpm2_parse_primary(optarg, primary);
+			    case 'N':
+				    return persistent = false, 0;
+			    case 'j':
+				    if(!parse_uint(optarg, jobs))
+					    return fprintf(stderr, "-j %s: %s\n", optarg, strerror(errno)), __LINE__;
+				    return 0;
 			    default:
 				    __builtin_unreachable();
 		    }
 	    },
-	    [&](auto dataset) {
-		    REQUIRE_KEY_LOADED(dataset);
+	    [&](auto datasets, auto datasets_len) {
+		    if(backup && datasets_len != 1)
+			    return fprintf(stderr, "-b %s: can only back up one key, but there are %zu\n", backup, datasets_len), __LINE__;
 
 
 		    // https://software.intel.com/content/www/us/en/develop/articles/code-sample-protecting-secret-data-and-keys-using-intel-platform-trust-technology.html
@@ -65,52 +80,148 @@ int main(int argc, char ** argv) {
 		    // tpm2_unseal -p session:session3.ctx --object-context=0x81000000
 		    // tpm2_flushcontext session3.ctx; rm session3.ctx
 
-		    return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
-			    TRY_MAIN(verify_backend(dataset, THIS_BACKEND, [&](auto previous_handle_s) {
-				    TPMI_DH_PERSISTENT previous_handle{};
-				    if(tpm2_parse_prop(zfs_get_name(dataset), previous_handle_s, previous_handle, nullptr))
-					    fprintf(stderr, "Couldn't parse previous persistent handle for dataset %s. You might need to run \"tpm2_evictcontrol -c %s\" or equivalent!\n",
-					            zfs_get_name(dataset), previous_handle_s);
-				    else {
-					    if(tpm2_free_persistent(tpm2_ctx, tpm2_session, previous_handle))
+		    struct rotation {
+			    bool sealed_ok;  // if not changed, the sealed object needs to be cleaned up
+			    bool props_set;  // likewise, the props
+			    bool changed;
+			    tpm2_sealed sealed;
+			    char * prop;
+			    char * previous_prop;                // to put back if the key isn't changed after all
+			    TPMI_DH_PERSISTENT previous_handle;  // only freed once the key's changed
+			    uint8_t wrap_key[WRAPPING_KEY_LEN];
+		    };
+		    auto rotations = TRY_PTR("allocate rotation list", reinterpret_cast<rotation *>(calloc(datasets_len, sizeof(rotation))));
+		    quickscope_wrapper rotations_deleter{[&] {
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    free(rotations[i].prop), free(rotations[i].previous_prop);
+			    explicit_bzero(rotations, datasets_len * sizeof(rotation));
+			    free(rotations);
+		    }};
+		    auto on    = TRY_PTR("allocate dataset list", reinterpret_cast<zfs_handle_t **>(calloc(datasets_len, sizeof(zfs_handle_t *))));
+		    auto props = TRY_PTR("allocate property list", reinterpret_cast<const char **>(calloc(datasets_len, sizeof(const char *))));
+		    auto done  = TRY_PTR("allocate property list", reinterpret_cast<bool *>(calloc(datasets_len, sizeof(bool))));
+		    quickscope_wrapper lists_deleter{[&] { free(on), free(props), free(done); }};
+
+		    int err{};
+		    size_t changed{};
+		    TRY_MAIN(with_tpm2_conn([&](auto & tpm2) {
+			    /// The primary is created once for all datasets (the connection keeps it), and the PCR policy digest is computed once per selection
+			    tpm2_pcr_policies pcr_policies{};
+			    tpm2.pcr_policies = &pcr_policies;
+
+			    /// The new objects aren't referenced by anything until the props are set, so zfs-tpm2-gc has to wait until we're done
+			    auto gc_lock = tpm2_lock_gc(false);
+			    quickscope_wrapper gc_lock_deleter{[=] {
+				    if(gc_lock != -1)
+					    close(gc_lock);
+			    }};
+			    if(expected_pcrs.count) {
+				    TPM2B_DIGEST policy_digest{};
+				    TRY_MAIN(tpm2_pcr_policy(pcrs, expected_pcrs, policy_digest));
+				    tpm2_pcr_policies_add(&pcr_policies, pcrs, policy_digest);
+			    }
+
+			    auto seal = [&](size_t i) {
+				    auto dataset = datasets[i];
+				    auto & rot   = rotations[i];
+				    REQUIRE_KEY_LOADED(dataset);
+
+				    /// The previous object still wraps the key until change_key() succeeds, so it's only freed after
+				    TRY_MAIN(verify_backend(dataset, THIS_BACKEND, [&](auto previous_handle_s) {
+					    rot.previous_prop = strdup(previous_handle_s);  // tpm2_parse_prop() tokenises in-place
+
+					    tpm2_sealed previous{};
+					    if(tpm2_parse_prop(zfs_get_name(dataset), previous_handle_s, previous, nullptr))
+						    fprintf(stderr, "Couldn't parse previous persistent handle for dataset %s. You might need to run \"tpm2_evictcontrol -c %s\" or equivalent!\n",
+						            zfs_get_name(dataset), previous_handle_s);
+					    else
+						    rot.previous_handle = previous.handle;
+				    }));
+
+				    TRY_MAIN(tpm2_generate_rand(tpm2, rot.wrap_key, WRAPPING_KEY_LEN));
+				    if(backup)
+					    TRY_MAIN(write_exact(backup, rot.wrap_key, WRAPPING_KEY_LEN, 0400));
+
+				    rot.sealed.primary = primary;
+				    TRY_MAIN(tpm2_seal(zfs_get_name(dataset), tpm2, rot.sealed, persistent, pcrs, allow_PCR_or_pass, rot.wrap_key, WRAPPING_KEY_LEN));
+				    rot.sealed_ok = true;
+
+				    TRY_MAIN(tpm2_unparse_prop(rot.sealed, pcrs, &rot.prop));
+				    return 0;
+			    };
+
+			    /// Sealing (and prompting) happens in order, on this thread
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    if(auto e = seal(i))
+					    err = e;
+
+			    /// All the props are then set in one transaction per pool; the ones that weren't sealed are skipped as already done
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    on[i] = datasets[i], props[i] = rotations[i].prop, done[i] = !rotations[i].prop;
+			    if(auto e = set_key_props(on, datasets_len, THIS_BACKEND, props, done))
+				    err = e;
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    rotations[i].props_set = rotations[i].prop && done[i];
+
+			    /// And the keys are changed in parallel with -j
+			    struct wrap_key_t {
+				    uint8_t key[WRAPPING_KEY_LEN];
+			    };
+			    std::atomic<int> change_err{};
+			    std::atomic<size_t> changed_keys{};
+			    TRY_MAIN(pipeline<wrap_key_t>(
+			        datasets_len, jobs,
+			        [&](size_t i, wrap_key_t & wrap_key) {
+				        if(!rotations[i].props_set)
+					        return 1;
+				        memcpy(wrap_key.key, rotations[i].wrap_key, WRAPPING_KEY_LEN);
+				        return 0;
+			        },
+			        [&](size_t, size_t i, wrap_key_t & wrap_key) {
+				        if(auto e = change_key(zfs_get_name(datasets[i]), wrap_key.key))
+					        change_err = e;
+				        else
+					        rotations[i].changed = true, ++changed_keys;
+			        }));
+			    if(change_err)
+				    err = change_err;
+			    changed = changed_keys;
+
+
+			    /// Free the previous persistent handles of the keys that did change, and the new ones (and props) of those that didn't;
+			    /// here, since neither the connection nor libzfs handles are thread-safe
+			    for(size_t i = 0; i < datasets_len; ++i) {
+				    auto & rot = rotations[i];
+				    if(rot.changed) {
+					    zfs_refresh_properties(datasets[i]);
+					    if(rot.previous_handle && tpm2_free_persistent(tpm2, rot.previous_handle))
 						    fprintf(stderr,
 						            "Couldn't free previous persistent handle for dataset %s. You might need to run \"tpm2_evictcontrol -c 0x%" PRIX32
 						            "\" or equivalent!\n",
-						            zfs_get_name(dataset), previous_handle);
+						            zfs_get_name(datasets[i]), rot.previous_handle);
+					    continue;
 				    }
-			    }));
-
-			    uint8_t wrap_key[WRAPPING_KEY_LEN];
-			    TPMI_DH_PERSISTENT persistent_handle{};
 
-			    TRY_MAIN(tpm2_generate_rand(tpm2_ctx, wrap_key, sizeof(wrap_key)));
-			    if(backup)
-				    TRY_MAIN(write_exact(backup, wrap_key, sizeof(wrap_key), 0400));
-
-			    TRY_MAIN(tpm2_seal(zfs_get_name(dataset), tpm2_ctx, tpm2_session, persistent_handle, tpm2_creation_metadata(zfs_get_name(dataset)), pcrs,
-			                       allow_PCR_or_pass, wrap_key, sizeof(wrap_key)));
-			    bool ok = false;  // Try to free the persistent handle if we're unsuccessful in actually using it later on
-			    quickscope_wrapper persistent_clearer{[&] {
-				    if(!ok && tpm2_free_persistent(tpm2_ctx, tpm2_session, persistent_handle))
+				    if(rot.sealed_ok && rot.sealed.handle && tpm2_free_persistent(tpm2, rot.sealed.handle))
 					    fprintf(stderr, "Couldn't free persistent handle. You might need to run \"tpm2_evictcontrol -c 0x%" PRIX32 "\" or equivalent!\n",
-					            persistent_handle);
-				    if(!ok)
-					    clear_key_props(dataset);
-			    }};
-
-			    {
-				    char * prop{};
-				    TRY_MAIN(tpm2_unparse_prop(persistent_handle, pcrs, &prop));
-				    quickscope_wrapper prop_deleter{[&] { free(prop); }};
-				    TRY_MAIN(set_key_props(dataset, THIS_BACKEND, prop));
+					            rot.sealed.handle);
 			    }
 
-			    TRY_MAIN(change_key(dataset, wrap_key));
-
-			    ok = true;
+			    /// The props of the keys that didn't change go back to the previous object, if there was one, and are cleared otherwise
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    props[i] = rotations[i].previous_prop, done[i] = !rotations[i].props_set || rotations[i].changed || !rotations[i].previous_prop;
+			    set_key_props(on, datasets_len, THIS_BACKEND, props, done);
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    done[i] = !rotations[i].props_set || rotations[i].changed || (rotations[i].previous_prop && done[i]);
+			    clear_key_props(on, datasets_len, done);
 			    return 0;
-		    });
+		    }));
+
+		    if(datasets_len != 1)
+			    printf("%zu / %zu key(s) successfully changed\n", changed, datasets_len);
+		    return err;
 	    },
+	    [](char **, bool &) { return 0; },
 	    [&]() {
 		    if(allow_PCR_or_pass && !pcrs.count)
 			    return __LINE__;
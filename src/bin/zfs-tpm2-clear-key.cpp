@@ -2,16 +2,19 @@
 
 
 #include "../main_clear.hpp"
-#include "../tpm2.hpp"
+#include "../tzpfmsd.hpp"
 
 
 #define THIS_BACKEND "TPM2"
 
 
 int main(int argc, char ** argv) {
-	TPMI_DH_PERSISTENT persistent_handle{};
+	tpm2_sealed sealed{};
 	return do_clear_main(
-	    argc, argv, THIS_BACKEND,
-	    [&](auto dataset, auto persistent_handle_s) { return tpm2_parse_prop(zfs_get_name(dataset), persistent_handle_s, persistent_handle, nullptr); },
-	    [&] { return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) { return tpm2_free_persistent(tpm2_ctx, tpm2_session, persistent_handle); }); });
+	    argc, argv, THIS_BACKEND, [&](auto dataset, auto sealed_s) { return tpm2_parse_prop(zfs_get_name(dataset), sealed_s, sealed, nullptr); },
+	    [&] {
+		    if(!sealed.handle)  // Blobs only live in the property
+			    return 0;
+		    return with_tpm2_conn([&](auto & tpm2) { return tpm2_free_persistent(tpm2, sealed.handle); });
+	    });
 }
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include <libzfs.h>
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../main.hpp"
+#include "../parse.hpp"
+#include "../tpm2.hpp"
+#include "../zfs.hpp"
+
+
+#define THIS_BACKEND "TPM2"
+
+
+int main(int argc, char ** argv) {
+	auto force = false;
+	return do_bare_main(
+	    argc, argv, "nf", "[-n|-f]", "[handle…]",
+	    [&](auto o) {
+		    switch(o) {
+			    case 'n':
+				    return force = false, 0;
+			    case 'f':
+				    return force = true, 0;
+			    default:
+				    __builtin_unreachable();
+		    }
+	    },
+	    [&](auto libz) {
+		    /// Only free what was asked for explicitly: either these handles, or, with -f, every orphan
+		    TPMI_DH_PERSISTENT * requested{};
+		    size_t requested_len{};
+		    quickscope_wrapper requested_deleter{[&] { free(requested); }};
+		    for(auto arg = argv + optind; *arg; ++arg) {
+			    if(!requested)
+				    requested = TRY_PTR("allocate handle list", reinterpret_cast<TPMI_DH_PERSISTENT *>(calloc(argc - optind, sizeof(TPMI_DH_PERSISTENT))));
+			    if(!parse_uint(*arg, requested[requested_len]) || requested[requested_len] < TPM2_PERSISTENT_FIRST ||
+			       requested[requested_len] >= TPM2_PLATFORM_PERSISTENT)
+				    return fprintf(stderr, "Handle %s: not an owner persistent handle.\n", *arg), __LINE__;
+			    ++requested_len;
+		    }
+		    auto evict = force || requested_len;
+
+		    /// No change-key can be between persisting an object and setting the prop pointing at it, and no new handles can be allocated, while we're looking
+		    auto gc_lock = tpm2_lock_gc(true);
+		    quickscope_wrapper gc_lock_deleter{[=] {
+			    if(gc_lock != -1)
+				    close(gc_lock);
+		    }};
+		    if(gc_lock == -1) {
+			    fprintf(stderr, "Couldn't lock " TPM2_PRIMARY_CACHE_DIR "/tpm2-gc.lock: %s\n", strerror(errno));
+			    if(evict)
+				    return fprintf(stderr, "Not freeing anything, since a running zfs-tpm2-change-key's new objects could be.\n"), __LINE__;
+			    fprintf(stderr, "Objects listed could belong to a running zfs-tpm2-change-key.\n");
+		    }
+		    auto lock = tpm2_lock_persistent();
+		    quickscope_wrapper lock_deleter{[=] {
+			    if(lock != -1)
+				    close(lock);
+		    }};
+
+		    TPMI_DH_PERSISTENT * referenced{};
+		    size_t referenced_len{}, referenced_cap{};
+		    quickscope_wrapper referenced_deleter{[&] { free(referenced); }};
+
+		    /// If we can't tell which handle a TPM2 dataset uses, we can't tell any handle is unused.
+		    /// Datasets with a key prop but some other (or no) back-end prop are treated as references too, if the prop parses: a half-cleared dataset
+		    /// or a botched manual edit shouldn't cost the key
+		    char * no_datasets[]{nullptr};
+		    TRY_MAIN(for_all_datasets(libz, no_datasets, MAXDEPTH_UNSET, [&](auto dataset) {
+			    char *backend{}, *handle_s{};
+			    TRY_MAIN(lookup_userprop(dataset, PROPNAME_BACKEND, backend));
+			    TRY_MAIN(lookup_userprop(dataset, PROPNAME_KEY, handle_s));
+			    if(!handle_s)
+				    return 0;
+			    auto ours = backend && !strcmp(backend, THIS_BACKEND);
+
+			    auto handle_s_dup = TRY_PTR("copy handle", strdup(handle_s));
+			    quickscope_wrapper handle_s_dup_deleter{[&] { free(handle_s_dup); }};
+
+			    tpm2_sealed sealed{};
+			    if(ours) {
+				    if(tpm2_parse_prop(zfs_get_name(dataset), handle_s_dup, sealed, nullptr))
+					    return fprintf(stderr, "Not collecting anything.\n"), __LINE__;
+			    } else {  // quietly, since this is usually a TPM1.X blob; only the persistent handle form matters
+				    handle_s_dup[strcspn(handle_s_dup, ";")] = '\0';
+				    if(!parse_uint(handle_s_dup, sealed.handle) || sealed.handle < TPM2_PERSISTENT_FIRST || sealed.handle >= TPM2_PLATFORM_PERSISTENT)
+					    return 0;
+				    fprintf(stderr, "Dataset %s has a %s property, but its %s is %s; keeping 0x%" PRIX32 ".\n", zfs_get_name(dataset), PROPNAME_KEY,
+				            PROPNAME_BACKEND, backend ?: "unset", sealed.handle);
+			    }
+			    if(!sealed.handle)
+				    return 0;
+
+			    if(referenced_len == referenced_cap)
+				    referenced = TRY_PTR("allocate handle list",
+				                         reinterpret_cast<TPMI_DH_PERSISTENT *>(reallocarray(referenced, referenced_cap = referenced_cap ? referenced_cap * 2 : 16,
+				                                                                                sizeof(TPMI_DH_PERSISTENT))));
+			    referenced[referenced_len++] = sealed.handle;
+			    return 0;
+		    }));
+		    qsort(referenced, referenced_len, sizeof(TPMI_DH_PERSISTENT), [](auto l, auto r) {
+			    auto lh = *static_cast<const TPMI_DH_PERSISTENT *>(l), rh = *static_cast<const TPMI_DH_PERSISTENT *>(r);
+			    return (lh > rh) - (lh < rh);
+		    });
+
+
+		    return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
+			    /// Both lists are sorted, so this is a merge; collect first, since evicting while paging would shift the pages
+			    TPMI_DH_PERSISTENT * orphans{};
+			    size_t orphans_len{}, orphans_cap{};
+			    quickscope_wrapper orphans_deleter{[&] { free(orphans); }};
+
+			    int err{};
+			    size_t ref_idx{};
+			    TRY_MAIN(tpm2_for_all_persistent(tpm2_ctx, TPM2_PERSISTENT_FIRST, [&](auto handle) {
+				    while(ref_idx < referenced_len && referenced[ref_idx] < handle)
+					    ++ref_idx;
+				    if(ref_idx < referenced_len && referenced[ref_idx] == handle)
+					    return true;
+
+				    if(orphans_len == orphans_cap) {
+					    auto new_orphans = reinterpret_cast<TPMI_DH_PERSISTENT *>(
+					        reallocarray(orphans, orphans_cap = orphans_cap ? orphans_cap * 2 : 16, sizeof(TPMI_DH_PERSISTENT)));
+					    if(!new_orphans)
+						    return err = (fprintf(stderr, "Couldn't allocate handle list: %s\n", strerror(errno)), __LINE__), false;
+					    orphans = new_orphans;
+				    }
+				    orphans[orphans_len++] = handle;
+				    return true;
+			    }));
+			    TRY_MAIN(err);
+
+
+			    /// Each orphan is looked at, then freed: convert it to an object once for both
+			    tpm2_persistent_objects objects{};
+			    quickscope_wrapper objects_deleter{[&] { tpm2_persistent_objects_close(tpm2_ctx, objects); }};
+			    size_t collected{}, considered{};
+			    for(auto cur = orphans; cur != orphans + orphans_len; ++cur) {
+				    if(requested_len && std::find(requested, requested + requested_len, *cur) == requested + requested_len)
+					    continue;
+				    ++considered;
+
+				    bool looks_sealed;
+				    if(tpm2_persistent_looks_sealed(tpm2_ctx, *cur, looks_sealed, &objects)) {
+					    err = __LINE__;
+					    continue;
+				    }
+				    if(!looks_sealed) {
+					    printf("0x%" PRIX32 ": not referenced, but not a sealed object; skipping\n", *cur);
+					    continue;
+				    }
+
+				    printf("0x%" PRIX32 ": not referenced by any dataset; %s\n", *cur, evict ? "freeing" : "would free");
+				    if(evict) {
+					    if(auto e = tpm2_free_persistent(tpm2_ctx, tpm2_session, *cur, &objects)) {
+						    err = e;
+						    continue;
+					    }
+				    }
+				    ++collected;
+			    }
+
+			    for(auto req = requested; req != requested + requested_len; ++req)
+				    if(std::find(orphans, orphans + orphans_len, *req) == orphans + orphans_len)
+					    err = (fprintf(stderr, "0x%" PRIX32 ": referenced by a dataset, or not persisted; not freeing\n", *req), __LINE__);
+
+			    printf("%zu / %zu unreferenced persistent handle(s) %s\n", collected, considered, evict ? "freed" : "would be freed");
+			    if(!evict && collected)
+				    printf("Re-run with -f, or with the handles to free, to free them.\n");
+			    return err;
+		    });
+	    });
+}
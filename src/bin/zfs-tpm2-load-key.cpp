@@ -5,11 +5,14 @@
 // #include <sys/zio_crypt.h>
 #define WRAPPING_KEY_LEN 32
 
+#include <algorithm>
 #include <stdio.h>
 
+#include "../coalesce.hpp"
 #include "../fd.hpp"
-#include "../main.hpp"
-#include "../tpm2.hpp"
+#include "../main_multi.hpp"
+#include "../parse.hpp"
+#include "../tzpfmsd.hpp"
 #include "../zfs.hpp"
 
 
@@ -18,25 +21,220 @@
 
 int main(int argc, char ** argv) {
 	auto noop = false;
-	return do_main(
-	    argc, argv, "n", "[-n]", [&](auto) { noop = true; },
-	    [&](auto dataset) {
-		    char * handle_s{};
-		    TRY_MAIN(parse_key_props(dataset, THIS_BACKEND, handle_s));
+	size_t jobs{};
+	auto coalescing = false;
+	return do_multi_main(
+	    argc, argv, THIS_BACKEND, ZFS_KEYSTATUS_UNAVAILABLE, "nj:C", "[-n] [-j jobs] [-C]",
+	    [&](auto o) {
+		    switch(o) {
+			    case 'n':
+				    return noop = true, 0;
+			    case 'j':
+				    if(!parse_uint(optarg, jobs))
+					    return fprintf(stderr, "-j %s: %s\n", optarg, strerror(errno)), __LINE__;
+				    return 0;
+			    case 'C':
+				    return coalescing = true, 0;
+			    default:
+				    __builtin_unreachable();
+		    }
+	    },
+	    [&](auto datasets, auto datasets_len) {
+		    size_t loaded{};
+		    auto load = [&](zfs_handle_t ** datasets, size_t datasets_len, auto && serve) {
+			    struct sealed_key {
+				    bool ok;      // false if the props are broken
+				    bool named;   // name is the sealed object's (only with the key cache)
+				    bool cached;  // wrap_key is from the key cache
+				    TPM2B_NAME name;
+				    tpm2_sealed sealed;
+				    TPML_PCR_SELECTION pcrs;
+				    uint8_t wrap_key[WRAPPING_KEY_LEN];
+			    };
+			    auto keys = TRY_PTR("allocate key list", reinterpret_cast<sealed_key *>(calloc(datasets_len, sizeof(sealed_key))));
+			    quickscope_wrapper keys_deleter{[&] {
+				    explicit_bzero(keys, datasets_len * sizeof(sealed_key));
+				    free(keys);
+			    }};
 
-		    TPMI_DH_PERSISTENT handle{};
-		    TPML_PCR_SELECTION pcrs{};
-		    TRY_MAIN(tpm2_parse_prop(zfs_get_name(dataset), handle_s, handle, &pcrs));
+			    /// The key cache goes by the sealed object's name: blobs' are known up-front, but persistent objects' need the TPM
+			    size_t cached{};
+			    auto lookup = [&](size_t i, tpm2_conn * tpm2) {
+				    if(key_cache_timeout() && (keys[i].named = !tpm2_sealed_name(tpm2, keys[i].sealed, keys[i].name)) &&
+				       (keys[i].cached = cached_key(zfs_get_name(datasets[i]), keys[i].name.name, keys[i].name.size, keys[i].wrap_key)))
+					    ++cached;
+			    };
 
+			    /// Parse everything first so that we don't touch the TPM at all if there's nothing to unseal
+			    int err{};
+			    size_t parsed{};
+			    for(size_t i = 0; i < datasets_len; ++i) {
+				    char * handle_s{};
+				    if(auto e = parse_key_props(datasets[i], THIS_BACKEND, handle_s))
+					    err = e;
+				    else if(auto e = tpm2_parse_prop(zfs_get_name(datasets[i]), handle_s, keys[i].sealed, &keys[i].pcrs))
+					    err = e;
+				    else {
+					    keys[i].ok = true, ++parsed;
+					    if(!keys[i].sealed.handle)
+						    lookup(i, nullptr);
+				    }
+			    }
 
-		    uint8_t wrap_key[WRAPPING_KEY_LEN];
-		    TRY_MAIN(with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
-			    TRY_MAIN(tpm2_unseal(zfs_get_name(dataset), tpm2_ctx, tpm2_session, handle, pcrs, wrap_key, sizeof(wrap_key)));
+			    auto unseal = [&](tpm2_conn * tpm2, size_t i, uint8_t * wrap_key) {
+				    if(!keys[i].ok)
+					    return __LINE__;
+				    if(keys[i].cached)
+					    return memcpy(wrap_key, keys[i].wrap_key, WRAPPING_KEY_LEN), 0;
+
+				    TRY_MAIN(tpm2_unseal(zfs_get_name(datasets[i]), *tpm2, keys[i].sealed, keys[i].pcrs, wrap_key, WRAPPING_KEY_LEN));
+				    if(keys[i].named)
+					    cache_key(zfs_get_name(datasets[i]), keys[i].name.name, keys[i].name.size, wrap_key);
+				    return 0;
+			    };
+
+
+			    /// All unseals share the connection (to tzpfmsd, or the HMAC and PCR policy sessions), and happen on this thread;
+			    /// the keys are loaded in parallel with -j. As leader, we then do the same for the followers' datasets, one by one.
+			    /// If all keys are cached (and in blobs), the TPM isn't touched at all
+			    if(parsed > cached || coalescing)
+				    TRY_MAIN(with_tpm2_conn([&](auto & tpm2) {
+					    for(size_t i = 0; i < datasets_len; ++i)
+						    if(keys[i].ok && keys[i].sealed.handle)
+							    lookup(i, &tpm2);
+
+					    if(parsed)
+						    if(auto e = load_keys(datasets, datasets_len, jobs, noop, loaded, [&](auto i, auto wrap_key) { return unseal(&tpm2, i, wrap_key); }))
+							    err = e;
+
+					    return serve([&](const char * dataset_name, bool follower_noop) {
+						    auto dataset = TRY_PTR(nullptr, zfs_open(zfs_get_handle(datasets[0]), dataset_name, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME));
+						    quickscope_wrapper dataset_deleter{[&] { zfs_close(dataset); }};
+
+						    char * handle_s{};
+						    TRY_MAIN(parse_key_props(dataset, THIS_BACKEND, handle_s));
+
+						    sealed_key key{};
+						    quickscope_wrapper key_deleter{[&] { explicit_bzero(&key, sizeof(key)); }};
+						    TRY_MAIN(tpm2_parse_prop(dataset_name, handle_s, key.sealed, &key.pcrs));
+
+						    key.named = key_cache_timeout() && !tpm2_sealed_name(&tpm2, key.sealed, key.name);
+						    if(!key.named || !cached_key(dataset_name, key.name.name, key.name.size, key.wrap_key)) {
+							    TRY_MAIN(tpm2_unseal(dataset_name, tpm2, key.sealed, key.pcrs, key.wrap_key, sizeof(key.wrap_key)));
+							    if(key.named)
+								    cache_key(dataset_name, key.name.name, key.name.size, key.wrap_key);
+						    }
+						    return load_key(dataset_name, key.wrap_key, follower_noop);
+					    });
+				    }));
+			    else if(parsed)
+				    if(auto e = load_keys(datasets, datasets_len, jobs, noop, loaded, [&](auto i, auto wrap_key) { return unseal(nullptr, i, wrap_key); }))
+					    err = e;
+			    return err;
+		    };
+
+
+		    int err;
+		    if(coalescing)
+			    err = coalesce("tpm2-load-key", datasets, datasets_len, noop, loaded, load);
+		    else
+			    err = load(datasets, datasets_len, [](auto &&) { return 0; });
+
+		    if(datasets_len != 1)
+			    printf("%zu / %zu key(s) successfully %s\n", loaded, datasets_len, noop ? "verified" : "loaded");
+		    return err;
+	    },
+	    [&](char ** dataset_names, bool & handled) {
+		    /// The boot-time case: a few datasets named outright, all encryption roots with our props. Those can be answered with a channel program,
+		    /// without libzfs_init() (and zfs_open(), and encryption root resolution); anything more interesting is left to libzfs
+		    if(jobs || coalescing)
 			    return 0;
-		    }));
 
+		    size_t datasets_len{};
+		    while(dataset_names[datasets_len])
+			    ++datasets_len;
+
+		    struct fast_key {
+			    nvlist_t * props;  // nullptr for duplicates
+			    char *backend, *handle;
+			    bool ok;      // false if the props are broken
+			    bool named;   // name is the sealed object's (only with the key cache)
+			    bool cached;  // wrap_key is from the key cache
+			    TPM2B_NAME name;
+			    tpm2_sealed sealed;
+			    TPML_PCR_SELECTION pcrs;
+			    uint8_t wrap_key[WRAPPING_KEY_LEN];
+		    };
+		    auto keys = TRY_PTR("allocate key list", reinterpret_cast<fast_key *>(calloc(datasets_len, sizeof(fast_key))));
+		    quickscope_wrapper keys_deleter{[&] {
+			    for(size_t i = 0; i < datasets_len; ++i)
+				    nvlist_free(keys[i].props);
+			    explicit_bzero(keys, datasets_len * sizeof(fast_key));
+			    free(keys);
+		    }};
+
+		    size_t unique{};
+		    for(size_t i = 0; i < datasets_len; ++i) {
+			    if(std::any_of(dataset_names, dataset_names + i, [&](auto d) { return !strcmp(d, dataset_names[i]); }))
+				    continue;
+			    TRY_MAIN(fast_lookup_key_props(dataset_names[i], keys[i].props, keys[i].backend, keys[i].handle));
+			    if(!keys[i].props || strcmp(keys[i].backend, THIS_BACKEND))
+				    return 0;
+			    ++unique;
+		    }
+		    handled = true;
+
+		    size_t cached{};
+		    auto lookup = [&](size_t i, tpm2_conn * tpm2) {
+			    if(key_cache_timeout() && (keys[i].named = !tpm2_sealed_name(tpm2, keys[i].sealed, keys[i].name)) &&
+			       (keys[i].cached = cached_key(dataset_names[i], keys[i].name.name, keys[i].name.size, keys[i].wrap_key)))
+				    ++cached;
+		    };
+
+		    int err{};
+		    size_t parsed{};
+		    for(size_t i = 0; i < datasets_len; ++i)
+			    if(keys[i].props) {
+				    if(auto e = tpm2_parse_prop(dataset_names[i], keys[i].handle, keys[i].sealed, &keys[i].pcrs))
+					    err = e;
+				    else {
+					    keys[i].ok = true, ++parsed;
+					    if(!keys[i].sealed.handle)
+						    lookup(i, nullptr);
+				    }
+			    }
+
+		    size_t loaded{};
+		    auto load = [&](tpm2_conn * tpm2) {
+			    for(size_t i = 0; i < datasets_len; ++i) {
+				    if(!keys[i].ok)
+					    continue;
+
+				    if(keys[i].sealed.handle)
+					    lookup(i, tpm2);
+				    if(!keys[i].cached) {
+					    if(auto e = tpm2_unseal(dataset_names[i], *tpm2, keys[i].sealed, keys[i].pcrs, keys[i].wrap_key, sizeof(keys[i].wrap_key))) {
+						    err = e;
+						    continue;
+					    }
+					    if(keys[i].named)
+						    cache_key(dataset_names[i], keys[i].name.name, keys[i].name.size, keys[i].wrap_key);
+				    }
+
+				    if(auto e = load_key(dataset_names[i], keys[i].wrap_key, noop))
+					    err = e;
+				    else
+					    ++loaded;
+			    }
+			    return 0;
+		    };
+		    if(parsed > cached)
+			    TRY_MAIN(with_tpm2_conn([&](auto & tpm2) { return load(&tpm2); }));
+		    else
+			    load(nullptr);
 
-		    TRY_MAIN(load_key(dataset, wrap_key, noop));
-		    return 0;
+		    if(unique != 1)
+			    printf("%zu / %zu key(s) successfully %s\n", loaded, unique, noop ? "verified" : "loaded");
+		    return err;
 	    });
 }
@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include "coalesce.hpp"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <utility>
+
+
+int coalesce_elect(const char * name, int & lock, int & sock, bool & leader) {
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if(snprintf(addr.sun_path, sizeof(addr.sun_path), COALESCE_DIR "/%s.sock", name) >= static_cast<int>(sizeof(addr.sun_path)))
+		return fprintf(stderr, "Coalescing socket name %s too long.\n", name), __LINE__;
+
+	char lock_path[sizeof(COALESCE_DIR "/") + NAME_MAX];
+	snprintf(lock_path, sizeof(lock_path), COALESCE_DIR "/%s.lock", name);
+
+	if(mkdir(COALESCE_DIR, 0700) == -1 && errno != EEXIST)
+		TRY("create " COALESCE_DIR, -1);
+	lock = TRY("open coalescing lock", open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+	leader = false;
+	sock   = -1;
+	quickscope_wrapper lock_deleter{[&] {
+		if(!leader || sock == -1)
+			close(std::exchange(lock, -1));
+	}};
+
+	for(;;) {
+		if(flock(lock, LOCK_EX | LOCK_NB) != -1) {
+			leader        = true;
+			auto listener = TRY("create coalescing socket", socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+			quickscope_wrapper listener_deleter{[&] {
+				if(sock == -1)
+					close(listener);
+			}};
+			unlink(addr.sun_path);  // stale, since the previous leader's gone
+			TRY("bind coalescing socket", bind(listener, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)));
+			TRY("listen on coalescing socket", listen(listener, SOMAXCONN));
+
+			sock = listener;
+			return 0;
+		} else if(errno != EWOULDBLOCK)
+			TRY("lock coalescing lock", -1);
+
+		auto follower = TRY("create coalescing socket", socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+		if(connect(follower, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != -1) {
+			sock = follower;
+			return 0;
+		}
+		close(follower);
+
+		// The leader either hasn't started listening yet, or has just stopped
+		const timespec backoff{0, 10'000'000};
+		nanosleep(&backoff, nullptr);
+	}
+}
+
+
+int coalesce_follow(int sock, const char * dataset, bool noop, int & verdict, bool & hung_up) {
+	coalesce_request req{};
+	req.noop = noop;
+	strncpy(req.dataset, dataset, sizeof(req.dataset) - 1);
+
+	iovec iov{&req, sizeof(req)};
+	alignas(cmsghdr) char cmsg_buf[CMSG_SPACE(2 * sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cmsg_buf;
+	msg.msg_controllen = sizeof(cmsg_buf);
+
+	auto cmsg             = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level      = SOL_SOCKET;
+	cmsg->cmsg_type       = SCM_RIGHTS;
+	cmsg->cmsg_len        = CMSG_LEN(2 * sizeof(int));
+	const int out_fds[2]{1, 2};
+	memcpy(CMSG_DATA(cmsg), out_fds, sizeof(out_fds));
+
+	fflush(stdout), fflush(stderr);
+	hung_up = false;
+	if(sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+		if(errno == EPIPE || errno == ECONNRESET)
+			return hung_up = true, 0;
+		TRY("hand dataset to leader", -1);
+	}
+
+	switch(recv(sock, &verdict, sizeof(verdict), 0)) {
+		case sizeof(verdict):
+			return 0;
+		case -1:
+			if(errno != ECONNRESET)
+				TRY("read verdict from leader", -1);
+			[[fallthrough]];
+		default:
+			return hung_up = true, 0;
+	}
+}
+
+
+int coalesce_serve_one(int client, int (*handle)(void * data, const char * dataset, bool noop), void * data) {
+	ucred cred{};
+	socklen_t cred_len = sizeof(cred);
+	TRY("get follower credentials", getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len));
+	if(cred.uid != geteuid())
+		return fprintf(stderr, "Rejecting follower PID %ld with UID %ld.\n", static_cast<long>(cred.pid), static_cast<long>(cred.uid)), __LINE__;
+
+	for(;;) {
+		coalesce_request req{};
+		iovec iov{&req, sizeof(req)};
+		alignas(cmsghdr) char cmsg_buf[CMSG_SPACE(2 * sizeof(int))]{};
+		msghdr msg{};
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+
+		auto rd = TRY("read follower request", recvmsg(client, &msg, MSG_CMSG_CLOEXEC));
+		if(!rd)
+			return 0;
+
+		int out_fds[2]{-1, -1};
+		if(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(out_fds)))
+			memcpy(out_fds, CMSG_DATA(cmsg), sizeof(out_fds));
+		quickscope_wrapper out_fds_deleter{[&] {
+			for(auto fd : out_fds)
+				if(fd != -1)
+					close(fd);
+		}};
+		if(rd != sizeof(req) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || out_fds[0] == -1)
+			return fprintf(stderr, "Malformed follower request.\n"), __LINE__;
+		req.dataset[sizeof(req.dataset) - 1] = '\0';
+
+
+		int verdict;
+		{
+			fflush(stdout), fflush(stderr);
+			auto stdout_saved = TRY("dup() stdout", dup(1));
+			quickscope_wrapper stdout_saved_deleter{[=] { close(stdout_saved); }};
+			auto stderr_saved = TRY("dup() stderr", dup(2));
+			quickscope_wrapper stderr_saved_deleter{[=] { close(stderr_saved); }};
+
+			TRY("dup2() onto stdout", dup2(out_fds[0], 1));
+			quickscope_wrapper stdout_restorer{[=] { fflush(stdout), dup2(stdout_saved, 1); }};
+			TRY("dup2() onto stderr", dup2(out_fds[1], 2));
+			quickscope_wrapper stderr_restorer{[=] { fflush(stderr), dup2(stderr_saved, 2); }};
+
+			verdict = handle(data, req.dataset, req.noop);
+		}
+
+		TRY("send verdict to follower", send(client, &verdict, sizeof(verdict), MSG_NOSIGNAL));
+	}
+}
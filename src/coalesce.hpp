@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include "main.hpp"
+
+#include <libzfs.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define COALESCE_DIR TZPFMS_RUN_DIR
+
+/// How long the leader waits for more followers after the queue runs dry; zfs-load-key@ instances are started all at once,
+/// so anyone later than this can just as well lead on their own
+#define COALESCE_LINGER_MS 250
+
+
+struct coalesce_request {
+	bool noop;
+	char dataset[ZFS_MAX_DATASET_NAME_LEN];
+};
+
+
+/// Become the leader for name (listener is the socket to accept followers on), or a follower (sock is connected to the leader).
+/// lock is held by the leader only; after closing listener, the leader unlink()s the socket, then releases lock by closing it.
+extern int coalesce_elect(const char * name, int & lock, int & sock, bool & leader);
+
+/// Hand dataset to the leader on sock, and get its verdict (0 on success); hung_up is set if the leader left before answering
+extern int coalesce_follow(int sock, const char * dataset, bool noop, int & verdict, bool & hung_up);
+
+/// Serve followers' requests on listener with handle(const char * dataset, bool noop) -> int, with stdout and stderr pointing at the follower's,
+/// until none come in for COALESCE_LINGER_MS
+template <class H>
+int coalesce_serve(int listener, H && handle);
+
+extern int coalesce_serve_one(int client, int (*handle)(void * data, const char * dataset, bool noop), void * data);
+
+
+/// Elect a leader among all concurrent invocations for name, with flock(2) on COALESCE_DIR/name.lock (so no daemon is needed).
+///
+/// Followers hand datasets (and noop) to the leader one by one over COALESCE_DIR/name.sock, and add the amount of successful ones to loaded;
+/// the leader runs lead(datasets, datasets_len, serve), and lead() calls serve(handle) (cf. coalesce_serve()) once it's done with its own datasets,
+/// ideally on the same TPM connection. If the leader leaves before handling all of a follower's datasets, one of the followers takes over.
+///
+/// Returns the first error.
+template <class L>
+int coalesce(const char * name, zfs_handle_t ** datasets, size_t datasets_len, bool noop, size_t & loaded, L && lead) {
+	int err{};
+	for(size_t i = 0; i < datasets_len;) {
+		int lock, sock;
+		bool leader;
+		TRY_MAIN(coalesce_elect(name, lock, sock, leader));
+		if(leader) {
+			char sock_path[sizeof(COALESCE_DIR "/") + NAME_MAX];
+			snprintf(sock_path, sizeof(sock_path), COALESCE_DIR "/%s.sock", name);
+			quickscope_wrapper leadership_deleter{[&] {
+				close(sock);
+				unlink(sock_path);
+				close(lock);
+			}};
+
+			if(auto e = lead(datasets + i, datasets_len - i, [&](auto && handle) { return coalesce_serve(sock, handle); }); e && !err)
+				err = e;
+			return err;
+		}
+		quickscope_wrapper sock_deleter{[&] { close(sock); }};
+
+		for(bool hung_up = false; i < datasets_len && !hung_up;) {
+			int verdict;
+			TRY_MAIN(coalesce_follow(sock, zfs_get_name(datasets[i]), noop, verdict, hung_up));
+			if(hung_up)
+				break;
+
+			if(verdict && !err)
+				err = verdict;
+			else if(!verdict)
+				++loaded;
+			++i;
+		}
+	}
+
+	return err;
+}
+
+
+template <class H>
+int coalesce_serve(int listener, H && handle) {
+	for(pollfd pfd{listener, POLLIN, 0}; TRY("wait for followers", poll(&pfd, 1, COALESCE_LINGER_MS));) {
+		auto client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if(client == -1) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			TRY("accept follower", -1);
+		}
+		quickscope_wrapper client_deleter{[=] { close(client); }};
+
+		coalesce_serve_one(
+		    client, [](void * data, const char * dataset, bool noop) { return (*static_cast<std::remove_reference_t<H> *>(data))(dataset, noop); }, &handle);
+	}
+
+	return 0;
+}
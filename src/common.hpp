@@ -9,6 +9,10 @@
 #include <string.h>
 
 
+/// Runtime state (locks, sockets, caches) all lives here; tmpfs, so none of it outlives a reboot (or the TPM's reset)
+#define TZPFMS_RUN_DIR "/run/tzpfms"
+
+
 #define TRY_GENERIC(what, cond_pre, cond_post, err_src, err_ret, strerr, ...)                   \
 	({                                                                                            \
 		auto _try_ret = (__VA_ARGS__);                                                              \
@@ -3,14 +3,20 @@
 
 #include "fd.hpp"
 
+#include "keyring.hpp"
 #include "main.hpp"
+#include "trace.hpp"
 
 #include <fcntl.h>
+#include <libzfs.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -18,23 +24,6 @@
 #define MIN_PASSPHRASE_LEN 8
 
 
-int filled_fd(int & fd, const void * with, size_t with_len) {
-	int pipes[2];
-	TRY("create buffer pipe", pipe2(pipes, O_CLOEXEC));
-	quickscope_wrapper pipes_w_deleter{[=] { close(pipes[1]); }};
-	fd = pipes[0];
-
-	auto ret = write(pipes[1], with, with_len);
-	if(ret >= 0 && static_cast<size_t>(ret) < with_len) {
-		ret   = -1;
-		errno = ENODATA;
-	}
-	TRY("write to buffer pipe", ret);
-
-	return 0;
-}
-
-
 int read_exact(const char * path, void * data, size_t len) {
 	auto infd = TRY("open input file", open(path, O_RDONLY | O_CLOEXEC));
 	quickscope_wrapper infd_deleter{[=] { close(infd); }};
@@ -140,6 +129,151 @@ static int get_key_material_helper(const char * helper, const char * whom, bool
 }
 
 
+/// $TZPFMS_PASSPHRASE_COPROCESS: started on the first prompt, then kept around for every later one; hangs up and is reaped at exit
+static struct passphrase_coprocess {
+	int sock  = -1;
+	pid_t pid = -1;
+
+	/// Exit status, or -1 if it died to a signal.
+	/// It should exit on hang-up; if it hasn't within a second, it's sent SIGTERM, then, a second after that, SIGKILL, so we never hang on it
+	int reap() {
+		close(this->sock);
+		this->sock = -1;
+
+		int status;
+		auto wait = [&](int options) {
+			int ret;
+			while((ret = waitpid(this->pid, &status, options)) == -1 && errno == EINTR)
+				;
+			return ret;
+		};
+
+		const timespec step{0, 10'000'000};
+		int ret{};
+		for(int sig : {0, SIGTERM}) {
+			if(sig)
+				kill(this->pid, sig);
+			for(int i = 0; i < 100 && !(ret = wait(WNOHANG)); ++i)
+				nanosleep(&step, nullptr);
+			if(ret)
+				break;
+		}
+		if(!ret)
+			kill(this->pid, SIGKILL), ret = wait(0);
+		this->pid = -1;
+		return ret > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+
+	~passphrase_coprocess() {
+		if(this->pid != -1)
+			this->reap();
+	}
+} coprocess;
+
+/// Past this, the coprocess is assumed to be talking a different protocol
+#define MAX_COPROCESS_PASSPHRASE_LEN (1024 * 1024)
+
+static int recv_exact(int sock, void * data, size_t len) {
+	while(len)
+		if(const auto rd = recv(sock, data, len, MSG_WAITALL); rd > 0) {
+			len -= rd;
+			data = static_cast<char *>(data) + rd;
+		} else if(rd == 0 || errno != EINTR)
+			return -1;
+	return 0;
+}
+
+/// Request: the four $TZPFMS_PASSPHRASE_HELPER arguments, each as a native-endian uint32_t length followed by that many bytes.
+/// Response: likewise, the passphrase, used as-is; UINT32_MAX instead of a length refuses the prompt.
+///
+/// TRY_MAIN rules, plus -1 if the coprocess doesn't exist
+static int get_key_material_coprocess(const char * helper, const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
+	if(coprocess.pid == -1) {
+		int socks[2];
+		TRY_HELPER("create helper socket", socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, socks));
+
+		switch(auto pid = fork()) {
+			case -1:
+				close(socks[0]), close(socks[1]);
+				return TRY_HELPER("create child", pid);
+
+			case 0:  // child
+				dup2(socks[1], 0);
+				dup2(socks[1], 1);
+				execl("/bin/sh", "sh", "-c", helper, helper, nullptr);
+				fprintf(stderr, "exec(/bin/sh): %s\n", strerror(errno));
+				_exit(127);
+
+			default:  // parent
+				close(socks[1]);
+				coprocess.sock = socks[0];
+				coprocess.pid  = pid;
+				break;
+		}
+	}
+
+	auto hung_up = [&] {
+		switch(auto status = coprocess.reap()) {
+			case 127:  // ENOENT, error already written by shell or child
+				return -1;
+			case -1:
+				return fprintf(stderr, "Helper '%s' died.\n", helper), __LINE__;
+			default:
+				return fprintf(stderr, "Helper '%s' hung up with %d.\n", helper, status), __LINE__;
+		}
+	};
+
+
+	char * msg{};
+	if(asprintf(&msg, "%sassphrase for %s%s", newkey ? "New p" : "P", whom, again ? " (again)" : "") == -1)
+		TRY("format prompt", -1);
+	quickscope_wrapper msg_deleter{[&] { free(msg); }};
+
+	const char * fields[]{msg, whom, newkey ? "new" : "", again ? "again" : ""};
+	uint32_t lens[sizeof(fields) / sizeof(*fields)];
+	iovec request[sizeof(fields) / sizeof(*fields) * 2];
+	size_t request_len{};
+	for(size_t i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+		lens[i]            = strlen(fields[i]);
+		request[i * 2]     = {&lens[i], sizeof(lens[i])};
+		request[i * 2 + 1] = {const_cast<char *>(fields[i]), lens[i]};
+		request_len += sizeof(lens[i]) + lens[i];
+	}
+
+	msghdr hdr{};
+	hdr.msg_iov    = request;
+	hdr.msg_iovlen = sizeof(request) / sizeof(*request);
+	ssize_t sent;
+	while((sent = sendmsg(coprocess.sock, &hdr, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		;
+	if(sent == -1 && errno == EPIPE)
+		return hung_up();
+	TRY("write to helper", sent);
+	if(static_cast<size_t>(sent) != request_len)  // the prompts are way smaller than the socket buffer
+		return fprintf(stderr, "Couldn't write to helper: short write\n"), __LINE__;
+
+
+	uint32_t len;
+	if(recv_exact(coprocess.sock, &len, sizeof(len)))
+		return hung_up();
+	if(len == UINT32_MAX)
+		return fprintf(stderr, "Helper '%s' refused.\n", helper), __LINE__;
+	if(len > MAX_COPROCESS_PASSPHRASE_LEN)
+		return fprintf(stderr, "Helper '%s' sent a %" PRIu32 "-byte passphrase (max %u).\n", helper, len, MAX_COPROCESS_PASSPHRASE_LEN), __LINE__;
+
+	if(!len)
+		return buf = nullptr, len_out = 0, 0;
+	buf = TRY_PTR("allocate passphrase", static_cast<uint8_t *>(malloc(len)));
+	if(recv_exact(coprocess.sock, buf, len)) {
+		free(buf);
+		buf = nullptr;
+		return hung_up();
+	}
+	len_out = len;
+	return 0;
+}
+
+
 /// Adapted from src:zfs's lib/libzfs/libzfs_crypto.c#get_key_material_raw()
 static int get_key_material_raw(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
 	static int caught_interrupt;
@@ -224,12 +358,24 @@ static int get_key_material_raw(const char * whom, bool again, bool newkey, uint
 #define STRINGIFY_(...) #__VA_ARGS__
 #define STRINGIFY(...) STRINGIFY_(__VA_ARGS__)
 
-static int get_key_material_dispatch(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
+int (*passphrase_forwarder)(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out);
+
+int read_passphrase_locally(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
+	static const char * coprocess_helper{};
+	if(!coprocess_helper)
+		coprocess_helper = getenv("TZPFMS_PASSPHRASE_COPROCESS") ?: "";
+	if(*coprocess_helper) {
+		if(auto err = TRACE("passphrase coprocess", get_key_material_coprocess(coprocess_helper, whom, again, newkey, buf, len_out)); err != -1)
+			return err;
+		else
+			coprocess_helper = "";
+	}
+
 	static const char * helper{};
 	if(!helper)
 		helper = getenv("TZPFMS_PASSPHRASE_HELPER") ?: STRINGIFY(TZPFMS_PASSPHRASE_HELPER);
 	if(*helper) {
-		if(auto err = get_key_material_helper(helper, whom, again, newkey, buf, len_out); err != -1)
+		if(auto err = TRACE("passphrase helper", get_key_material_helper(helper, whom, again, newkey, buf, len_out)); err != -1)
 			return err;
 		else
 			helper = "";
@@ -237,6 +383,10 @@ static int get_key_material_dispatch(const char * whom, bool again, bool newkey,
 	return get_key_material_raw(whom, again, newkey, buf, len_out);
 }
 
+static int get_key_material_dispatch(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out) {
+	return (passphrase_forwarder ?: read_passphrase_locally)(whom, again, newkey, buf, len_out);
+}
+
 
 int read_known_passphrase(const char * whom, uint8_t *& buf, size_t & len_out, size_t max_len) {
 	TRY_MAIN(get_key_material_dispatch(whom, false, false, buf, len_out));
@@ -278,3 +428,39 @@ int read_new_passphrase(const char * whom, uint8_t *& buf, size_t & len_out, siz
 	len_out = second_passphrase_len;
 	return 0;
 }
+
+
+static unsigned passphrase_cache_timeout() {
+	static int timeout = -1;
+	if(timeout == -1)
+		timeout = keyring_timeout("TZPFMS_PASSPHRASE_CACHE");
+	return timeout;
+}
+
+/// whom is at most a dataset name and " TPM2 wrapping key" or similar
+static const constexpr size_t passphrase_cache_description_len = 7 + ZFS_MAX_DATASET_NAME_LEN + 64;
+
+static bool passphrase_cache_description(const char * whom, char (&into)[passphrase_cache_description_len]) {
+	return snprintf(into, sizeof(into), "tzpfms:%s", whom) < static_cast<int>(sizeof(into));
+}
+
+bool passphrase_cache_get(const char * whom, uint8_t *& buf, size_t & len_out) {
+	char desc[passphrase_cache_description_len];
+	if(!passphrase_cache_timeout() || !passphrase_cache_description(whom, desc))
+		return false;
+	return keyring_read(desc, buf, len_out);
+}
+
+void passphrase_cache_put(const char * whom, const uint8_t * buf, size_t len) {
+	char desc[passphrase_cache_description_len];
+	if(!passphrase_cache_timeout() || !passphrase_cache_description(whom, desc))
+		return;
+	if(!keyring_write(desc, buf, len, passphrase_cache_timeout()))
+		fprintf(stderr, "Couldn't cache passphrase for %s: %s\n", whom, strerror(errno));
+}
+
+void passphrase_cache_drop(const char * whom) {
+	char desc[passphrase_cache_description_len];
+	if(passphrase_cache_timeout() && passphrase_cache_description(whom, desc))
+		keyring_drop(desc);
+}
@@ -9,25 +9,6 @@
 #include <stdint.h>
 
 
-template <class F>
-int with_stdin_at(int fd, F && what) {
-	auto stdin_saved = TRY("dup() stdin", dup(0));
-	quickscope_wrapper stdin_saved_deleter{[=] { close(stdin_saved); }};
-
-	TRY("dup2() onto stdin", dup2(fd, 0));
-
-	if(int ret = what()) {
-		dup2(stdin_saved, 0);
-		return ret;
-	}
-
-	TRY("dup2() stdin back onto stdin", dup2(stdin_saved, 0));
-	return 0;
-}
-
-/// with_len may not exceed pipe capacity (64k by default)
-extern int filled_fd(int & fd, const void * with, size_t with_len);
-
 /// Read exactly len bytes from path into data, or error
 extern int read_exact(const char * path, void * data, size_t len);
 
@@ -39,3 +20,21 @@ extern int read_known_passphrase(const char * whom, uint8_t *& buf, size_t & len
 
 /// Prompt twice for passphrase for whom the user is setting
 extern int read_new_passphrase(const char * whom, uint8_t *& buf, size_t & len_out, size_t max_len = SIZE_MAX);
+
+/// If set, all prompts go here instead of to read_passphrase_locally() (tzpfmsd uses this to prompt on the client's side)
+extern int (*passphrase_forwarder)(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out);
+
+/// Prompt for passphrase for whom with $TZPFMS_PASSPHRASE_COPROCESS or $TZPFMS_PASSPHRASE_HELPER, falling back to stdin, regardless of passphrase_forwarder
+extern int read_passphrase_locally(const char * whom, bool again, bool newkey, uint8_t *& buf, size_t & len_out);
+
+
+/// With $TZPFMS_PASSPHRASE_CACHE, passphrases that worked are kept in the user keyring, under whom.
+/// Only ever tried for the same whom, since each wrong guess counts towards the TPM's lock-out.
+/// Returns false if there's none, or if caching is off (or not on Linux).
+extern bool passphrase_cache_get(const char * whom, uint8_t *& buf, size_t & len_out);
+
+/// Remember that this passphrase worked for whom; no-op if caching is off
+extern void passphrase_cache_put(const char * whom, const uint8_t * buf, size_t len);
+
+/// Forget the one for whom (because it didn't work)
+extern void passphrase_cache_drop(const char * whom);
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include "keyring.hpp"
+
+#include "common.hpp"
+#include "parse.hpp"
+
+#include <stdlib.h>
+#if __linux__
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+/// No libkeyutils: these are all simple enough to call directly, and it'd be a new dependency for two caches
+
+
+#if __linux__
+unsigned keyring_timeout(const char * var) {
+	unsigned ret{};
+	if(auto val = getenv(var); val && *val && !parse_uint(val, ret))
+		fprintf(stderr, "%s=%s: %s; not caching\n", var, val, strerror(errno)), ret = 0;
+	return ret;
+}
+
+static int32_t keyring_find(const char * desc) {
+	return syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING, "user", desc, 0);
+}
+
+bool keyring_read(const char * desc, uint8_t *& buf, size_t & len_out) {
+	auto key = keyring_find(desc);
+	if(key == -1)
+		return false;
+
+	for(long len = 0;;) {
+		auto got = syscall(SYS_keyctl, KEYCTL_READ, key, buf, len);
+		if(got == -1)
+			return free(buf), buf = nullptr, false;
+		if(got <= len)
+			return len_out = got, true;
+
+		auto newbuf = static_cast<uint8_t *>(realloc(buf, got));
+		if(!newbuf)
+			return free(buf), buf = nullptr, false;
+		buf = newbuf;
+		len = got;
+	}
+}
+
+bool keyring_write(const char * desc, const void * data, size_t len, unsigned timeout) {
+	// add_key() updates in place if there's already one, and the timeout is reset either way
+	int32_t key = syscall(SYS_add_key, "user", desc, data, len, KEY_SPEC_USER_KEYRING);
+	if(key == -1)
+		return false;
+	return syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, key, timeout) != -1;
+}
+
+void keyring_drop(const char * desc) {
+	if(auto key = keyring_find(desc); key != -1)
+		syscall(SYS_keyctl, KEYCTL_INVALIDATE, key);
+}
+
+/// The keyring reads as an array of key serials, and each key describes itself as "type;uid;gid;perm;description"
+void keyring_drop_prefixed(const char * prefix, size_t suffix_len) {
+	uint8_t * keys{};
+	size_t keys_len{};
+	for(long len = 0;;) {
+		auto got = syscall(SYS_keyctl, KEYCTL_READ, KEY_SPEC_USER_KEYRING, keys, len);
+		if(got == -1)
+			return free(keys);
+		if(got <= len) {
+			keys_len = got;
+			break;
+		}
+
+		auto newkeys = static_cast<uint8_t *>(realloc(keys, got));
+		if(!newkeys)
+			return free(keys);
+		keys = newkeys;
+		len  = got;
+	}
+	quickscope_wrapper keys_deleter{[&] { free(keys); }};
+
+	const auto prefix_len = strlen(prefix);
+	for(size_t i = 0; i + sizeof(int32_t) <= keys_len; i += sizeof(int32_t)) {
+		int32_t key;
+		memcpy(&key, keys + i, sizeof(key));
+
+		char desc[4096];
+		auto got = syscall(SYS_keyctl, KEYCTL_DESCRIBE, key, desc, sizeof(desc));
+		if(got <= 0 || got > static_cast<long>(sizeof(desc)))
+			continue;
+
+		const char * name = desc;
+		for(int fields = 0; fields < 4 && name; ++fields)
+			if((name = strchr(name, ';')))
+				++name;
+		if(!name || strncmp(desc, "user;", 5) || strncmp(name, prefix, prefix_len) || strlen(name + prefix_len) != suffix_len)
+			continue;
+		syscall(SYS_keyctl, KEYCTL_INVALIDATE, key);
+	}
+}
+#else
+unsigned keyring_timeout(const char *) {
+	return 0;
+}
+
+bool keyring_read(const char *, uint8_t *&, size_t &) {
+	return false;
+}
+
+bool keyring_write(const char *, const void *, size_t, unsigned) {
+	return errno = ENOSYS, false;
+}
+
+void keyring_drop(const char *) {}
+
+void keyring_drop_prefixed(const char *, size_t) {}
+#endif
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Read the timeout for a cache from var, in seconds, diagnosing if it's not a number; 0 (off) if unset or empty, or not on Linux
+extern unsigned keyring_timeout(const char * var);
+
+/// Read the "user" key named desc in the user keyring into buf (malloc()ed); false if there's none
+extern bool keyring_read(const char * desc, uint8_t *& buf, size_t & len_out);
+
+/// Add or update the "user" key named desc in the user keyring to data, expiring in timeout seconds; false and errno if that failed
+extern bool keyring_write(const char * desc, const void * data, size_t len, unsigned timeout);
+
+/// Invalidate the "user" key named desc in the user keyring, if any
+extern void keyring_drop(const char * desc);
+
+/// Invalidate every "user" key in the user keyring named prefix followed by exactly suffix_len more characters
+extern void keyring_drop_prefixed(const char * prefix, size_t suffix_len);
@@ -5,6 +5,7 @@
 
 
 #include "common.hpp"
+#include "trace.hpp"
 #include <libzfs.h>
 #include <stdlib.h>
 #include <type_traits>
@@ -19,15 +20,21 @@
 	} while(0)
 
 
-template <class G, class M, class V = int (*)()>
-static int do_bare_main(
-    int argc, char ** argv, const char * getoptions, const char * usage, const char * dataset_usage, G && getoptfn, M && main,
-    V && validate = []() { return 0; }) {
-	const auto libz = TRY_PTR("initialise libzfs", libzfs_init());
+template <class M>
+int with_libzfs(M && main) {
+	const auto libz = TRY_PTR("initialise libzfs", TRACE("libzfs_init", libzfs_init()));
 	quickscope_wrapper libz_deleter{[=] { libzfs_fini(libz); }};
 
 	libzfs_print_on_error(libz, B_TRUE);
+	return main(libz);
+}
+
 
+/// Like do_bare_main(), but main() is called without arguments, and libzfs is left uninitialised
+template <class G, class M, class V = int (*)()>
+static int do_bare_main_nolibz(
+    int argc, char ** argv, const char * getoptions, const char * usage, const char * dataset_usage, G && getoptfn, M && main,
+    V && validate = []() { return 0; }) {
 	auto gopts = reinterpret_cast<char *>(alloca(strlen(getoptions) + 2 + 1));
 	gopts[0] = 'h', gopts[1] = 'V';
 	strcpy(gopts + 2, getoptions);
@@ -53,7 +60,16 @@ static int do_bare_main(
 
 	if(auto err = validate())
 		return fprintf(stderr, "Usage: %s [-hV] %s%s%s\n", argv[0], usage, strlen(usage) ? " " : "", dataset_usage), err;
-	return main(libz);
+	return main();
+}
+
+/// libzfs is only initialised once the options have been parsed, so -h and -V don't open /dev/zfs
+template <class G, class M, class V = int (*)()>
+static int do_bare_main(
+    int argc, char ** argv, const char * getoptions, const char * usage, const char * dataset_usage, G && getoptfn, M && main,
+    V && validate = []() { return 0; }) {
+	return do_bare_main_nolibz(
+	    argc, argv, getoptions, usage, dataset_usage, getoptfn, [&] { return with_libzfs(main); }, validate);
 }
 
 template <class G, class M, class V = int (*)()>
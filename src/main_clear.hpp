@@ -23,6 +23,7 @@ int do_clear_main(int argc, char ** argv, const char * this_backend, H && handle
 
 		    if(zfs_crypto_rewrap(dataset, TRY_PTR("get clear rewrap args", clear_rewrap_args()), B_FALSE))
 			    return __LINE__;  // Error printed by libzfs
+		    uncache_key(zfs_get_name(dataset));
 
 
 		    TRY_MAIN(freefn());
@@ -0,0 +1,180 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include "main.hpp"
+#include "pipeline.hpp"
+#include "zfs.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <libzfs_core.h>
+#include <type_traits>
+#include <utility>
+
+// #include <sys/zio_crypt.h>
+#define WRAPPING_KEY_LEN 32
+
+
+/// Like do_main(), but mirrors zfs(8) load-key: any amount of datasets (normalised to their encryption roots), or, with -r, all encryption roots
+/// at or under them, or, with -a, all encryption roots on the system. The latter two only pick up encryption roots managed by this_backend whose key
+/// status is implicit_keystatus, and skip all others silently.
+///
+/// main() gets the deduplicated encryption roots as (zfs_handle_t ** datasets, size_t datasets_len); they're closed afterward.
+///
+/// Without -r or -a, fast(char ** dataset_names, bool & handled) gets the first go, before libzfs is initialised (but after libzfs_core is);
+/// if it doesn't set handled, it mustn't have done anything, and main() runs as usual.
+template <class G, class M, class F = int (*)(char **, bool &), class V = int (*)()>
+static int do_multi_main(int argc, char ** argv, const char * this_backend, zfs_keystatus_t implicit_keystatus, const char * getoptions, const char * usage,
+                         G && getoptfn, M && main, F && fast = [](char **, bool &) { return 0; }, V && validate = []() { return 0; }) {
+	bool recursive = false;
+	bool all       = false;
+
+	auto gopts = reinterpret_cast<char *>(alloca(strlen(getoptions) + 2 + 1));
+	gopts[0] = 'r', gopts[1] = 'a';
+	strcpy(gopts + 2, getoptions);
+	return do_bare_main_nolibz(
+	    argc, argv, gopts, usage, "-a|[-r] dataset…",
+	    [&](auto opt) {
+		    switch(opt) {
+			    case 'r':
+				    return recursive = true, 0;
+			    case 'a':
+				    return all = true, 0;
+			    default:
+				    if constexpr(std::is_same_v<std::invoke_result_t<G, decltype(opt)>, void>)
+					    return getoptfn(opt), 0;
+				    else
+					    return static_cast<int>(getoptfn(opt));
+		    }
+	    },
+	    [&] {
+		    if(all == !!*(argv + optind))
+			    return fprintf(stderr,
+			                   "%s\n"
+			                   "Usage: %s [-hV] %s%s-a|[-r] dataset…\n",
+			                   all ? "-a specified alongside datasets?" : "No dataset to act on?", argv[0], usage, strlen(usage) ? " " : ""),
+			           __LINE__;
+
+		    if(!recursive && !all && !libzfs_core_init()) {  // else libzfs_init() will fail, and say why
+			    quickscope_wrapper libzc_deleter{[] { libzfs_core_fini(); }};
+
+			    bool handled = false;
+			    auto err     = fast(argv + optind, handled);
+			    if(handled)
+				    return err;
+		    }
+
+		    return with_libzfs([&](auto libz) {
+			    zfs_handle_t ** datasets{};
+			    size_t datasets_len{};
+			    size_t datasets_cap{};
+			    quickscope_wrapper datasets_deleter{[&] {
+				    for(size_t i = 0; i < datasets_len; ++i)
+					    zfs_close(datasets[i]);
+				    free(datasets);
+			    }};
+
+			    /// Encryption roots are usually reached from many datasets or specified more than once; -a can't produce duplicates.
+			    /// Takes ownership of dataset, even on error
+			    auto add_dataset = [&](zfs_handle_t * dataset) {
+				    quickscope_wrapper dataset_deleter{[&] {
+					    if(dataset)
+						    zfs_close(dataset);
+				    }};
+				    if(!all && std::any_of(datasets, datasets + datasets_len, [&](auto d) { return !strcmp(zfs_get_name(d), zfs_get_name(dataset)); }))
+					    return 0;
+
+				    if(datasets_len == datasets_cap) {
+					    datasets = TRY_PTR("allocate dataset list", reinterpret_cast<zfs_handle_t **>(reallocarray(datasets, datasets_cap ? datasets_cap * 2 : 16,
+					                                                                                                 sizeof(zfs_handle_t *))));
+					    datasets_cap = datasets_cap ? datasets_cap * 2 : 16;
+				    }
+				    datasets[datasets_len++] = std::exchange(dataset, nullptr);
+				    return 0;
+			    };
+
+			    if(!recursive && !all)
+				    for(auto dataset_name = argv + optind; *dataset_name; ++dataset_name) {
+					    auto dataset = TRY_PTR(nullptr, zfs_open(libz, *dataset_name, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME));
+					    quickscope_wrapper dataset_deleter{[&] {
+						    if(dataset)
+							    zfs_close(dataset);
+					    }};
+
+					    char encryption_root[MAXNAMELEN];
+					    boolean_t dataset_is_root;
+					    TRY("get encryption root", zfs_crypto_get_encryption_root(dataset, &dataset_is_root, encryption_root));
+
+					    if(!dataset_is_root && !strlen(encryption_root))
+						    return fprintf(stderr, "Dataset %s not encrypted?\n", zfs_get_name(dataset)), __LINE__;
+					    else if(!dataset_is_root) {
+						    fprintf(stderr, "Using dataset %s's encryption root %s instead.\n", zfs_get_name(dataset), encryption_root);
+						    zfs_close(std::exchange(dataset, nullptr));
+						    dataset = TRY_PTR(nullptr, zfs_open(libz, encryption_root, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME));
+					    }
+
+					    TRY_MAIN(add_dataset(std::exchange(dataset, nullptr)));
+				    }
+			    else
+				    // Handles passed here are used for iterating over their children afterward, so they can't be closed (cf. zfs-tpm-list)
+				    TRY_MAIN(for_all_datasets(libz, argv + optind, recursive ? SIZE_MAX : MAXDEPTH_UNSET, [&](auto dataset) {
+					    boolean_t dataset_is_root;
+					    TRY("get encryption root", zfs_crypto_get_encryption_root(dataset, &dataset_is_root, nullptr));
+					    if(!dataset_is_root || zfs_prop_get_int(dataset, ZFS_PROP_KEYSTATUS) != static_cast<uint64_t>(implicit_keystatus))
+						    return 0;
+
+					    char * backend{};
+					    TRY_MAIN(lookup_userprop(dataset, PROPNAME_BACKEND, backend));
+					    if(!backend || strcmp(backend, this_backend))
+						    return 0;
+
+					    return add_dataset(TRY_PTR("duplicate dataset handle", zfs_handle_dup(dataset)));
+				    }));
+
+
+			    return main(datasets, datasets_len);
+		    });
+	    },
+	    validate);
+}
+
+
+/// Unseal the keys for datasets in order with unseal(i, uint8_t * wrap_key), and load them as they come in, with jobs threads (cf. pipeline()).
+/// Returns the last error, and adds the amount of successfully loaded keys to loaded.
+///
+/// load_key() doesn't touch the (thread-unsafe) libzfs handles, so the workers can share them; the loaded ones are refreshed on this thread afterward.
+template <class U>
+int load_keys(zfs_handle_t ** datasets, size_t datasets_len, size_t jobs, bool noop, size_t & loaded, U && unseal) {
+	struct wrap_key_t {
+		uint8_t key[WRAPPING_KEY_LEN];
+	};
+	auto loaded_ok = TRY_PTR("allocate dataset list", reinterpret_cast<bool *>(calloc(datasets_len, sizeof(bool))));
+	quickscope_wrapper loaded_ok_deleter{[&] { free(loaded_ok); }};
+
+	std::atomic<int> err{};
+	std::atomic<size_t> loaded_keys{};
+	TRY_MAIN(pipeline<wrap_key_t>(
+	    datasets_len, jobs,
+	    [&](size_t i, wrap_key_t & wrap_key) {
+		    if(auto e = unseal(i, wrap_key.key))
+			    return err = e, e;
+		    return 0;
+	    },
+	    [&](size_t, size_t i, wrap_key_t & wrap_key) {
+		    if(auto e = load_key(zfs_get_name(datasets[i]), wrap_key.key, noop))
+			    err = e;
+		    else
+			    loaded_ok[i] = true, ++loaded_keys;
+	    }));
+
+	if(!noop)
+		for(size_t i = 0; i < datasets_len; ++i)
+			if(loaded_ok[i])
+				zfs_refresh_properties(datasets[i]);
+
+	loaded += loaded_keys;
+	return err;
+}
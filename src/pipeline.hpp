@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include "common.hpp"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+
+#define TRY_PTHREAD(what, ...) TRY_GENERIC(what, , != 0, _try_ret, __LINE__, strerror, __VA_ARGS__)
+
+
+/// Run produce(i, T & item) for every i in [0, count) on this thread, in order, and, for each i it returned 0 for, consume(worker, i, T & item) on one
+/// of jobs worker threads (worker being the thread's index in [0, jobs)); at most jobs produced items wait for a worker at any one time.
+///
+/// With jobs = 0, consume(0, i, item) is called right after each produce(), on this thread.
+///
+/// Only errors in managing the threads are returned; produce() and consume() are expected to record their own.
+///
+/// Items are usually key material, so every copy is explicit_bzero()ed once consumed (or dropped).
+template <class T, class P, class C>
+int pipeline(size_t count, size_t jobs, P && produce, C && consume) {
+	if(!jobs) {
+		for(size_t i = 0; i < count; ++i) {
+			T item;
+			quickscope_wrapper item_deleter{[&] { explicit_bzero(&item, sizeof(item)); }};
+			if(!produce(i, item))
+				consume(0, i, item);
+		}
+		return 0;
+	}
+
+	struct entry {
+		size_t i;
+		T item;
+	};
+	struct state_t {
+		C & consume;
+		pthread_mutex_t lock;
+		pthread_cond_t nonempty;
+		pthread_cond_t nonfull;
+		entry * ring;
+		size_t ring_cap;
+		size_t ring_head;
+		size_t ring_len;
+		bool done;
+	} state{consume, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, nullptr, jobs, 0, 0, false};
+	state.ring = TRY_PTR("allocate pipeline queue", reinterpret_cast<entry *>(calloc(jobs, sizeof(entry))));
+	quickscope_wrapper ring_deleter{[&] {
+		explicit_bzero(state.ring, jobs * sizeof(entry));
+		free(state.ring);
+	}};
+
+	struct worker_t {
+		state_t * state;
+		size_t idx;
+		pthread_t thread;
+	};
+	auto workers = TRY_PTR("allocate worker list", reinterpret_cast<worker_t *>(calloc(jobs, sizeof(worker_t))));
+	quickscope_wrapper workers_deleter{[&] { free(workers); }};
+
+	size_t started{};
+	quickscope_wrapper workers_joiner{[&] {
+		pthread_mutex_lock(&state.lock);
+		state.done = true;
+		pthread_cond_broadcast(&state.nonempty);
+		pthread_mutex_unlock(&state.lock);
+
+		for(size_t i = 0; i < started; ++i)
+			pthread_join(workers[i].thread, nullptr);
+	}};
+	for(; started < jobs; ++started) {
+		workers[started] = {&state, started, {}};
+		TRY_PTHREAD("start worker", pthread_create(
+		                                &workers[started].thread, nullptr,
+		                                [](void * worker_p) -> void * {
+			                                auto worker = reinterpret_cast<worker_t *>(worker_p);
+			                                auto & st   = *worker->state;
+
+			                                pthread_mutex_lock(&st.lock);
+			                                for(;;) {
+				                                while(!st.ring_len && !st.done)
+					                                pthread_cond_wait(&st.nonempty, &st.lock);
+				                                if(!st.ring_len)
+					                                break;
+
+				                                auto cur = st.ring[st.ring_head];
+				                                explicit_bzero(&st.ring[st.ring_head], sizeof(entry));
+				                                st.ring_head = (st.ring_head + 1) % st.ring_cap;
+				                                --st.ring_len;
+				                                pthread_cond_signal(&st.nonfull);
+				                                pthread_mutex_unlock(&st.lock);
+
+				                                st.consume(worker->idx, cur.i, cur.item);
+				                                explicit_bzero(&cur, sizeof(cur));
+
+				                                pthread_mutex_lock(&st.lock);
+			                                }
+			                                pthread_mutex_unlock(&st.lock);
+			                                return nullptr;
+		                                },
+		                                &workers[started]));
+	}
+
+	for(size_t i = 0; i < count; ++i) {
+		entry cur{i, {}};
+		quickscope_wrapper cur_deleter{[&] { explicit_bzero(&cur, sizeof(cur)); }};
+		if(produce(i, cur.item))
+			continue;
+
+		pthread_mutex_lock(&state.lock);
+		while(state.ring_len == state.ring_cap)
+			pthread_cond_wait(&state.nonfull, &state.lock);
+		state.ring[(state.ring_head + state.ring_len) % state.ring_cap] = cur;
+		++state.ring_len;
+		pthread_cond_signal(&state.nonempty);
+		pthread_mutex_unlock(&state.lock);
+	}
+
+	return 0;
+}
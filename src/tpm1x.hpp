@@ -30,14 +30,14 @@ static const constexpr uint8_t parent_key_secret[TPM_SHA1_160_HASH_LEN]{0xCE, 0x
 template <class F>
 int with_tpm1x_session(F && func) {
 	TSS_HCONTEXT ctx{};  // All memory lives as long as this does
-	TRY_TPM1X("create TPM context", Tspi_Context_Create(&ctx));
+	TRY_TPM1X("create TPM context", TRACE("Tspi_Context_Create", Tspi_Context_Create(&ctx)));
 
 	{
 		UNICODE * tcs_address{};
 		quickscope_wrapper tcs_address_deleter{[&] { free(tcs_address); }};
 		if(auto addr = getenv("TZPFMS_TPM1X"))
 			tcs_address = reinterpret_cast<UNICODE *>(TRY_PTR("allocate remote TPM address", Trspi_Native_To_UNICODE(reinterpret_cast<BYTE *>(addr), nullptr)));
-		TRY_TPM1X("connect TPM context to TPM", Tspi_Context_Connect(ctx, tcs_address));
+		TRY_TPM1X("connect TPM context to TPM", TRACE("Tspi_Context_Connect", Tspi_Context_Connect(ctx, tcs_address)));
 	}
 	quickscope_wrapper ctx_deleter{[&] {
 		Trspi_Error_String(Tspi_Context_FreeMemory(ctx, nullptr));
@@ -46,7 +46,7 @@ int with_tpm1x_session(F && func) {
 
 
 	TSS_HOBJECT srk{};
-	TRY_TPM1X("load SRK", Tspi_Context_LoadKeyByUUID(ctx, TSS_PS_TYPE_SYSTEM, TSS_UUID_SRK, &srk));
+	TRY_TPM1X("load SRK", TRACE("Tspi_Context_LoadKeyByUUID", Tspi_Context_LoadKeyByUUID(ctx, TSS_PS_TYPE_SYSTEM, TSS_UUID_SRK, &srk)));
 
 	TSS_HPOLICY srk_policy{};
 	TRY_TPM1X("get SRK policy", Tspi_GetPolicyObject(srk, TSS_POLICY_USAGE, &srk_policy));
@@ -61,12 +61,27 @@ int with_tpm1x_session(F && func) {
 	return func(ctx, srk, srk_policy);
 }
 
-/// Try to run func() with the current policy; if it fails, prompt for passphrase and reattempt up to three total times.
+/// Try to run func() with the current policy; if it fails, try the cached passphrase, then prompt for passphrase and reattempt up to three total times.
 template <class F>
 int try_policy_or_passphrase(const char * what, const char * what_for, TSS_HPOLICY policy, F && func) {
 	auto err = func();
 	// Equivalent to TSS_ERROR_LAYER(err) == TSS_LAYER_TPM && TSS_ERROR_CODE(err) == TPM_E_AUTHFAIL
-	for(int i = 0; ((err & TSS_LAYER_TSP) == TSS_LAYER_TPM && (err & TSS_MAX_ERROR) == TPM_E_AUTHFAIL) && i < 3; ++i) {
+	auto authfail = [&] { return (err & TSS_LAYER_TSP) == TSS_LAYER_TPM && (err & TSS_MAX_ERROR) == TPM_E_AUTHFAIL; };
+	{
+		BYTE * pass{};
+		size_t pass_len{};
+		if(authfail() && passphrase_cache_get(what_for, pass, pass_len)) {
+			quickscope_wrapper pass_deleter{[&] { free(pass); }};
+
+			TRY_TPM1X("set passphrase secret on policy", Tspi_Policy_SetSecret(policy, TSS_SECRET_MODE_PLAIN, pass_len, pass));
+			if((err = func()) == TPM_SUCCESS)
+				passphrase_cache_put(what_for, pass, pass_len);
+			else if(authfail())  // wrong, so don't try it again
+				passphrase_cache_drop(what_for);
+		}
+	}
+
+	for(int i = 0; authfail() && i < 3; ++i) {
 		if(i)
 			fprintf(stderr, "Couldn't %s: %s\n", what, Trspi_Error_String(err));
 
@@ -76,7 +91,8 @@ int try_policy_or_passphrase(const char * what, const char * what_for, TSS_HPOLI
 		quickscope_wrapper pass_deleter{[&] { free(pass); }};
 
 		TRY_TPM1X("set passphrase secret on policy", Tspi_Policy_SetSecret(policy, TSS_SECRET_MODE_PLAIN, pass_len, pass));
-		err = func();
+		if((err = func()) == TPM_SUCCESS)
+			passphrase_cache_put(what_for, pass, pass_len);
 	}
 
 	// TRY_TPM1X() unrolled because no constexpr/string-literal-template arguments until C++20, which is not supported by GCC 8, which we need for Buster
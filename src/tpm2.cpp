@@ -5,17 +5,44 @@
 #include "fd.hpp"
 #include "main.hpp"
 #include "parse.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <openssl/sha.h>
 #include <optional>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <tss2/tss2_mu.h>
+#include <unistd.h>
 
 
-template <class F>
-static int try_or_passphrase(const char * what, const char * what_for, ESYS_CONTEXT * tpm2_ctx, TPM2_RC valid_error, ESYS_TR passphrased_object, F && func) {
-	auto err = func();
+int tpm2_try_or_passphrase(const char * what, const char * what_for, ESYS_CONTEXT * tpm2_ctx, TPM2_RC valid_error, ESYS_TR passphrased_object,
+                           TPM2_RC (*func)(void * data), void * data) {
+	auto err = func(data);
+	{
+		uint8_t * pass{};
+		size_t pass_len{};
+		if(err == TPM2_RC_9 + valid_error && passphrase_cache_get(what_for, pass, pass_len)) {
+			quickscope_wrapper pass_deleter{[&] { free(pass); }};
+			if(pass_len <= sizeof(TPM2B_AUTH::buffer)) {
+				TPM2B_AUTH auth{};
+				auth.size = pass_len;
+				memcpy(auth.buffer, pass, auth.size);
+
+				TRY_TPM2("set passphrase", Esys_TR_SetAuth(tpm2_ctx, passphrased_object, &auth));
+				if((err = func(data)) == TPM2_RC_SUCCESS)
+					passphrase_cache_put(what_for, pass, pass_len);
+				else if(err == TPM2_RC_9 + valid_error)  // wrong, so don't try it again
+					passphrase_cache_drop(what_for);
+			} else
+				passphrase_cache_drop(what_for);
+		}
+	}
+
 	for(int i = 0; err == TPM2_RC_9 + valid_error && i < 3; ++i) {
 		if(i)
 			fprintf(stderr, "Couldn't %s: %s\n", what, Tss2_RC_Decode(err));
@@ -30,7 +57,8 @@ static int try_or_passphrase(const char * what, const char * what_for, ESYS_CONT
 		memcpy(auth.buffer, pass, auth.size);
 
 		TRY_TPM2("set passphrase", Esys_TR_SetAuth(tpm2_ctx, passphrased_object, &auth));
-		err = func();
+		if((err = func(data)) == TPM2_RC_SUCCESS)
+			passphrase_cache_put(what_for, pass, pass_len);
 	}
 
 	// TRY_TPM2() unrolled because no constexpr/string-literal-template arguments until C++20, which is not supported by GCC 8, which we need for Buster
@@ -55,31 +83,81 @@ TPM2B_DATA tpm2_creation_metadata(const char * dataset_name) {
 }
 
 
-int tpm2_parse_prop(const char * dataset_name, char * handle_s, TPMI_DH_PERSISTENT & handle, TPML_PCR_SELECTION * pcrs) {
+/// 0xFF if not a hex digit
+static uint8_t tpm2_unhex_nibble(char c) {
+	return (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0xFF;
+}
+
+/// Marshalled TPM2B_PRIVATE or TPM2B_PUBLIC, as in tpm2_create(1)'s --private= and --public= files
+static int tpm2_unhex(const char * dataset_name, const char * what, const char * hex, size_t hex_len, uint8_t * out, size_t & out_len) {
+	if(hex_len % 2 || hex_len / 2 > out_len)
+		return fprintf(stderr, "Dataset %s's %s blob has invalid length %zu.\n", dataset_name, what, hex_len), __LINE__;
+
+	out_len = hex_len / 2;
+	for(size_t i = 0; i < hex_len; ++i) {
+		auto c   = hex[i];
+		auto nib = tpm2_unhex_nibble(c);
+		if(nib == 0xFF)
+			return fprintf(stderr, "Dataset %s's %s blob: invalid hex digit %c.\n", dataset_name, what, c), __LINE__;
+		out[i / 2] = (i % 2) ? (out[i / 2] | nib) : (nib << 4);
+	}
+	return 0;
+}
+
+int tpm2_parse_prop(const char * dataset_name, char * handle_s, tpm2_sealed & sealed, TPML_PCR_SELECTION * pcrs) {
 	char * sv{};
-	if(!parse_uint(handle_s = strtok_r(handle_s, ";", &sv), handle))
+	sealed = {};
+	if(auto midpoint = strchr(handle_s = strtok_r(handle_s, ";", &sv) ?: handle_s, ':')) {
+		uint8_t marshalled[sizeof(TPM2B_PRIVATE) > sizeof(TPM2B_PUBLIC) ? sizeof(TPM2B_PRIVATE) : sizeof(TPM2B_PUBLIC)];
+		size_t marshalled_len = sizeof(marshalled);
+		TRY_MAIN(tpm2_unhex(dataset_name, "private", handle_s, midpoint - handle_s, marshalled, marshalled_len));
+		size_t offset{};
+		if(Tss2_MU_TPM2B_PRIVATE_Unmarshal(marshalled, marshalled_len, &offset, &sealed.priv) != TPM2_RC_SUCCESS || offset != marshalled_len)
+			return fprintf(stderr, "Dataset %s's private blob not valid.\n", dataset_name), __LINE__;
+
+		marshalled_len = sizeof(marshalled);
+		TRY_MAIN(tpm2_unhex(dataset_name, "public", midpoint + 1, strlen(midpoint + 1), marshalled, marshalled_len));
+		offset         = 0;
+		if(Tss2_MU_TPM2B_PUBLIC_Unmarshal(marshalled, marshalled_len, &offset, &sealed.pub) != TPM2_RC_SUCCESS || offset != marshalled_len)
+			return fprintf(stderr, "Dataset %s's public blob not valid.\n", dataset_name), __LINE__;
+	} else if(!parse_uint(handle_s, sealed.handle) || (!sealed.handle && (errno = EINVAL)))
 		return fprintf(stderr, "Dataset %s's handle %s: %s.\n", dataset_name, handle_s, strerror(errno)), __LINE__;
 
-	if(auto p = strtok_r(nullptr, ";", &sv); p && pcrs)
-		TRY_MAIN(tpm2_parse_pcrs(p, *pcrs));
+	sealed.primary = tpm2_primary::rsa;
+	while(auto p = strtok_r(nullptr, ";", &sv))
+		if(!strcmp(p, "ecc"))
+			sealed.primary = tpm2_primary::ecc;
+		else if(pcrs)
+			TRY_MAIN(tpm2_parse_pcrs(p, *pcrs));
 
 	return 0;
 }
 
+int tpm2_parse_primary(const char * arg, tpm2_primary & primary) {
+	if(!strcmp(arg, "rsa"))
+		primary = tpm2_primary::rsa;
+	else if(!strcmp(arg, "ecc"))
+		primary = tpm2_primary::ecc;
+	else
+		return fprintf(stderr, "Unknown primary key type %s (want rsa or ecc).\n", arg), __LINE__;
+	return 0;
+}
+
 
 /// Extension of the table used by tpm2-tools (tpm2_create et al.), which only has "s{m,ha}3_XXX", not "s{m,ha}3-XXX", and does case-sentitive comparisons
 #define TPM2_HASH_ALGS_MAX_NAME_LEN 8  // sha3_512
 static const constexpr struct tpm2_hash_algs_t {
 	TPM2_ALG_ID alg;
+	uint16_t digest_size;
 	const char * names[2];
-} tpm2_hash_algs[] = {{TPM2_ALG_SHA1, {"sha1"}},
-                      {TPM2_ALG_SHA256, {"sha256"}},
-                      {TPM2_ALG_SHA384, {"sha384"}},
-                      {TPM2_ALG_SHA512, {"sha512"}},
-                      {TPM2_ALG_SM3_256, {"sm3_256", "sm3-256"}},
-                      {TPM2_ALG_SHA3_256, {"sha3_256", "sha3-256"}},
-                      {TPM2_ALG_SHA3_384, {"sha3_384", "sha3-384"}},
-                      {TPM2_ALG_SHA3_512, {"sha3_512", "sha3-512"}}};
+} tpm2_hash_algs[] = {{TPM2_ALG_SHA1, TPM2_SHA1_DIGEST_SIZE, {"sha1"}},
+                      {TPM2_ALG_SHA256, TPM2_SHA256_DIGEST_SIZE, {"sha256"}},
+                      {TPM2_ALG_SHA384, TPM2_SHA384_DIGEST_SIZE, {"sha384"}},
+                      {TPM2_ALG_SHA512, TPM2_SHA512_DIGEST_SIZE, {"sha512"}},
+                      {TPM2_ALG_SM3_256, TPM2_SM3_256_DIGEST_SIZE, {"sm3_256", "sm3-256"}},
+                      {TPM2_ALG_SHA3_256, TPM2_SHA3_256_DIGEST_SIZE, {"sha3_256", "sha3-256"}},
+                      {TPM2_ALG_SHA3_384, TPM2_SHA3_384_DIGEST_SIZE, {"sha3_384", "sha3-384"}},
+                      {TPM2_ALG_SHA3_512, TPM2_SHA3_512_DIGEST_SIZE, {"sha3_512", "sha3-512"}}};
 
 static constexpr bool is_tpm2_hash_algs_sorted() {
 	for(auto itr = std::begin(tpm2_hash_algs); itr != std::end(tpm2_hash_algs) - 1; ++itr)
@@ -89,11 +167,15 @@ static constexpr bool is_tpm2_hash_algs_sorted() {
 }
 static_assert(is_tpm2_hash_algs_sorted());  // for the binary_search() below
 
-/// Assuming always != end: we always parse first
-static const char * tpm2_hash_alg_name(TPM2_ALG_ID id) {
-	return std::lower_bound(std::begin(tpm2_hash_algs), std::end(tpm2_hash_algs), tpm2_hash_algs_t{id, {}},
-	                        [&](auto && lhs, auto && rhs) { return lhs.alg < rhs.alg; })
-	    ->names[0];
+static const tpm2_hash_algs_t * tpm2_hash_alg(TPM2_ALG_ID id) {
+	auto alg = std::lower_bound(std::begin(tpm2_hash_algs), std::end(tpm2_hash_algs), tpm2_hash_algs_t{id, 0, {}},
+	                            [&](auto && lhs, auto && rhs) { return lhs.alg < rhs.alg; });
+	return (alg != std::end(tpm2_hash_algs) && alg->alg == id) ? alg : nullptr;
+}
+
+const char * tpm2_hash_alg_name(TPM2_ALG_ID id) {
+	auto alg = tpm2_hash_alg(id);
+	return alg ? alg->names[0] : nullptr;
 }
 
 
@@ -116,8 +198,11 @@ static const char * tpm2_hash_alg_name(TPM2_ALG_ID id) {
 #define TPM2_PCR_SELECT_MAX_BUT_STRONGER ((TPM2_MAX_PCRS_BUT_STRONGER + 7) / 8)
 static_assert(TPM2_PCR_SELECT_MAX_BUT_STRONGER <= sizeof(TPMS_PCR_SELECT::pcrSelect));
 
-int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs) {
+int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs, tpm2_pcr_values * expected) {
 	TPMS_PCR_SELECTION * bank = pcrs.pcrSelections;
+	size_t selected{};
+	if(expected)
+		expected->count = 0;
 
 	char * ph_sv{};
 	for(auto per_hash = strtok_r(arg, "+", &ph_sv); per_hash; per_hash = strtok_r(nullptr, "+", &ph_sv), ++bank) {
@@ -137,8 +222,7 @@ int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs) {
 			   alg != std::end(tpm2_hash_algs))
 				bank->hash = alg->alg;
 			else {
-				if(!parse_uint(per_hash, bank->hash) || !std::binary_search(std::begin(tpm2_hash_algs), std::end(tpm2_hash_algs), tpm2_hash_algs_t{bank->hash, {}},
-				                                                            [&](auto && lhs, auto && rhs) { return lhs.alg < rhs.alg; })) {
+				if(!parse_uint(per_hash, bank->hash) || !tpm2_hash_alg(bank->hash)) {
 					fprintf(stderr,
 					        "Unknown hash algorithm %s.\n"
 					        "Can be any of case-insensitive ",
@@ -154,19 +238,50 @@ int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs) {
 
 			bank->sizeofSelect = TPM2_PCR_SELECT_MAX_BUT_STRONGER;
 			if(!strcasecmp(values, "all"))
-				memset(bank->pcrSelect, 0xFF, bank->sizeofSelect);
+				memset(bank->pcrSelect, 0xFF, bank->sizeofSelect), selected += TPM2_MAX_PCRS_BUT_STRONGER;
 			else if(!strcasecmp(values, "none"))
 				;  // already 0
 			else {
 				char * sv{};
 				for(values = strtok_r(values, ", ", &sv); values; values = strtok_r(nullptr, ", ", &sv)) {
+					auto value = strchr(values, '=');
+					if(value)
+						*value++ = '\0';
+
 					uint8_t pcr;
 					if(!parse_uint(values, pcr))
 						return fprintf(stderr, "PCR %s: %s\n", values, strerror(errno)), __LINE__;
 					if(pcr > TPM2_MAX_PCRS_BUT_STRONGER - 1)
 						return fprintf(stderr, "PCR %s: %s, max %u\n", values, strerror(ERANGE), TPM2_MAX_PCRS_BUT_STRONGER - 1), __LINE__;
 
+					if(!(bank->pcrSelect[pcr / 8] & (1 << (pcr % 8))))
+						++selected;
 					bank->pcrSelect[pcr / 8] |= 1 << (pcr % 8);
+
+					if(value) {
+						if(!expected)
+							return fprintf(stderr, "PCR %s: can't have an expected value here\n", values), __LINE__;
+						if(expected->count == sizeof(expected->values) / sizeof(*expected->values))
+							return fprintf(stderr, "Too many expected PCR values! Can only have up to %zu\n", sizeof(expected->values) / sizeof(*expected->values)),
+							       __LINE__;
+
+						auto & into     = expected->values[expected->count++];
+						auto value_len  = strlen(value);
+						auto alg        = tpm2_hash_alg(bank->hash);
+						into.hash       = bank->hash;
+						into.pcr        = pcr;
+						into.value.size = alg->digest_size;
+						if(value_len != alg->digest_size * 2u)
+							return fprintf(stderr, "PCR %s: expected value %s has length %zu, but %s needs %u hex digits\n", values, value, value_len, alg->names[0],
+							               alg->digest_size * 2u),
+							       __LINE__;
+						for(size_t i = 0; i < value_len; ++i) {
+							auto nib = tpm2_unhex_nibble(value[i]);
+							if(nib == 0xFF)
+								return fprintf(stderr, "PCR %s: expected value %s: invalid hex digit %c\n", values, value, value[i]), __LINE__;
+							into.value.buffer[i / 2] = (i % 2) ? (into.value.buffer[i / 2] | nib) : (nib << 4);
+						}
+					}
 				}
 			}
 		} else
@@ -174,16 +289,37 @@ int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs) {
 	}
 
 	pcrs.count = bank - pcrs.pcrSelections;
+	if(expected && expected->count && expected->count != selected)
+		return fprintf(stderr, "%zu expected PCR values for %zu PCRs: need one for each, or none.\n", expected->count, selected), __LINE__;
 	return 0;
 }
 
-int tpm2_unparse_prop(TPMI_DH_PERSISTENT persistent_handle, const TPML_PCR_SELECTION & pcrs, char ** prop) {
-	// 0xFFFFFFFF;sha3_512:00,01,02,03,04,05,06,07,08,09,10,11,12,13,14,15,16,17,18,19,20,21,22+sha3_...
+int tpm2_unparse_prop(const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, char ** prop) {
+	uint8_t marshalled_priv[sizeof(TPM2B_PRIVATE)];
+	uint8_t marshalled_pub[sizeof(TPM2B_PUBLIC)];
+	size_t marshalled_priv_len{}, marshalled_pub_len{};
+	if(!sealed.handle) {
+		TRY_TPM2("marshal private blob", Tss2_MU_TPM2B_PRIVATE_Marshal(&sealed.priv, marshalled_priv, sizeof(marshalled_priv), &marshalled_priv_len));
+		TRY_TPM2("marshal public blob", Tss2_MU_TPM2B_PUBLIC_Marshal(&sealed.pub, marshalled_pub, sizeof(marshalled_pub), &marshalled_pub_len));
+	}
+
+	// 0xFFFFFFFF;sha3_512:00,01,02,03,04,05,06,07,08,09,10,11,12,13,14,15,16,17,18,19,20,21,22+sha3_...;ecc
+	// or
+	// 00AB...:0030...;sha3_512:...;ecc
 	*prop = TRY_PTR("allocate property value",
-	                reinterpret_cast<char *>(malloc(2 + 8 + pcrs.count * (1 + TPM2_HASH_ALGS_MAX_NAME_LEN + (TPM2_MAX_PCRS_BUT_STRONGER - 1) * 3) + 1)));
+	                reinterpret_cast<char *>(malloc((sealed.handle ? 2 + 8 : marshalled_priv_len * 2 + 1 + marshalled_pub_len * 2) +
+	                                                pcrs.count * (1 + TPM2_HASH_ALGS_MAX_NAME_LEN + (TPM2_MAX_PCRS_BUT_STRONGER - 1) * 3) + 4 + 1)));
 
 	auto cur = *prop;
-	cur += sprintf(cur, "0x%" PRIX32 "", persistent_handle);
+	if(sealed.handle)
+		cur += sprintf(cur, "0x%" PRIX32 "", sealed.handle);
+	else {
+		for(size_t i = 0; i < marshalled_priv_len; ++i)
+			cur += sprintf(cur, "%02" PRIX8 "", marshalled_priv[i]);
+		*cur++ = ':';
+		for(size_t i = 0; i < marshalled_pub_len; ++i)
+			cur += sprintf(cur, "%02" PRIX8 "", marshalled_pub[i]);
+	}
 
 	auto pre = ';';
 	for(size_t i = 0; i < pcrs.count; ++i) {
@@ -207,6 +343,9 @@ int tpm2_unparse_prop(TPMI_DH_PERSISTENT persistent_handle, const TPML_PCR_SELEC
 		}
 	}
 
+	if(sealed.primary == tpm2_primary::ecc)
+		memcpy(cur, ";ecc", strlen(";ecc")), cur += strlen(";ecc");
+
 	*cur = '\0';
 	return 0;
 }
@@ -214,7 +353,7 @@ int tpm2_unparse_prop(TPMI_DH_PERSISTENT persistent_handle, const TPML_PCR_SELEC
 
 int tpm2_generate_rand(ESYS_CONTEXT * tpm2_ctx, void * into, size_t length) {
 	TPM2B_DIGEST * rand{};
-	TRY_TPM2("get random data from TPM", Esys_GetRandom(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, length, &rand));
+	TRY_TPM2("get random data from TPM", TRACE("Esys_GetRandom", Esys_GetRandom(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, length, &rand)));
 	quickscope_wrapper rand_deleter{[&] { Esys_Free(rand); }};
 
 	if(rand->size != length)
@@ -225,147 +364,373 @@ int tpm2_generate_rand(ESYS_CONTEXT * tpm2_ctx, void * into, size_t length) {
 }
 
 
-static int tpm2_find_unused_persistent_non_platform(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT & persistent_handle) {
-	TPMS_CAPABILITY_DATA * cap{};  // TODO: check for more data?
-	TRY_TPM2("Read used persistent TPM handles", Esys_GetCapability(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, TPM2_CAP_HANDLES, TPM2_PERSISTENT_FIRST,
-	                                                                TPM2_MAX_CAP_HANDLES, nullptr, &cap));
-	quickscope_wrapper cap_deleter{[&] { Esys_Free(cap); }};
+/// The originals, saved on first hook; every TCTI we open is the same kind, so these are the same for all of them
+static TSS2_TCTI_TRANSMIT_FCN tpm2_tcti_transmit;
+static TSS2_TCTI_RECEIVE_FCN tpm2_tcti_receive;
 
-	persistent_handle = 0;
-	switch(cap->data.handles.count) {
-		case 0:
-			persistent_handle = TPM2_PERSISTENT_FIRST;
-			break;
-		case TPM2_MAX_CAP_HANDLES:
-			break;
-		default:
-			for(TPM2_HC i = TPM2_PERSISTENT_FIRST; i <= TPM2_PERSISTENT_LAST && i <= TPM2_PLATFORM_PERSISTENT; ++i)
-				if(std::find(std::begin(cap->data.handles.handle), std::end(cap->data.handles.handle), i) == std::end(cap->data.handles.handle)) {
-					persistent_handle = i;
-					break;
-				}
+/// Commands start with a TPMI_ST_COMMAND_TAG, the UINT32 size, then the big-endian TPM2_CC
+static TSS2_RC tpm2_tcti_traced_transmit(TSS2_TCTI_CONTEXT * tcti, size_t size, const uint8_t * command) {
+	++trace_tpm.round_trips;
+	trace_tpm.command_bytes += size;
+	if(size >= 10 && ((TPM2_CC{command[6]} << 24) | (TPM2_CC{command[7]} << 16) | (TPM2_CC{command[8]} << 8) | TPM2_CC{command[9]}) == TPM2_CC_PCR_Read)
+		++trace_tpm.pcr_reads;
+	return tpm2_tcti_transmit(tcti, size, command);
+}
+
+static TSS2_RC tpm2_tcti_traced_receive(TSS2_TCTI_CONTEXT * tcti, size_t * size, uint8_t * response, int32_t timeout) {
+	auto err = tpm2_tcti_receive(tcti, size, response, timeout);
+	if(err == TPM2_RC_SUCCESS && response)  // else just asking for the size
+		trace_tpm.response_bytes += *size;
+	return err;
+}
+
+void tpm2_trace_tcti(ESYS_CONTEXT * tpm2_ctx) {
+	TSS2_TCTI_CONTEXT * tcti{};
+	if(!trace_file || Esys_GetTcti(tpm2_ctx, &tcti) != TPM2_RC_SUCCESS || !tcti)
+		return;
+
+	/// Every command goes through these two, so that's all the round trips
+	auto & transmit = TSS2_TCTI_TRANSMIT(tcti);
+	auto & receive  = TSS2_TCTI_RECEIVE(tcti);
+	if(transmit == tpm2_tcti_traced_transmit)  // already hooked; wrapping again would count everything twice (and call ourselves forever)
+		return;
+	tpm2_tcti_transmit = transmit;
+	tpm2_tcti_receive  = receive;
+
+	transmit = tpm2_tcti_traced_transmit;
+	receive  = tpm2_tcti_traced_receive;
+}
+
+
+/// Handles come back in ascending order, so the lowest unused one is the first gap, and we stop reading as soon as we find it
+int tpm2_find_unused_persistent_non_platform(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT & persistent_handle) {
+	persistent_handle = TPM2_PERSISTENT_FIRST;
+	TRY_MAIN(tpm2_for_all_persistent(tpm2_ctx, TPM2_PERSISTENT_FIRST, [&](auto handle) {
+		if(handle != persistent_handle)
+			return false;
+		++persistent_handle;
+		return true;
+	}));
+
+	if(persistent_handle >= TPM2_PLATFORM_PERSISTENT)
+		return fprintf(stderr, "All %" PRIu32 " persistent handles allocated! We're fucked!\n", TPM2_PLATFORM_PERSISTENT - TPM2_PERSISTENT_FIRST), __LINE__;
+	return 0;
+}
+
+static int tpm2_lock(const char * path, int operation) {
+	if(mkdir(TPM2_PRIMARY_CACHE_DIR, 0700) == -1 && errno != EEXIST)
+		return -1;
+	auto lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(lock != -1)
+		while(flock(lock, operation) == -1)
+			if(errno != EINTR) {
+				auto err = errno;
+				close(lock);
+				return errno = err, -1;
+			}
+	return lock;
+}
+
+int tpm2_lock_persistent() {
+	return tpm2_lock(TPM2_PRIMARY_CACHE_DIR "/tpm2-persistent.lock", LOCK_EX);
+}
+
+int tpm2_lock_gc(bool exclusive) {
+	return tpm2_lock(TPM2_PRIMARY_CACHE_DIR "/tpm2-gc.lock", exclusive ? LOCK_EX : LOCK_SH);
+}
+
+/// SHA-256 of the current values of pcrs, in order, as PolicyPCR takes them; re-read from the start if they change in-between reads
+static int tpm2_read_pcrs_digest(ESYS_CONTEXT * tpm2_ctx, const TPML_PCR_SELECTION & pcrs, TPM2B_DIGEST & digested_pcrs) {
+	static_assert(sizeof(TPM2B_DIGEST::buffer) >= SHA256_DIGEST_LENGTH);
+	digested_pcrs.size = SHA256_DIGEST_LENGTH;
+
+	trace_span pcr_read_span{"Esys_PCR_Read"};  // all of them, with retries
+	SHA256_CTX ctx;
+new_pcrs:
+	std::optional<uint32_t> update_count;
+	SHA256_Init(&ctx);
+	auto pcrs_left = pcrs;
+	while(std::any_of(pcrs_left.pcrSelections, pcrs_left.pcrSelections + pcrs_left.count,
+	                  [](auto && sel) { return std::any_of(sel.pcrSelect, sel.pcrSelect + sel.sizeofSelect, [](auto b) { return b; }); })) {
+		uint32_t out_upcnt{};
+		TPML_PCR_SELECTION * out_sel{};
+		TPML_DIGEST * out_val{};
+		TRY_TPM2("read PCRs", Esys_PCR_Read(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &pcrs_left, &out_upcnt, &out_sel, &out_val));
+		quickscope_wrapper out_deleter{[&] { Esys_Free(out_val), Esys_Free(out_sel); }};
+
+		if(update_count && update_count != out_upcnt)
+			goto new_pcrs;
+		update_count = out_upcnt;
+
+		if(!out_val->count) {  // this can happen with SHA1 disabled, for example
+			auto first = true;
+			fputs("No PCRs when asking for ", stderr);
+			for(size_t i = 0; i < pcrs_left.count; ++i)
+				if(std::any_of(pcrs_left.pcrSelections[i].pcrSelect, pcrs_left.pcrSelections[i].pcrSelect + pcrs_left.pcrSelections[i].sizeofSelect,
+				               [](auto b) { return b; }))
+					fprintf(stderr, "%s%s", std::exchange(first, false) ? "" : ", ", tpm2_hash_alg_name(pcrs_left.pcrSelections[i].hash));
+			return fputs(": does the TPM support the algorithm?\n", stderr), __LINE__;
+		}
+
+		for(size_t i = 0; i < out_val->count; ++i)
+			SHA256_Update(&ctx, out_val->digests[i].buffer, out_val->digests[i].size);
+
+		for(size_t i = 0; i < out_sel->count; ++i)
+			for(size_t j = 0u; j < out_sel->pcrSelections[i].sizeofSelect; ++j)
+				pcrs_left.pcrSelections[i].pcrSelect[j] &= ~out_sel->pcrSelections[i].pcrSelect[j];
 	}
 
-	if(!persistent_handle)
-		return fprintf(stderr, "All %zu persistent handles allocated! We're fucked!\n", TPM2_MAX_CAP_HANDLES), __LINE__;
+	SHA256_Final(digested_pcrs.buffer, &ctx);
 	return 0;
 }
 
-template <class F>
-static int tpm2_police_pcrs(ESYS_CONTEXT * tpm2_ctx, const TPML_PCR_SELECTION & pcrs, TPM2_SE session_type, F && with_session) {
-	if(!pcrs.count)
-		return with_session(ESYS_TR_NONE);
+/// What PolicyGetDigest would return after PolicyPCR(digested_pcrs, pcrs) in a SHA-256 trial session at previous, without a TPM:
+///   SHA-256(previous || TPM2_CC_PolicyPCR || marshalled pcrs || digested_pcrs)
+/// An empty previous is a fresh session's zeroes; policy_digest can be previous.
+static int tpm2_policy_pcr_digest(const TPM2B_DIGEST & previous, const TPML_PCR_SELECTION & pcrs, const TPM2B_DIGEST & digested_pcrs,
+                                  TPM2B_DIGEST & policy_digest) {
+	if(previous.size && previous.size != SHA256_DIGEST_LENGTH)
+		return fprintf(stderr, "Previous policy digest has length %" PRIu16 ", expected %d.\n", previous.size, SHA256_DIGEST_LENGTH), __LINE__;
+
+	uint8_t marshalled_cc[sizeof(TPM2_CC)];
+	uint8_t marshalled_pcrs[sizeof(TPML_PCR_SELECTION)];
+	size_t marshalled_cc_len{}, marshalled_pcrs_len{};
+	TRY_TPM2("marshal PolicyPCR command code", Tss2_MU_TPM2_CC_Marshal(TPM2_CC_PolicyPCR, marshalled_cc, sizeof(marshalled_cc), &marshalled_cc_len));
+	TRY_TPM2("marshal PCR selection", Tss2_MU_TPML_PCR_SELECTION_Marshal(&pcrs, marshalled_pcrs, sizeof(marshalled_pcrs), &marshalled_pcrs_len));
+
+	const uint8_t initial_policy[SHA256_DIGEST_LENGTH]{};
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, previous.size ? previous.buffer : initial_policy, SHA256_DIGEST_LENGTH);
+	SHA256_Update(&ctx, marshalled_cc, marshalled_cc_len);
+	SHA256_Update(&ctx, marshalled_pcrs, marshalled_pcrs_len);
+	SHA256_Update(&ctx, digested_pcrs.buffer, digested_pcrs.size);
+	SHA256_Final(policy_digest.buffer, &ctx);
+	policy_digest.size = SHA256_DIGEST_LENGTH;
+	return 0;
+}
 
+int tpm2_pcr_policy(const TPML_PCR_SELECTION & pcrs, const tpm2_pcr_values & expected, TPM2B_DIGEST & policy_digest) {
 	TPM2B_DIGEST digested_pcrs{};
 	digested_pcrs.size = SHA256_DIGEST_LENGTH;
-	static_assert(sizeof(TPM2B_DIGEST::buffer) >= SHA256_DIGEST_LENGTH);
 
-	{
-		SHA256_CTX ctx;
-	new_pcrs:
-		std::optional<uint32_t> update_count;
-		SHA256_Init(&ctx);
-		auto pcrs_left = pcrs;
-		while(std::any_of(pcrs_left.pcrSelections, pcrs_left.pcrSelections + pcrs_left.count,
-		                  [](auto && sel) { return std::any_of(sel.pcrSelect, sel.pcrSelect + sel.sizeofSelect, [](auto b) { return b; }); })) {
-			uint32_t out_upcnt{};
-			TPML_PCR_SELECTION * out_sel{};
-			TPML_DIGEST * out_val{};
-			TRY_TPM2("read PCRs", Esys_PCR_Read(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &pcrs_left, &out_upcnt, &out_sel, &out_val));
-			quickscope_wrapper out_deleter{[&] { Esys_Free(out_val), Esys_Free(out_sel); }};
-
-			if(update_count && update_count != out_upcnt)
-				goto new_pcrs;
-			update_count = out_upcnt;
-
-			if(!out_val->count) {  // this can happen with SHA1 disabled, for example
-				auto first = true;
-				fputs("No PCRs when asking for ", stderr);
-				for(size_t i = 0; i < pcrs_left.count; ++i)
-					if(std::any_of(pcrs_left.pcrSelections[i].pcrSelect, pcrs_left.pcrSelections[i].pcrSelect + pcrs_left.pcrSelections[i].sizeofSelect,
-					               [](auto b) { return b; }))
-						fprintf(stderr, "%s%s", std::exchange(first, false) ? "" : ", ", tpm2_hash_alg_name(pcrs_left.pcrSelections[i].hash));
-				return fputs(": does the TPM support the algorithm?\n", stderr), __LINE__;
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	for(auto bank = pcrs.pcrSelections; bank != pcrs.pcrSelections + pcrs.count; ++bank)
+		for(uint8_t pcr = 0; pcr < bank->sizeofSelect * 8; ++pcr)
+			if(bank->pcrSelect[pcr / 8] & (1 << (pcr % 8))) {
+				auto value = std::find_if(expected.values, expected.values + expected.count, [&](auto && v) { return v.hash == bank->hash && v.pcr == pcr; });
+				if(value == expected.values + expected.count)
+					return fprintf(stderr, "No expected value for %s PCR %" PRIu8 ".\n", tpm2_hash_alg_name(bank->hash), pcr), __LINE__;
+				SHA256_Update(&ctx, value->value.buffer, value->value.size);
 			}
+	SHA256_Final(digested_pcrs.buffer, &ctx);
 
-			for(size_t i = 0; i < out_val->count; ++i)
-				SHA256_Update(&ctx, out_val->digests[i].buffer, out_val->digests[i].size);
+	return tpm2_policy_pcr_digest(TPM2B_DIGEST{}, pcrs, digested_pcrs, policy_digest);
+}
 
-			for(size_t i = 0; i < out_sel->count; ++i)
-				for(size_t j = 0u; j < out_sel->pcrSelections[i].sizeofSelect; ++j)
-					pcrs_left.pcrSelections[i].pcrSelect[j] &= ~out_sel->pcrSelections[i].pcrSelect[j];
-		}
+const TPM2B_DIGEST * tpm2_pcr_policies_find(const tpm2_pcr_policies * policies, const TPML_PCR_SELECTION & pcrs) {
+	if(!policies)
+		return nullptr;
+	auto policy = std::find_if(policies->pcrs, policies->pcrs + policies->count, [&](auto && p) { return !memcmp(&p, &pcrs, sizeof(pcrs)); });
+	return policy != policies->pcrs + policies->count ? &policies->digests[policy - policies->pcrs] : nullptr;
+}
 
-		SHA256_Final(digested_pcrs.buffer, &ctx);
+void tpm2_pcr_policies_add(tpm2_pcr_policies * policies, const TPML_PCR_SELECTION & pcrs, const TPM2B_DIGEST & policy_digest) {
+	if(policies && policies->count < sizeof(policies->pcrs) / sizeof(*policies->pcrs)) {
+		policies->pcrs[policies->count]      = pcrs;
+		policies->digests[policies->count++] = policy_digest;
 	}
+}
 
 
-	ESYS_TR pcr_session = ESYS_TR_NONE;
-	quickscope_wrapper tpm2_session_deleter{[&] { Esys_FlushContext(tpm2_ctx, pcr_session); }};
+/// If reuse_session is non-null, the session is taken from (or, if ESYS_TR_NONE, started into) it and reset with PolicyRestart instead of being flushed.
+///
+/// With an empty digest, PolicyPCR uses the current PCR values, read atomically by the TPM itself
+template <class F>
+static int tpm2_police_pcrs(ESYS_CONTEXT * tpm2_ctx, const TPML_PCR_SELECTION & pcrs, ESYS_TR * reuse_session, F && with_session) {
+	if(!pcrs.count)
+		return with_session(ESYS_TR_NONE);
+
+	ESYS_TR own_session = ESYS_TR_NONE;
+	quickscope_wrapper tpm2_session_deleter{[&] { Esys_FlushContext(tpm2_ctx, own_session); }};
 
-	TRY_TPM2("start PCR session", Esys_StartAuthSession(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, nullptr, session_type,
-	                                                    &tpm2_session_key, TPM2_ALG_SHA256, &pcr_session));
+	auto & pcr_session = reuse_session ? *reuse_session : own_session;
+	if(pcr_session == ESYS_TR_NONE)
+		TRY_TPM2("start PCR session", TRACE("Esys_StartAuthSession", Esys_StartAuthSession(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+		                                                                                   ESYS_TR_NONE, nullptr, TPM2_SE_POLICY, &tpm2_session_key,
+		                                                                                   TPM2_ALG_SHA256, &pcr_session)));
+	else
+		TRY_TPM2("restart PCR session", TRACE("Esys_PolicyRestart", Esys_PolicyRestart(tpm2_ctx, pcr_session, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE)));
 
 
-	TRY_TPM2("create PCR policy", Esys_PolicyPCR(tpm2_ctx, pcr_session, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &digested_pcrs, &pcrs));
+	const TPM2B_DIGEST current_pcrs{};
+	TRY_TPM2("create PCR policy",
+	         TRACE("Esys_PolicyPCR", Esys_PolicyPCR(tpm2_ctx, pcr_session, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &current_pcrs, &pcrs)));
 
 	return with_session(pcr_session);
 }
 
-int tpm2_seal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT & persistent_handle, const TPM2B_DATA & metadata,
-              const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass, void * data, size_t data_len) {
-	ESYS_TR primary_handle = ESYS_TR_NONE;
-	quickscope_wrapper primary_handle_deleter{[&] { Esys_FlushContext(tpm2_ctx, primary_handle); }};
+TPM2B_PUBLIC tpm2_primary_template(tpm2_primary primary) {
+	TPM2B_PUBLIC pub{};
+	pub.publicArea.objectAttributes = TPMA_OBJECT_USERWITHAUTH | TPMA_OBJECT_RESTRICTED | TPMA_OBJECT_DECRYPT | TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT |
+	                                  TPMA_OBJECT_SENSITIVEDATAORIGIN;
+	switch(primary) {
+		case tpm2_primary::rsa:
+			// Adapted from tpm2-tss-3.0.1/test/integration/esys-create-primary-hmac.int.c
+			pub.publicArea.type                                       = TPM2_ALG_RSA;
+			pub.publicArea.nameAlg                                    = TPM2_ALG_SHA1;
+			pub.publicArea.parameters.rsaDetail.symmetric.algorithm   = TPM2_ALG_AES;
+			pub.publicArea.parameters.rsaDetail.symmetric.keyBits.aes = 128;
+			pub.publicArea.parameters.rsaDetail.symmetric.mode.aes    = TPM2_ALG_CFB;
+			pub.publicArea.parameters.rsaDetail.scheme.scheme         = TPM2_ALG_NULL;
+			pub.publicArea.parameters.rsaDetail.keyBits               = 2048;
+			pub.publicArea.parameters.rsaDetail.exponent              = 0;
+			break;
+		case tpm2_primary::ecc:
+			// Same as tpm2_createprimary(1) -G ecc; key generation is a point multiplication instead of a prime search, so much faster on slow TPMs
+			pub.publicArea.type                                       = TPM2_ALG_ECC;
+			pub.publicArea.nameAlg                                    = TPM2_ALG_SHA256;
+			pub.publicArea.parameters.eccDetail.symmetric.algorithm   = TPM2_ALG_AES;
+			pub.publicArea.parameters.eccDetail.symmetric.keyBits.aes = 128;
+			pub.publicArea.parameters.eccDetail.symmetric.mode.aes    = TPM2_ALG_CFB;
+			pub.publicArea.parameters.eccDetail.scheme.scheme         = TPM2_ALG_NULL;
+			pub.publicArea.parameters.eccDetail.curveID               = TPM2_ECC_NIST_P256;
+			pub.publicArea.parameters.eccDetail.kdf.scheme            = TPM2_ALG_NULL;
+			break;
+	}
+	return pub;
+}
+
+#define TPM2_PRIMARY_CACHE_PATH_MAX (sizeof(TPM2_PRIMARY_CACHE_DIR "/primary-.ctx") + SHA256_DIGEST_LENGTH * 2)
 
-	{
-		const TPM2B_SENSITIVE_CREATE primary_sens{};
+/// TPM2_PRIMARY_CACHE_DIR/primary-<SHA-256 of the marshalled template>.ctx
+static bool tpm2_primary_cache_path(const TPM2B_PUBLIC & pub, char (&path)[TPM2_PRIMARY_CACHE_PATH_MAX]) {
+	uint8_t marshalled[sizeof(TPM2B_PUBLIC)];
+	size_t marshalled_len{};
+	if(Tss2_MU_TPM2B_PUBLIC_Marshal(&pub, marshalled, sizeof(marshalled), &marshalled_len) != TPM2_RC_SUCCESS)
+		return false;
 
-		// Adapted from tpm2-tss-3.0.1/test/integration/esys-create-primary-hmac.int.c
-		TPM2B_PUBLIC pub{};
-		pub.publicArea.type             = TPM2_ALG_RSA;
-		pub.publicArea.nameAlg          = TPM2_ALG_SHA1;
-		pub.publicArea.objectAttributes = TPMA_OBJECT_USERWITHAUTH | TPMA_OBJECT_RESTRICTED | TPMA_OBJECT_DECRYPT | TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT |
-		                                  TPMA_OBJECT_SENSITIVEDATAORIGIN;
-		pub.publicArea.parameters.rsaDetail.symmetric.algorithm   = TPM2_ALG_AES;
-		pub.publicArea.parameters.rsaDetail.symmetric.keyBits.aes = 128;
-		pub.publicArea.parameters.rsaDetail.symmetric.mode.aes    = TPM2_ALG_CFB;
-		pub.publicArea.parameters.rsaDetail.scheme.scheme         = TPM2_ALG_NULL;
-		pub.publicArea.parameters.rsaDetail.keyBits               = 2048;
-		pub.publicArea.parameters.rsaDetail.exponent              = 0;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	SHA256(marshalled, marshalled_len, digest);
+
+	auto cur = path + sprintf(path, TPM2_PRIMARY_CACHE_DIR "/primary-");
+	for(auto b : digest)
+		cur += sprintf(cur, "%02" PRIx8 "", b);
+	strcpy(cur, ".ctx");
+	return true;
+}
+
+/// The saved context is only loadable on this TPM until it's reset or the owner hierarchy is cleared, and is integrity-protected by the TPM itself,
+/// so any failure to load it just means creating the primary anew. Failing to save it is not an error either
+static void tpm2_load_cached_primary(ESYS_CONTEXT * tpm2_ctx, const char * path, ESYS_TR & primary_handle) {
+	auto fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return;
+	quickscope_wrapper fd_deleter{[=] { close(fd); }};
+
+	uint8_t marshalled[sizeof(TPMS_CONTEXT)];
+	auto rd = read(fd, marshalled, sizeof(marshalled));
+
+	TPMS_CONTEXT saved{};
+	size_t offset{};
+	if(rd <= 0 || Tss2_MU_TPMS_CONTEXT_Unmarshal(marshalled, rd, &offset, &saved) != TPM2_RC_SUCCESS || offset != static_cast<size_t>(rd) ||
+	   TRACE("Esys_ContextLoad", Esys_ContextLoad(tpm2_ctx, &saved, &primary_handle)) != TPM2_RC_SUCCESS) {
+		primary_handle = ESYS_TR_NONE;
+		unlink(path);
+	}
+}
+
+static void tpm2_save_cached_primary(ESYS_CONTEXT * tpm2_ctx, const char * path, ESYS_TR primary_handle) {
+	TPMS_CONTEXT * saved{};
+	if(TRACE("Esys_ContextSave", Esys_ContextSave(tpm2_ctx, primary_handle, &saved)) != TPM2_RC_SUCCESS)
+		return;
+	quickscope_wrapper saved_deleter{[&] { Esys_Free(saved); }};
+
+	uint8_t marshalled[sizeof(TPMS_CONTEXT)];
+	size_t marshalled_len{};
+	if(Tss2_MU_TPMS_CONTEXT_Marshal(saved, marshalled, sizeof(marshalled), &marshalled_len) != TPM2_RC_SUCCESS)
+		return;
+
+	if(mkdir(TPM2_PRIMARY_CACHE_DIR, 0700) == -1 && errno != EEXIST)
+		return;
+	char tmp_path[TPM2_PRIMARY_CACHE_PATH_MAX + 1 + 20];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, static_cast<long>(getpid()));
+	auto fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd == -1)
+		return;
+	auto ok = write(fd, marshalled, marshalled_len) == static_cast<ssize_t>(marshalled_len);
+	ok      = !close(fd) && ok;
+	if(!ok || rename(tmp_path, path) == -1)  // Atomic, so concurrent seals never see half a context
+		unlink(tmp_path);
+}
+
+/// The primary key is a function of the template and the owner seed only, so a context saved by a previous process is just as good;
+/// this saves both the key generation and the owner passphrase
+static int tpm2_load_primary(ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, tpm2_primary primary, const TPM2B_DATA & metadata, const TPML_PCR_SELECTION & pcrs,
+                             ESYS_TR & primary_handle) {
+	if(primary_handle != ESYS_TR_NONE)
+		return 0;
+
+	const auto pub = tpm2_primary_template(primary);
+	char cache_path[TPM2_PRIMARY_CACHE_PATH_MAX];
+	auto cacheable = tpm2_primary_cache_path(pub, cache_path);
+	if(cacheable)
+		tpm2_load_cached_primary(tpm2_ctx, cache_path, primary_handle);
+
+	if(primary_handle == ESYS_TR_NONE) {
+		const TPM2B_SENSITIVE_CREATE primary_sens{};
 		TRY_MAIN(try_or_passphrase("create primary encryption key", "TPM2 owner hierarchy", tpm2_ctx, TPM2_RC_BAD_AUTH, ESYS_TR_RH_OWNER, [&] {
-			return Esys_CreatePrimary(tpm2_ctx, ESYS_TR_RH_OWNER, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &primary_sens, &pub, &metadata, &pcrs, &primary_handle,
-			                          nullptr, nullptr, nullptr, nullptr);
+			return TRACE("Esys_CreatePrimary", Esys_CreatePrimary(tpm2_ctx, ESYS_TR_RH_OWNER, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &primary_sens, &pub,
+			                                                      &metadata, &pcrs, &primary_handle, nullptr, nullptr, nullptr, nullptr));
 		}));
 
-		// TSS2_RC Esys_CertifyCreation 	( 	ESYS_CONTEXT *  	esysContext,
-		//		ESYS_TR  	signHandle,
-		//		ESYS_TR  	objectHandle,
-		//		ESYS_TR  	shandle1,
-		//		ESYS_TR  	shandle2,
-		//		ESYS_TR  	shandle3,
-		//		const TPM2B_DATA *  	qualifyingData,
-		//		const TPM2B_DIGEST *  	creationHash,
-		//		const TPMT_SIG_SCHEME *  	inScheme,
-		//		const TPMT_TK_CREATION *  	creationTicket,
-		//		TPM2B_ATTEST **  	certifyInfo,
-		//		TPMT_SIGNATURE **  	signature
-		//	)
+		if(cacheable)
+			tpm2_save_cached_primary(tpm2_ctx, cache_path, primary_handle);
 	}
 
+	return 0;
+}
+
+#define TPM2_SEALED_ATTRIBUTES (TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT)
+
+int tpm2_seal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, ESYS_TR & primary_handle, tpm2_sealed & sealed, bool persistent,
+              const TPM2B_DATA & metadata, const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass, void * data, size_t data_len,
+              tpm2_pcr_policies * policies) {
+	TRY_MAIN(tpm2_load_primary(tpm2_ctx, tpm2_session, sealed.primary, metadata, pcrs, primary_handle));
+
+	// TSS2_RC Esys_CertifyCreation 	( 	ESYS_CONTEXT *  	esysContext,
+	//		ESYS_TR  	signHandle,
+	//		ESYS_TR  	objectHandle,
+	//		ESYS_TR  	shandle1,
+	//		ESYS_TR  	shandle2,
+	//		ESYS_TR  	shandle3,
+	//		const TPM2B_DATA *  	qualifyingData,
+	//		const TPM2B_DIGEST *  	creationHash,
+	//		const TPMT_SIG_SCHEME *  	inScheme,
+	//		const TPMT_TK_CREATION *  	creationTicket,
+	//		TPM2B_ATTEST **  	certifyInfo,
+	//		TPMT_SIGNATURE **  	signature
+	//	)
+
 	TPM2B_DIGEST policy_digest{};
-	if(pcrs.count)
-		TRY_MAIN(tpm2_police_pcrs(tpm2_ctx, pcrs, TPM2_SE_TRIAL, [&](auto pcr_session) {
-			TPM2B_DIGEST * dgst{};
-			TRY_TPM2("get PCR policy digest", Esys_PolicyGetDigest(tpm2_ctx, pcr_session, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &dgst));
-			quickscope_wrapper dgst_deleter{[&] { Esys_Free(dgst); }};
-			policy_digest = *dgst;
-			return 0;
-		}));
+	if(auto cached_policy = tpm2_pcr_policies_find(policies, pcrs))
+		policy_digest = *cached_policy;
+	else if(pcrs.count) {
+		/// Same as a trial session would give, but without the four round-trips to start it, run PolicyPCR, get the digest, and flush it
+		TPM2B_DIGEST digested_pcrs{};
+		TRY_MAIN(tpm2_read_pcrs_digest(tpm2_ctx, pcrs, digested_pcrs));
+		TRY_MAIN(tpm2_policy_pcr_digest(policy_digest, pcrs, digested_pcrs, policy_digest));
+		tpm2_pcr_policies_add(policies, pcrs, policy_digest);
+	}
 
 	TPM2B_PRIVATE * sealant_private{};
 	TPM2B_PUBLIC * sealant_public{};
 	quickscope_wrapper sealant_deleter{[&] { Esys_Free(sealant_public), Esys_Free(sealant_private); }};
 
+	ESYS_TR sealed_handle = ESYS_TR_NONE;
+	quickscope_wrapper sealed_handle_deleter{[&] { Esys_FlushContext(tpm2_ctx, sealed_handle); }};
+
 	/// This is the object with the actual sealed data in it
 	{
 		TPM2B_SENSITIVE_CREATE secret_sens{};
@@ -388,53 +753,138 @@ int tpm2_seal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_sessio
 
 		// Same args as tpm2-tools' tpm2_create(1)
 		TPM2B_PUBLIC pub{};
-		pub.publicArea.type    = TPM2_ALG_KEYEDHASH;
-		pub.publicArea.nameAlg = TPM2_ALG_SHA256;
-		pub.publicArea.objectAttributes =
-		    TPMA_OBJECT_FIXEDTPM | TPMA_OBJECT_FIXEDPARENT | ((pcrs.count && !secret_sens.sensitive.userAuth.size) ? 0 : TPMA_OBJECT_USERWITHAUTH);
+		pub.publicArea.type             = TPM2_ALG_KEYEDHASH;
+		pub.publicArea.nameAlg          = TPM2_ALG_SHA256;
+		pub.publicArea.objectAttributes = TPM2_SEALED_ATTRIBUTES | ((pcrs.count && !secret_sens.sensitive.userAuth.size) ? 0 : TPMA_OBJECT_USERWITHAUTH);
 		pub.publicArea.parameters.keyedHashDetail.scheme.scheme = TPM2_ALG_NULL;
 		pub.publicArea.authPolicy                               = policy_digest;
 
-		TRY_TPM2("create key seal", Esys_Create(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &secret_sens, &pub, &metadata, &pcrs,
-		                                        &sealant_private, &sealant_public, nullptr, nullptr, nullptr));
-	}
-
+		/// The blobs are the whole of the sealed object, and only loadable under this TPM's primary key
+		if(!persistent) {
+			TRY_TPM2("create key seal", TRACE("Esys_Create", Esys_Create(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &secret_sens, &pub,
+			                                                             &metadata, &pcrs, &sealant_private, &sealant_public, nullptr, nullptr, nullptr)));
+			sealed.handle = 0;
+			sealed.priv   = *sealant_private;
+			sealed.pub    = *sealant_public;
+			return 0;
+		}
 
-	ESYS_TR sealed_handle = ESYS_TR_NONE;
-	quickscope_wrapper sealed_handle_deleter{[&] { Esys_FlushContext(tpm2_ctx, sealed_handle); }};
+		/// CreateLoaded saves a round-trip (and a copy of the private part) over Create+Load, but is optional (and only in TPM 2.0 r1.38+).
+		/// It returns no creation data or ticket, so persistent objects can't be tied to the seal that made them later;
+		/// zfs-tpm2-gc goes by the object's attributes and the datasets' properties instead
+		TPM2B_TEMPLATE pub_template{};
+		size_t pub_template_len{};
+		TRY_TPM2("marshal key seal template", Tss2_MU_TPMT_PUBLIC_Marshal(&pub.publicArea, pub_template.buffer, sizeof(pub_template.buffer), &pub_template_len));
+		pub_template.size = pub_template_len;
+
+		auto err = TRACE("Esys_CreateLoaded", Esys_CreateLoaded(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &secret_sens, &pub_template,
+		                                                        &sealed_handle, nullptr, nullptr));
+		if((err & ~TSS2_RC_LAYER_MASK) == TPM2_RC_COMMAND_CODE) {
+			TRY_TPM2("create key seal", TRACE("Esys_Create", Esys_Create(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &secret_sens, &pub,
+			                                                             &metadata, &pcrs, &sealant_private, &sealant_public, nullptr, nullptr, nullptr)));
+
+			/// Load the sealed object (keyedhash) into a transient handle
+			TRY_TPM2("load key seal", TRACE("Esys_Load", Esys_Load(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, sealant_private,
+			                                                       sealant_public, &sealed_handle)));
+		} else
+			TRY_TPM2("create key seal", err);
+	}
 
-	/// Load the sealed object (keyedhash) into a transient handle
-	TRY_TPM2("load key seal", Esys_Load(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, sealant_private, sealant_public, &sealed_handle));
+	auto lock = tpm2_lock_persistent();
+	quickscope_wrapper lock_deleter{[=] {
+		if(lock != -1)
+			close(lock);
+	}};
 
 	/// Find lowest unused persistent handle
-	TRY_MAIN(tpm2_find_unused_persistent_non_platform(tpm2_ctx, persistent_handle));
+	TRY_MAIN(tpm2_find_unused_persistent_non_platform(tpm2_ctx, sealed.handle));
 
 	/// Persist the loaded handle in the TPM — this will make it available as $persistent_handle until we explicitly evict it back to the transient store
 	{
 		// Can't be flushed (tpm:parameter(1):value is out of range or is not correct for the context), plus, that's kinda the point
 		ESYS_TR new_handle;
-		TRY_TPM2("persist key seal",
-		         Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, sealed_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, persistent_handle, &new_handle));
+		TRY_MAIN(try_or_passphrase("persist key seal", "TPM2 owner hierarchy", tpm2_ctx, TPM2_RC_BAD_AUTH, ESYS_TR_RH_OWNER, [&] {
+			for(int i = 0;; ++i) {
+				auto err = TRACE("Esys_EvictControl",
+				                 Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, sealed_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, sealed.handle, &new_handle));
+				// Someone not holding the lock took it in the meantime
+				if((err & ~TSS2_RC_LAYER_MASK) != TPM2_RC_NV_DEFINED || i == 3 || tpm2_find_unused_persistent_non_platform(tpm2_ctx, sealed.handle))
+					return err;
+			}
+		}));
+		Esys_TR_Close(tpm2_ctx, &new_handle);
 	}
 
 	return 0;
 }
 
-int tpm2_unseal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle, const TPML_PCR_SELECTION & pcrs,
-                void * data, size_t data_len) {
+void tpm2_persistent_objects_close(ESYS_CONTEXT * tpm2_ctx, tpm2_persistent_objects & objects) {
+	for(size_t i = 0; i < objects.count; ++i)
+		Esys_TR_Close(tpm2_ctx, &objects.objects[i]);
+	objects.count = 0;
+}
+
+/// Entirely fake and not flushable (tpm:parameter(1):value is out of range or is not correct for the context), but it can be forgotten about;
+/// close_object is whether that's on the caller, or whether it's in objects
+static int tpm2_persistent_object(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT persistent_handle, tpm2_persistent_objects * objects, ESYS_TR & object,
+                                  bool & close_object) {
+	close_object = false;
+	if(objects)
+		for(size_t i = 0; i < objects->count; ++i)
+			if(objects->handles[i] == persistent_handle)
+				return object = objects->objects[i], 0;
+
+	TRY_TPM2("convert persistent handle to object",
+	         TRACE("Esys_TR_FromTPMPublic", Esys_TR_FromTPMPublic(tpm2_ctx, persistent_handle, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &object)));
+	if(objects && objects->count < sizeof(objects->handles) / sizeof(*objects->handles)) {
+		objects->handles[objects->count]   = persistent_handle;
+		objects->objects[objects->count++] = object;
+	} else
+		close_object = true;
+	return 0;
+}
+
+/// For when the object's been invalidated
+static void tpm2_persistent_object_forget(tpm2_persistent_objects * objects, TPMI_DH_PERSISTENT persistent_handle) {
+	if(objects)
+		for(size_t i = 0; i < objects->count; ++i)
+			if(objects->handles[i] == persistent_handle) {
+				--objects->count;
+				objects->handles[i] = objects->handles[objects->count];
+				objects->objects[i] = objects->objects[objects->count];
+				return;
+			}
+}
+
+int tpm2_unseal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, ESYS_TR & policy_session, ESYS_TR & primary_handle,
+                const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, void * data, size_t data_len, tpm2_persistent_objects * objects) {
+	trace_span unseal_span{"tpm2_unseal"};  // prompts included
 	// Esys_FlushContext(tpm2_ctx, tpm2_session);
 	char what_for[ZFS_MAX_DATASET_NAME_LEN + 18 + 1];
 	snprintf(what_for, sizeof(what_for), "%s TPM2 wrapping key", dataset);
 
-	// Entirely fake and not flushable (tpm:parameter(1):value is out of range or is not correct for the context)
-	ESYS_TR pandle;
-	TRY_TPM2("convert persistent handle to object", Esys_TR_FromTPMPublic(tpm2_ctx, persistent_handle, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &pandle));
+	ESYS_TR pandle    = ESYS_TR_NONE;
+	bool close_pandle = false;
+	quickscope_wrapper pandle_deleter{[&] {
+		if(sealed.handle) {
+			if(close_pandle)
+				Esys_TR_Close(tpm2_ctx, &pandle);
+		} else
+			Esys_FlushContext(tpm2_ctx, pandle);
+	}};
+	if(sealed.handle)
+		TRY_MAIN(tpm2_persistent_object(tpm2_ctx, sealed.handle, objects, pandle, close_pandle));
+	else {
+		TRY_MAIN(tpm2_load_primary(tpm2_ctx, tpm2_session, sealed.primary, tpm2_creation_metadata(dataset), TPML_PCR_SELECTION{}, primary_handle));
+		TRY_TPM2("load key seal",
+		         TRACE("Esys_Load", Esys_Load(tpm2_ctx, primary_handle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, &sealed.priv, &sealed.pub, &pandle)));
+	}
 
 
 	TPM2B_SENSITIVE_DATA * unsealed{};
 	quickscope_wrapper unsealed_deleter{[&] { Esys_Free(unsealed); }};
-	auto unseal = [&](auto sess) { return Esys_Unseal(tpm2_ctx, pandle, sess, ESYS_TR_NONE, ESYS_TR_NONE, &unsealed); };
-	TRY_MAIN(tpm2_police_pcrs(tpm2_ctx, pcrs, TPM2_SE_POLICY, [&](auto pcr_session) {
+	auto unseal = [&](auto sess) { return TRACE("Esys_Unseal", Esys_Unseal(tpm2_ctx, pandle, sess, ESYS_TR_NONE, ESYS_TR_NONE, &unsealed)); };
+	TRY_MAIN(tpm2_police_pcrs(tpm2_ctx, pcrs, &policy_session, [&](auto pcr_session) {
 		// In case there's (PCR policy || passphrase): try PCR once; if it fails, fall back to passphrase
 		if(pcr_session != ESYS_TR_NONE) {
 			if(auto err = unseal(pcr_session); err != TPM2_RC_SUCCESS)
@@ -453,14 +903,73 @@ int tpm2_unseal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_sess
 	return 0;
 }
 
-int tpm2_free_persistent(ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle) {
-	// Neither of these are flushable (tpm:parameter(1):value is out of range or is not correct for the context)
+int tpm2_free_persistent(ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle, tpm2_persistent_objects * objects) {
+	// Neither of these are flushable (tpm:parameter(1):value is out of range or is not correct for the context); EvictControl() invalidates pandle
 	ESYS_TR pandle;
-	TRY_TPM2("convert persistent handle to object", Esys_TR_FromTPMPublic(tpm2_ctx, persistent_handle, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &pandle));
+	bool close_pandle;
+	TRY_MAIN(tpm2_persistent_object(tpm2_ctx, persistent_handle, objects, pandle, close_pandle));
+	auto evicted = false;
+	quickscope_wrapper pandle_deleter{[&] {
+		if(evicted)
+			tpm2_persistent_object_forget(objects, persistent_handle);
+		else if(close_pandle)  // otherwise it stays in objects, still good
+			Esys_TR_Close(tpm2_ctx, &pandle);
+	}};
 
 	ESYS_TR new_handle;
 	TRY_MAIN(try_or_passphrase("unpersist object", "TPM2 owner hierarchy", tpm2_ctx, TPM2_RC_BAD_AUTH, ESYS_TR_RH_OWNER,
-	                           [&] { return Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, pandle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, 0, &new_handle); }));
+	                           [&] {
+		                           return TRACE("Esys_EvictControl",
+		                                        Esys_EvictControl(tpm2_ctx, ESYS_TR_RH_OWNER, pandle, tpm2_session, ESYS_TR_NONE, ESYS_TR_NONE, 0, &new_handle));
+	                           }));
+	evicted = true;
+
+	return 0;
+}
+
+int tpm2_sealed_name(ESYS_CONTEXT * tpm2_ctx, const tpm2_sealed & sealed, TPM2B_NAME & name, tpm2_persistent_objects * objects) {
+	if(sealed.handle) {
+		ESYS_TR pandle;
+		bool close_pandle;
+		TRY_MAIN(tpm2_persistent_object(tpm2_ctx, sealed.handle, objects, pandle, close_pandle));
+		quickscope_wrapper pandle_deleter{[&] {
+			if(close_pandle)
+				Esys_TR_Close(tpm2_ctx, &pandle);
+		}};
+
+		TPM2B_NAME * pname{};
+		TRY_TPM2("get persistent object name", Esys_TR_GetName(tpm2_ctx, pandle, &pname));  // read along with the object
+		quickscope_wrapper pname_deleter{[&] { Esys_Free(pname); }};
+		name = *pname;
+		return 0;
+	}
 
+	/// Same as the TPM's for SHA-256, which is what tpm2_seal() uses
+	uint8_t pub[sizeof(TPMT_PUBLIC)];
+	size_t pub_len{};
+	TRY_TPM2("marshal public area", Tss2_MU_TPMT_PUBLIC_Marshal(&sealed.pub.publicArea, pub, sizeof(pub), &pub_len));
+	name.size    = sizeof(TPM2_ALG_ID) + SHA256_DIGEST_LENGTH;
+	name.name[0] = sealed.pub.publicArea.nameAlg >> 8;
+	name.name[1] = sealed.pub.publicArea.nameAlg & 0xFF;
+	SHA256(pub, pub_len, name.name + sizeof(TPM2_ALG_ID));
+	return 0;
+}
+
+int tpm2_persistent_looks_sealed(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT persistent_handle, bool & looks_sealed, tpm2_persistent_objects * objects) {
+	ESYS_TR pandle;
+	bool close_pandle;
+	TRY_MAIN(tpm2_persistent_object(tpm2_ctx, persistent_handle, objects, pandle, close_pandle));
+	quickscope_wrapper pandle_deleter{[&] {
+		if(close_pandle)
+			Esys_TR_Close(tpm2_ctx, &pandle);
+	}};
+
+	TPM2B_PUBLIC * pub{};
+	TRY_TPM2("read persistent object", Esys_ReadPublic(tpm2_ctx, pandle, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, &pub, nullptr, nullptr));
+	quickscope_wrapper pub_deleter{[&] { Esys_Free(pub); }};
+
+	looks_sealed = pub->publicArea.type == TPM2_ALG_KEYEDHASH && pub->publicArea.nameAlg == TPM2_ALG_SHA256 &&
+	               (pub->publicArea.objectAttributes & ~TPMA_OBJECT_USERWITHAUTH) == TPM2_SEALED_ATTRIBUTES &&
+	               pub->publicArea.parameters.keyedHashDetail.scheme.scheme == TPM2_ALG_NULL;
 	return 0;
 }
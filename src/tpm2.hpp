@@ -5,6 +5,9 @@
 
 
 #include "common.hpp"
+#include "trace.hpp"
+
+#include <type_traits>
 
 #include <tss2/tss2_common.h>
 #include <tss2/tss2_esys.h>
@@ -13,11 +16,18 @@
 
 #define TRY_TPM2(what, ...) TRY_GENERIC(what, , != TPM2_RC_SUCCESS, _try_ret, __LINE__, Tss2_RC_Decode, __VA_ARGS__)
 
+/// Saved contexts of primary keys are kept here, since generating them is the slowest part of sealing
+#define TPM2_PRIMARY_CACHE_DIR TZPFMS_RUN_DIR
+
 
 // https://github.com/tpm2-software/tpm2-tss/blob/49146d926ccb0fd3c3ee064455eb02356e0cdf90/test/integration/esys-create-session-auth.int.c#L218
 static const constexpr TPMT_SYM_DEF tpm2_session_key{.algorithm = TPM2_ALG_AES, .keyBits = {.aes = 128}, .mode = {.aes = TPM2_ALG_CFB}};
 
 
+/// With $TZPFMS_TRACE, count commands and their sizes in trace_tpm by hooking the TCTI under tpm2_ctx
+extern void tpm2_trace_tcti(ESYS_CONTEXT * tpm2_ctx);
+
+
 template <class F>
 int with_tpm2_session(F && func) {
 	// https://trustedcomputinggroup.org/wp-content/uploads/TSS_ESAPI_v1p00_r05_pubrev.pdf
@@ -25,32 +35,151 @@ int with_tpm2_session(F && func) {
 	// https://tpm2-tss.readthedocs.io/en/latest/group___e_s_y_s___c_o_n_t_e_x_t.html
 
 	ESYS_CONTEXT * tpm2_ctx{};
-	TRY_TPM2("initialise TPM connection", Esys_Initialize(&tpm2_ctx, nullptr, nullptr));
+	TRY_TPM2("initialise TPM connection", TRACE("Esys_Initialize", Esys_Initialize(&tpm2_ctx, nullptr, nullptr)));
 	quickscope_wrapper tpm2_ctx_deleter{[&] { Esys_Finalize(&tpm2_ctx); }};
+	tpm2_trace_tcti(tpm2_ctx);
 
-	TRY_TPM2("start TPM", Esys_Startup(tpm2_ctx, TPM2_SU_CLEAR));
+	TRY_TPM2("start TPM", TRACE("Esys_Startup", Esys_Startup(tpm2_ctx, TPM2_SU_CLEAR)));
 
 	ESYS_TR tpm2_session = ESYS_TR_NONE;
 	quickscope_wrapper tpm2_session_deleter{[&] { Esys_FlushContext(tpm2_ctx, tpm2_session); }};
 
-	TRY_TPM2("authenticate with TPM", Esys_StartAuthSession(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, nullptr, TPM2_SE_HMAC,
-	                                                        &tpm2_session_key, TPM2_ALG_SHA256, &tpm2_session));
+	TRY_TPM2("authenticate with TPM", TRACE("Esys_StartAuthSession", Esys_StartAuthSession(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+	                                                                                        ESYS_TR_NONE, nullptr, TPM2_SE_HMAC, &tpm2_session_key,
+	                                                                                        TPM2_ALG_SHA256, &tpm2_session)));
 
 	return func(tpm2_ctx, tpm2_session);
 }
 
-extern TPM2B_DATA tpm2_creation_metadata(const char * dataset_name);
+/// Run func(data); while it fails with valid_error, try the cached passphrase for passphrased_object, then prompt for it and retry, up to three more times
+extern int tpm2_try_or_passphrase(const char * what, const char * what_for, ESYS_CONTEXT * tpm2_ctx, TPM2_RC valid_error, ESYS_TR passphrased_object,
+                                  TPM2_RC (*func)(void * data), void * data);
+
+/// tpm2_try_or_passphrase() with func() instead; this way, the prompting and caching (fd.hpp) stay out of this header
+template <class F>
+int try_or_passphrase(const char * what, const char * what_for, ESYS_CONTEXT * tpm2_ctx, TPM2_RC valid_error, ESYS_TR passphrased_object, F && func) {
+	return tpm2_try_or_passphrase(
+	    what, what_for, tpm2_ctx, valid_error, passphrased_object, [](void * data) -> TPM2_RC { return (*static_cast<std::remove_reference_t<F> *>(data))(); },
+	    &func);
+}
+
+/// Call func(handle) -> bool for all persistent handles in the owner range, from first, in ascending order, until it returns false
+template <class F>
+int tpm2_for_all_persistent(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT first, F && func) {
+	for(TPMI_YES_NO more = TPM2_YES; more && first < TPM2_PLATFORM_PERSISTENT;) {
+		TPMS_CAPABILITY_DATA * cap{};
+		TRY_TPM2("Read used persistent TPM handles", Esys_GetCapability(tpm2_ctx, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE, TPM2_CAP_HANDLES, first,
+		                                                                TPM2_MAX_CAP_HANDLES, &more, &cap));
+		quickscope_wrapper cap_deleter{[&] { Esys_Free(cap); }};
+		if(!cap->data.handles.count)
+			break;
+
+		for(uint32_t i = 0; i < cap->data.handles.count; ++i)
+			if(cap->data.handles.handle[i] >= TPM2_PLATFORM_PERSISTENT || !func(static_cast<TPMI_DH_PERSISTENT>(cap->data.handles.handle[i])))
+				return 0;
+		first = cap->data.handles.handle[cap->data.handles.count - 1] + 1;
+	}
+
+	return 0;
+}
 
-/// Parse a persistent handle name as stored in a ZFS property
-extern int tpm2_parse_prop(const char * dataset_name, char * handle_s, TPMI_DH_PERSISTENT & handle, TPML_PCR_SELECTION * pcrs);
-extern int tpm2_unparse_prop(TPMI_DH_PERSISTENT persistent_handle, const TPML_PCR_SELECTION & pcrs, char ** prop);
+/// Template for the primary key the sealed object is created under; RSA is the original and is implied if absent from the property
+enum class tpm2_primary : uint8_t {
+	rsa,
+	ecc,
+};
 
-/// `alg:PCR[,PCR]...[+alg:PCR[,PCR]...]...`; all separators can have spaces
-extern int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs);
+extern TPM2B_DATA tpm2_creation_metadata(const char * dataset_name);
+extern TPM2B_PUBLIC tpm2_primary_template(tpm2_primary primary);
+
+/// A sealed object is either persisted in the TPM's NV at handle, or, if that's 0, kept as blobs in the property, and loaded under the primary key to unseal
+struct tpm2_sealed {
+	TPMI_DH_PERSISTENT handle;
+	tpm2_primary primary;
+	TPM2B_PRIVATE priv;  // !handle
+	TPM2B_PUBLIC pub;    // !handle
+};
+
+/// Parse a sealed object as stored in a ZFS property: `{handle|hex-private:hex-public}[;PCRs][;ecc]`
+extern int tpm2_parse_prop(const char * dataset_name, char * handle_s, tpm2_sealed & sealed, TPML_PCR_SELECTION * pcrs);
+extern int tpm2_unparse_prop(const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, char ** prop);
+
+/// `rsa` or `ecc`
+extern int tpm2_parse_primary(const char * arg, tpm2_primary & primary);
+
+/// Expected values of PCRs, by bank; the digests are as long as the bank's algorithm's
+struct tpm2_pcr_values {
+	struct {
+		TPM2_ALG_ID hash;
+		uint8_t pcr;
+		TPM2B_DIGEST value;
+	} values[32];
+	size_t count;
+};
+
+/// `alg:PCR[,PCR]...[+alg:PCR[,PCR]...]...`; all separators can have spaces.
+/// If expected isn't nullptr, each PCR can also be `PCR=hex-value`; then either all or none of them must be
+extern int tpm2_parse_pcrs(char * arg, TPML_PCR_SELECTION & pcrs, tpm2_pcr_values * expected = nullptr);
+/// The canonical name for the hash algorithm, or nullptr if it's not one tpm2_parse_pcrs() accepts
+extern const char * tpm2_hash_alg_name(TPM2_ALG_ID id);
+
+/// PolicyPCR digests by PCR selection, for a batch of seals to only read the PCRs once per selection;
+/// the PCR values read for the first seal are used for all the rest, so don't keep one around for longer than the batch.
+/// A digest from tpm2_pcr_policy() can also be added up-front, to seal to those PCR values instead of the current ones
+struct tpm2_pcr_policies {
+	TPML_PCR_SELECTION pcrs[4];
+	TPM2B_DIGEST digests[4];
+	size_t count;
+};
+/// The digest for pcrs, or nullptr if there isn't one (or policies is nullptr)
+extern const TPM2B_DIGEST * tpm2_pcr_policies_find(const tpm2_pcr_policies * policies, const TPML_PCR_SELECTION & pcrs);
+/// Remember policy_digest for pcrs, if there's space (and policies isn't nullptr)
+extern void tpm2_pcr_policies_add(tpm2_pcr_policies * policies, const TPML_PCR_SELECTION & pcrs, const TPM2B_DIGEST & policy_digest);
+
+/// The PolicyPCR policy digest for pcrs having the expected values, computed without a TPM
+extern int tpm2_pcr_policy(const TPML_PCR_SELECTION & pcrs, const tpm2_pcr_values & expected, TPM2B_DIGEST & policy_digest);
+
+/// Objects for persistent handles, for each to only go through Esys_TR_FromTPMPublic() (a ReadPublic round-trip) once per batch; like tpm2_pcr_policies,
+/// don't keep one around for longer than that, since it wouldn't notice the handle being evicted and reused by anyone else.
+/// Once full, further handles aren't remembered; tpm2_persistent_objects_close() closes them all
+struct tpm2_persistent_objects {
+	TPMI_DH_PERSISTENT handles[16];
+	ESYS_TR objects[16];
+	size_t count;
+};
+extern void tpm2_persistent_objects_close(ESYS_CONTEXT * tpm2_ctx, tpm2_persistent_objects & objects);
 
 extern int tpm2_generate_rand(ESYS_CONTEXT * tpm2_ctx, void * into, size_t length);
-extern int tpm2_seal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT & persistent_handle, const TPM2B_DATA & metadata,
-                     const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass, void * data, size_t data_len);
-extern int tpm2_unseal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle,
-                       const TPML_PCR_SELECTION & pcrs, void * data, size_t data_len);
-extern int tpm2_free_persistent(ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle);
+/// primary_handle (of type sealed.primary) is loaded or created on first use and kept for subsequent seals; the caller flushes it once done.
+/// If persistent, sealed.handle is set to the lowest free persistent handle the object is persisted at, otherwise sealed.priv and sealed.pub are set.
+/// If policies isn't nullptr, the PCR policy digest is taken from (or added to) it
+extern int tpm2_seal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, ESYS_TR & primary_handle, tpm2_sealed & sealed, bool persistent,
+                     const TPM2B_DATA & metadata, const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass, void * data, size_t data_len,
+                     tpm2_pcr_policies * policies = nullptr);
+/// policy_session is started on first use and reused (via PolicyRestart) for subsequent unseals; the caller flushes it once done.
+/// primary_handle is as in tpm2_seal(), and only used for blob sealed objects. The PCR policy is satisfied by the TPM itself, without reading the PCRs.
+/// If objects isn't nullptr, the persistent handle's object is taken from (or added to) it; likewise for the other functions taking one
+extern int tpm2_unseal(const char * dataset, ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, ESYS_TR & policy_session, ESYS_TR & primary_handle,
+                       const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, void * data, size_t data_len, tpm2_persistent_objects * objects = nullptr);
+extern int tpm2_free_persistent(ESYS_CONTEXT * tpm2_ctx, ESYS_TR tpm2_session, TPMI_DH_PERSISTENT persistent_handle,
+                                tpm2_persistent_objects * objects = nullptr);
+/// The sealed object's name, nameAlg || SHA-256 of its public area, which, unlike a persistent handle, is never reused for a different object.
+/// Blobs' is computed from sealed.pub, and tpm2_ctx can be nullptr then; a persistent object's is what the TPM says (one ReadPublic, if not in objects)
+extern int tpm2_sealed_name(ESYS_CONTEXT * tpm2_ctx, const tpm2_sealed & sealed, TPM2B_NAME & name, tpm2_persistent_objects * objects = nullptr);
+
+/// Lock TPM2_PRIMARY_CACHE_DIR/tpm2-persistent.lock, returning the fd to close() or -1; tpm2_seal() holds it from finding an unused persistent handle until
+/// it's used, so that concurrent seals don't race for the same one. This is only an optimisation, since anyone else (tpm2_evictcontrol(1), say)
+/// can take it anyway, so failing to lock is fine
+extern int tpm2_lock_persistent();
+/// Lock TPM2_PRIMARY_CACHE_DIR/tpm2-gc.lock likewise: zfs-tpm2-change-key holds it shared from its first seal until the properties point at the new objects
+/// (and the keys are changed), and zfs-tpm2-gc exclusively for its whole run, so it doesn't see the objects in-between as unreferenced.
+/// This is a separate lock, since tpm2_seal() (maybe in tzpfmsd) takes tpm2_lock_persistent() under it; always take this one first.
+/// Unlike tpm2_lock_persistent(), this one isn't optional: zfs-tpm2-gc mustn't evict anything without it (errno is set on -1).
+/// zfs-tpm2-change-key can go on without it, since it can only fail for both (no TPM2_PRIMARY_CACHE_DIR), and then gc won't evict
+extern int tpm2_lock_gc(bool exclusive);
+/// The lowest persistent handle in the owner range that's not in use; take tpm2_lock_persistent() around this and its use
+extern int tpm2_find_unused_persistent_non_platform(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT & persistent_handle);
+
+/// Whether the object at persistent_handle has the attributes of one tpm2_seal() makes; tpm2_create(1) makes ones that look the same
+extern int tpm2_persistent_looks_sealed(ESYS_CONTEXT * tpm2_ctx, TPMI_DH_PERSISTENT persistent_handle, bool & looks_sealed,
+                                        tpm2_persistent_objects * objects = nullptr);
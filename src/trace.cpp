@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include "trace.hpp"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+FILE * trace_file = [] {
+	auto path = getenv("TZPFMS_TRACE");
+	if(!path || !*path)
+		return static_cast<FILE *>(nullptr);
+
+	/// Appended to by every process, so one line is one write()
+	auto ret = fopen(path, "ae");
+	if(!ret)
+		fprintf(stderr, "Couldn't open $TZPFMS_TRACE (%s): %s\n", path, strerror(errno));
+	else
+		setvbuf(ret, nullptr, _IOLBF, 0);
+	return ret;
+}();
+
+trace_atomic_counters trace_tpm;
+
+
+static uint64_t trace_now() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+}
+
+void trace_span::begin() {
+	this->start_tpm = trace_tpm.load();
+	this->start_ns  = trace_now();
+}
+
+void trace_span::end() {
+	auto duration = trace_now() - this->start_ns;
+	auto tpm      = trace_tpm.load();
+	fprintf(trace_file,
+	        "{\"pid\":%ld,\"phase\":\"%s\",\"start_ns\":%" PRIu64 ",\"duration_ns\":%" PRIu64 ",\"tpm_round_trips\":%" PRIu64 ",\"tpm_command_bytes\":%" PRIu64
+	        ",\"tpm_response_bytes\":%" PRIu64 ",\"tpm_pcr_reads\":%" PRIu64 "}\n",
+	        static_cast<long>(getpid()), this->phase, this->start_ns, duration, tpm.round_trips - this->start_tpm.round_trips,
+	        tpm.command_bytes - this->start_tpm.command_bytes, tpm.response_bytes - this->start_tpm.response_bytes, tpm.pcr_reads - this->start_tpm.pcr_reads);
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/// Time phase, which is anything __VA_ARGS__ does, and evaluate to __VA_ARGS__
+#define TRACE(phase, ...)          \
+	({                               \
+		trace_span _trace_span{phase}; \
+		__VA_ARGS__;                   \
+	})
+
+
+/// Opened from $TZPFMS_TRACE at start-up; nullptr if that's unset or empty, and then nothing's measured
+extern FILE * trace_file;
+
+struct trace_counters {
+	uint64_t round_trips;
+	uint64_t command_bytes;
+	uint64_t response_bytes;
+	uint64_t pcr_reads;  // of the round trips; unsealing shouldn't need any, since the TPM checks the PCRs itself
+};
+
+struct trace_atomic_counters {
+	std::atomic<uint64_t> round_trips;
+	std::atomic<uint64_t> command_bytes;
+	std::atomic<uint64_t> response_bytes;
+	std::atomic<uint64_t> pcr_reads;
+
+	trace_counters load() const { return {this->round_trips, this->command_bytes, this->response_bytes, this->pcr_reads}; }
+};
+
+/// Everything that's gone to and from the TPM so far (TPM2 only, cf. tpm2_trace_tcti()).
+/// Bumped by whichever thread talks to the TPM (-j workers included), so a span's counts are process-wide over its duration
+extern trace_atomic_counters trace_tpm;
+
+
+/// Append {"pid":…,"phase":"…","start_ns":…,"duration_ns":…,"tpm_round_trips":…,"tpm_command_bytes":…,"tpm_response_bytes":…,"tpm_pcr_reads":…}
+/// to trace_file when this goes out of scope. start_ns is CLOCK_MONOTONIC, the TPM counters are the differences in trace_tpm.
+/// Spans may nest; phase must be a string literal.
+struct trace_span {
+	const char * phase;
+	uint64_t start_ns;
+	trace_counters start_tpm;
+
+	trace_span(const char * phase) : phase(phase) {
+		if(trace_file)
+			this->begin();
+	}
+	~trace_span() {
+		if(trace_file)
+			this->end();
+	}
+
+	void begin();
+	void end();
+};
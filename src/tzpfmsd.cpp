@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#include "tzpfmsd.hpp"
+#include "fd.hpp"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <utility>
+
+
+static ssize_t tzpfmsd_send_request(int sock, const tzpfmsd_request & req) {
+	iovec iov{const_cast<tzpfmsd_request *>(&req), sizeof(req)};
+	alignas(cmsghdr) char cmsg_buf[CMSG_SPACE(sizeof(int))]{};
+	msghdr msg{};
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cmsg_buf;
+	msg.msg_controllen = sizeof(cmsg_buf);
+
+	auto cmsg        = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	const int err_fd = 2;
+	memcpy(CMSG_DATA(cmsg), &err_fd, sizeof(err_fd));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+
+int tzpfmsd_connect(int & sock) {
+	sock = -1;
+
+	auto path = getenv("TZPFMSD_SOCKET") ?: TZPFMSD_SOCKET;
+	if(!*path)
+		return 0;
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return fprintf(stderr, "tzpfmsd socket path %s too long.\n", path), __LINE__;
+	strcpy(addr.sun_path, path);
+
+	auto sck = TRY("create tzpfmsd socket", socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+	quickscope_wrapper sck_deleter{[&] {
+		if(sck != -1)
+			close(sck);
+	}};
+	if(connect(sck, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1)  // Not running or not for us: do it ourselves
+		return 0;
+
+	/// Likewise if it hangs up, resets, or doesn't get to us in time
+	tzpfmsd_request req{};
+	req.op = tzpfmsd_op::hello;
+	tzpfmsd_reply rep{};
+	timeval timeout{TZPFMSD_HELLO_TIMEOUT, 0};
+	if(setsockopt(sck, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 || tzpfmsd_send_request(sck, req) == -1 ||
+	   recv(sck, &rep, sizeof(rep), 0) != sizeof(rep) || rep.kind != tzpfmsd_reply_kind::done)
+		return 0;
+
+	/// It's ours until we hang up, but requests can take arbitrarily long (the TPM, prompts)
+	timeout = {};
+	TRY("reset tzpfmsd socket timeout", setsockopt(sck, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)));
+	sock = std::exchange(sck, -1);
+	return 0;
+}
+
+
+int tzpfmsd_call(int sock, const tzpfmsd_request & req, tzpfmsd_reply & rep) {
+	trace_span call_span{"tzpfmsd_call"};  // prompts included; tzpfmsd traces its TPM side itself
+
+	TRY("send request to tzpfmsd", tzpfmsd_send_request(sock, req));
+
+	for(;;) {
+		switch(TRY("read reply from tzpfmsd", recv(sock, &rep, sizeof(rep), 0))) {
+			case 0:
+				return fprintf(stderr, "tzpfmsd hung up.\n"), __LINE__;
+			case sizeof(rep):
+				break;
+			default:
+				return fprintf(stderr, "Malformed reply from tzpfmsd.\n"), __LINE__;
+		}
+		if(rep.kind == tzpfmsd_reply_kind::done)
+			return 0;
+
+
+		rep.whom[sizeof(rep.whom) - 1] = '\0';
+
+		tzpfmsd_passphrase pass{};
+		uint8_t * buf{};
+		size_t len{};
+		quickscope_wrapper buf_deleter{[&] { free(buf); }};
+		if(!(pass.err = read_passphrase_locally(rep.whom, rep.again, rep.newkey, buf, len)) && len > sizeof(pass.passphrase))
+			pass.err = (fprintf(stderr, "Passphrase too long (max %zu)\n", sizeof(pass.passphrase)), __LINE__);
+		if(!pass.err) {
+			pass.len = len;
+			memcpy(pass.passphrase, buf, len);
+		}
+
+		auto ret = send(sock, &pass, sizeof(pass), MSG_NOSIGNAL);
+		explicit_bzero(&pass, sizeof(pass));
+		TRY("send passphrase to tzpfmsd", ret);
+	}
+}
+
+
+void tpm2_conn_flush(tpm2_conn & conn) {
+	Esys_FlushContext(conn.ctx, conn.policy_session);
+	for(auto primary : conn.primaries)
+		Esys_FlushContext(conn.ctx, primary);
+	if(conn.persistent_objects)
+		tpm2_persistent_objects_close(conn.ctx, *conn.persistent_objects);
+}
+
+
+int tpm2_generate_rand(tpm2_conn & conn, void * into, size_t length) {
+	if(conn.daemon == -1)
+		return tpm2_generate_rand(conn.ctx, into, length);
+	if(length > sizeof(tzpfmsd_request::data))
+		return fprintf(stderr, "Too much data for tzpfmsd (%zu > %zu).\n", length, sizeof(tzpfmsd_request::data)), __LINE__;
+
+	tzpfmsd_request req{};
+	req.op       = tzpfmsd_op::generate_rand;
+	req.data_len = length;
+
+	tzpfmsd_reply rep{};
+	quickscope_wrapper rep_deleter{[&] { explicit_bzero(&rep, sizeof(rep)); }};
+	TRY_MAIN(tzpfmsd_call(conn.daemon, req, rep));
+	TRY_MAIN(rep.err);
+
+	memcpy(into, rep.data, length);
+	return 0;
+}
+
+int tpm2_seal(const char * dataset, tpm2_conn & conn, tpm2_sealed & sealed, bool persistent, const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass,
+              void * data, size_t data_len) {
+	if(conn.daemon == -1)
+		return tpm2_seal(dataset, conn.ctx, conn.session, conn.primaries[static_cast<uint8_t>(sealed.primary)], sealed, persistent,
+		                 tpm2_creation_metadata(dataset), pcrs, allow_PCR_or_pass, data, data_len, conn.pcr_policies);
+	if(data_len > sizeof(tzpfmsd_request::data))
+		return fprintf(stderr, "Too much data for tzpfmsd (%zu > %zu).\n", data_len, sizeof(tzpfmsd_request::data)), __LINE__;
+
+	tzpfmsd_request req{};
+	quickscope_wrapper req_deleter{[&] { explicit_bzero(&req, sizeof(req)); }};
+	req.op                = tzpfmsd_op::seal;
+	req.allow_PCR_or_pass = allow_PCR_or_pass;
+	req.persistent        = persistent;
+	req.sealed.primary    = sealed.primary;
+	req.pcrs              = pcrs;
+	req.data_len          = data_len;
+	if(auto pcr_policy = tpm2_pcr_policies_find(conn.pcr_policies, pcrs))
+		req.pcr_policy = *pcr_policy;
+	memcpy(req.data, data, data_len);
+	strncpy(req.dataset, dataset, sizeof(req.dataset) - 1);
+
+	tzpfmsd_reply rep{};
+	TRY_MAIN(tzpfmsd_call(conn.daemon, req, rep));
+	TRY_MAIN(rep.err);
+
+	sealed = rep.sealed;
+	return 0;
+}
+
+int tpm2_unseal(const char * dataset, tpm2_conn & conn, const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, void * data, size_t data_len) {
+	if(conn.daemon == -1)
+		return tpm2_unseal(dataset, conn.ctx, conn.session, conn.policy_session, conn.primaries[static_cast<uint8_t>(sealed.primary)], sealed, pcrs, data,
+		                   data_len, conn.persistent_objects);
+	if(data_len > sizeof(tzpfmsd_request::data))
+		return fprintf(stderr, "Too much data for tzpfmsd (%zu > %zu).\n", data_len, sizeof(tzpfmsd_request::data)), __LINE__;
+
+	tzpfmsd_request req{};
+	req.op                = tzpfmsd_op::unseal;
+	req.sealed            = sealed;
+	req.pcrs              = pcrs;
+	req.data_len          = data_len;
+	strncpy(req.dataset, dataset, sizeof(req.dataset) - 1);
+
+	tzpfmsd_reply rep{};
+	quickscope_wrapper rep_deleter{[&] { explicit_bzero(&rep, sizeof(rep)); }};
+	TRY_MAIN(tzpfmsd_call(conn.daemon, req, rep));
+	TRY_MAIN(rep.err);
+
+	memcpy(data, rep.data, data_len);
+	return 0;
+}
+
+static_assert(sizeof(TPM2B_NAME) <= sizeof(tzpfmsd_reply::data));
+int tpm2_sealed_name(tpm2_conn * conn, const tpm2_sealed & sealed, TPM2B_NAME & name) {
+	if(!sealed.handle || conn->daemon == -1)
+		return tpm2_sealed_name(sealed.handle ? conn->ctx : nullptr, sealed, name, sealed.handle ? conn->persistent_objects : nullptr);
+
+	tzpfmsd_request req{};
+	req.op            = tzpfmsd_op::sealed_name;
+	req.sealed.handle = sealed.handle;
+
+	tzpfmsd_reply rep{};
+	TRY_MAIN(tzpfmsd_call(conn->daemon, req, rep));
+	TRY_MAIN(rep.err);
+
+	memcpy(&name, rep.data, sizeof(name));
+	if(name.size > sizeof(name.name))
+		return fprintf(stderr, "Malformed reply from tzpfmsd.\n"), __LINE__;
+	return 0;
+}
+
+int tpm2_free_persistent(tpm2_conn & conn, TPMI_DH_PERSISTENT persistent_handle) {
+	if(conn.daemon == -1)
+		return tpm2_free_persistent(conn.ctx, conn.session, persistent_handle, conn.persistent_objects);
+
+	tzpfmsd_request req{};
+	req.op                = tzpfmsd_op::free_persistent;
+	req.sealed.handle     = persistent_handle;
+
+	tzpfmsd_reply rep{};
+	TRY_MAIN(tzpfmsd_call(conn.daemon, req, rep));
+	return rep.err;
+}
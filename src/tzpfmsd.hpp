@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: MIT */
+
+
+#pragma once
+
+
+#include "main.hpp"
+#include "tpm2.hpp"
+
+#include <libzfs.h>
+#include <stdint.h>
+#include <unistd.h>
+
+
+/// Overridable with $TZPFMSD_SOCKET; if that's set to empty, tzpfmsd is never used
+#define TZPFMSD_SOCKET TZPFMS_RUN_DIR "/tzpfmsd.sock"
+
+/// The TPM2 back-end takes at most 64 bytes, but we may as well say so on tzpfmsd's side
+#define TZPFMSD_MAX_PASSPHRASE_LEN 512
+
+/// How long tzpfmsd_connect() waits for the hello to be answered (by a tzpfmsd that's starting up or serving someone else) before going it alone, in seconds
+#define TZPFMSD_HELLO_TIMEOUT 3
+
+
+/// All messages are single SOCK_SEQPACKETs, in the order:
+///   client -> tzpfmsd: tzpfmsd_request, with the client's stderr attached as SCM_RIGHTS; the first one is always a hello
+///   tzpfmsd -> client: tzpfmsd_reply{kind = prompt}, client -> tzpfmsd: tzpfmsd_passphrase  (any amount of times)
+///   tzpfmsd -> client: tzpfmsd_reply{kind = done}
+/// and then another request, or hang-up.
+///
+/// Only clients with the same UID as tzpfmsd are served.
+enum class tzpfmsd_op : uint8_t {
+	generate_rand,
+	seal,
+	unseal,
+	free_persistent,
+	sealed_name,
+	hello,  // no-op
+};
+
+struct tzpfmsd_request {
+	tzpfmsd_op op;
+	bool allow_PCR_or_pass;                              // seal
+	bool persistent;                                     // seal
+	tpm2_sealed sealed;                                  // seal (primary only), unseal, free_persistent and sealed_name (handle only)
+	TPML_PCR_SELECTION pcrs;                             // seal, unseal
+	TPM2B_DIGEST pcr_policy;                             // seal: if size, for expected PCR values instead of the current ones
+	uint16_t data_len;                                   // all but free_persistent
+	uint8_t data[sizeof(TPM2B_SENSITIVE_DATA::buffer)];  // seal
+	char dataset[ZFS_MAX_DATASET_NAME_LEN];              // seal, unseal
+};
+
+enum class tzpfmsd_reply_kind : uint8_t {
+	prompt,
+	done,
+};
+
+struct tzpfmsd_reply {
+	tzpfmsd_reply_kind kind;
+	bool again;                                          // prompt
+	bool newkey;                                         // prompt
+	int err;                                             // done
+	tpm2_sealed sealed;                                  // done: seal
+	uint8_t data[sizeof(TPM2B_SENSITIVE_DATA::buffer)];  // done: generate_rand, unseal, sealed_name (a TPM2B_NAME)
+	char whom[ZFS_MAX_DATASET_NAME_LEN + 38 + 1];        // prompt
+};
+
+struct tzpfmsd_passphrase {
+	int err;
+	uint16_t len;
+	uint8_t passphrase[TZPFMSD_MAX_PASSPHRASE_LEN];
+};
+
+
+/// Either a connection to tzpfmsd (daemon != -1) or an in-process TPM context from with_tpm2_session();
+/// in the latter case, the policy session and primary keys are kept around for reuse, as tpm2_unseal() and tpm2_seal() allow
+struct tpm2_conn {
+	int daemon;
+	ESYS_CONTEXT * ctx;
+	ESYS_TR session;
+	ESYS_TR policy_session;
+	ESYS_TR primaries[2];              // by tpm2_primary
+	tpm2_pcr_policies * pcr_policies;              // for tpm2_seal(), if set
+	tpm2_persistent_objects * persistent_objects;  // for tpm2_unseal() and tpm2_free_persistent(), if set; tpm2_conn_flush() closes them
+};
+
+/// Flush the in-process policy session, primary keys, and persistent objects
+extern void tpm2_conn_flush(tpm2_conn & conn);
+
+/// Connect to tzpfmsd; sock is set to -1 if it isn't running (or disabled).
+/// A socket being there doesn't mean tzpfmsd is (systemd holds it even if tzpfmsd won't start), nor that it's free (it serves one client at a time),
+/// so it's only used if it answers a hello within TZPFMSD_HELLO_TIMEOUT
+extern int tzpfmsd_connect(int & sock);
+
+/// Make a request to tzpfmsd, answering prompts as they come in; returns transport errors, rep.err is the result
+extern int tzpfmsd_call(int sock, const tzpfmsd_request & req, tzpfmsd_reply & rep);
+
+
+/// Use tzpfmsd if it's up, and fall back to with_tpm2_session() if not
+template <class F>
+int with_tpm2_conn(F && func) {
+	tpm2_conn conn{-1, nullptr, ESYS_TR_NONE, ESYS_TR_NONE, {ESYS_TR_NONE, ESYS_TR_NONE}, nullptr, nullptr};
+	TRY_MAIN(tzpfmsd_connect(conn.daemon));
+	if(conn.daemon != -1) {
+		quickscope_wrapper daemon_deleter{[&] { close(conn.daemon); }};
+		return func(conn);
+	}
+
+	return with_tpm2_session([&](auto tpm2_ctx, auto tpm2_session) {
+		tpm2_persistent_objects persistent_objects{};
+		conn.ctx                = tpm2_ctx;
+		conn.session            = tpm2_session;
+		conn.persistent_objects = &persistent_objects;
+		quickscope_wrapper conn_deleter{[&] { tpm2_conn_flush(conn); }};
+		return func(conn);
+	});
+}
+
+/// The tpm2_*() functions of the same name, but over a tpm2_conn; creation metadata for tpm2_seal() is made on the TPM's side,
+/// and a PCR policy tpm2_seal() would find in conn.pcr_policies is also used by tzpfmsd
+extern int tpm2_generate_rand(tpm2_conn & conn, void * into, size_t length);
+extern int tpm2_seal(const char * dataset, tpm2_conn & conn, tpm2_sealed & sealed, bool persistent, const TPML_PCR_SELECTION & pcrs, bool allow_PCR_or_pass,
+                     void * data, size_t data_len);
+extern int tpm2_unseal(const char * dataset, tpm2_conn & conn, const tpm2_sealed & sealed, const TPML_PCR_SELECTION & pcrs, void * data, size_t data_len);
+extern int tpm2_free_persistent(tpm2_conn & conn, TPMI_DH_PERSISTENT persistent_handle);
+/// conn is only needed for persistent objects, and can be nullptr otherwise
+extern int tpm2_sealed_name(tpm2_conn * conn, const tpm2_sealed & sealed, TPM2B_NAME & name);
@@ -4,8 +4,10 @@
 #include "zfs.hpp"
 #include "common.hpp"
 #include "main.hpp"
+#include "trace.hpp"
 
 #include <libzfs.h>
+#include <libzfs_core.h>
 
 #include <string.h>
 
@@ -18,8 +20,8 @@ nvlist_t * rewrap_args() {
 		if(auto err =
 		       [&] {
 			       TRY_NVL("allocate rewrap nvlist", nvlist_alloc(&rrargs, NV_UNIQUE_NAME, 0));
-			       TRY_NVL("add keyformat to rewrap nvlist",
-			               nvlist_add_string(rrargs, zfs_prop_to_name(ZFS_PROP_KEYFORMAT), "raw"));  // Why can't this be uint64 and ZFS_KEYFORMAT_RAW?
+			       // Goes straight to lzc_change_key(), so this is what zfs_valid_proplist() would've turned "raw" into
+			       TRY_NVL("add keyformat to rewrap nvlist", nvlist_add_uint64(rrargs, zfs_prop_to_name(ZFS_PROP_KEYFORMAT), ZFS_KEYFORMAT_RAW));
 			       TRY_NVL("add keylocation to rewrap nvlist", nvlist_add_string(rrargs, zfs_prop_to_name(ZFS_PROP_KEYLOCATION), "prompt"));
 			       return 0;
 		       }();
@@ -80,46 +82,226 @@ int lookup_userprop(zfs_handle_t * in, const char * name, char *& out) {
 }
 
 
+/// Set both or neither (as far as a channel program can promise: zfs.check first, where there is one), in one TXG, for each dataset;
+/// argv is {backend, dataset, handle, dataset, handle, ...}, and the return maps each dataset to its errno
+static const char set_key_props_program[] = R"(
+args = ...
+argv = args["argv"]
+ret = {}
+for i = 2, #argv, 2 do
+	local dataset, handle = argv[i], argv[i + 1]
+	local err = 0
+	if zfs.check.set_prop then
+		err = zfs.check.set_prop(dataset, ")" PROPNAME_BACKEND R"(", argv[1])
+		if err == 0 then
+			err = zfs.check.set_prop(dataset, ")" PROPNAME_KEY R"(", handle)
+		end
+	end
+	if err == 0 then
+		err = zfs.sync.set_prop(dataset, ")" PROPNAME_BACKEND R"(", argv[1])
+	end
+	if err == 0 then
+		err = zfs.sync.set_prop(dataset, ")" PROPNAME_KEY R"(", handle)
+	end
+	ret[dataset] = err
+end
+return ret
+)";
+
+/// argv is {dataset, dataset, ...}
+static const char clear_key_props_program[] = R"(
+args = ...
+argv = args["argv"]
+ret = {}
+for i = 1, #argv do
+	local dataset = argv[i]
+	local err = zfs.sync.inherit(dataset, ")" PROPNAME_BACKEND R"(")
+	if err == 0 then
+		err = zfs.sync.inherit(dataset, ")" PROPNAME_KEY R"(")
+	end
+	ret[dataset] = err
+end
+return ret
+)";
+
+/// Run program over on (but not the ones already done), one channel program per pool, with argv = {prefix, dataset, (per_dataset[i]), ...};
+/// done[i] is set for the datasets it succeeded on, and their handles' properties are refreshed, as zfs_prop_set_list() and zfs_prop_inherit() would've.
+/// Failures (no channel programs, or zfs.sync.set_prop, or zfs.sync.inherit, not root, &c.) are left for libzfs to do (and explain)
+static void key_props_program(const char * program, zfs_handle_t ** on, size_t on_len, const char * prefix, const char * const * per_dataset, bool * done) {
+	auto argv = reinterpret_cast<const char **>(calloc(1 + on_len * 2, sizeof(const char *)));
+	auto pooled = reinterpret_cast<bool *>(calloc(on_len, sizeof(bool)));
+	quickscope_wrapper argv_deleter{[&] { free(argv), free(pooled); }};
+	if(!argv || !pooled)
+		return;
+
+	for(size_t first = 0; first < on_len; ++first) {
+		if(pooled[first] || done[first])
+			continue;
+
+		char pool[ZFS_MAX_DATASET_NAME_LEN];
+		auto pool_len = strcspn(zfs_get_name(on[first]), "/@#");
+		if(pool_len >= sizeof(pool))
+			continue;
+		memcpy(pool, zfs_get_name(on[first]), pool_len);
+		pool[pool_len] = '\0';
+
+		size_t argc{};
+		if(prefix)
+			argv[argc++] = prefix;
+		for(size_t i = first; i < on_len; ++i)
+			if(!pooled[i] && !done[i] && !strncmp(zfs_get_name(on[i]), pool, pool_len) && strchr("/@#", zfs_get_name(on[i])[pool_len])) {
+				pooled[i]     = true;
+				argv[argc++] = zfs_get_name(on[i]);
+				if(per_dataset)
+					argv[argc++] = per_dataset[i];
+			}
+
+		nvlist_t * args{};
+		nvlist_t * result{};
+		quickscope_wrapper args_deleter{[&] { nvlist_free(args), nvlist_free(result); }};
+		if(nvlist_alloc(&args, NV_UNIQUE_NAME, 0) || nvlist_add_string_array(args, "argv", const_cast<char **>(argv), argc))
+			continue;
+
+		/// The default limits (10M instructions, 10M memory) are orders of magnitude above what even thousands of datasets need
+		if(TRACE("lzc_channel_program", lzc_channel_program(pool, program, 10'000'000, 10 * 1024 * 1024, args, &result)))
+			continue;
+
+		nvlist_t * ret{};
+		if(nvlist_lookup_nvlist(result, "return", &ret))
+			continue;
+		for(size_t i = first; i < on_len; ++i) {
+			int64_t err;
+			if(pooled[i] && !done[i] && !nvlist_lookup_int64(ret, zfs_get_name(on[i]), &err) && !err) {
+				done[i] = true;
+				zfs_refresh_properties(on[i]);
+			}
+		}
+	}
+}
+
+
 int set_key_props(zfs_handle_t * on, const char * backend, const char * handle) {
-	nvlist_t * props{};
-	quickscope_wrapper props_deleter{[&] { nvlist_free(props); }};
+	bool done{};
+	return set_key_props(&on, 1, backend, &handle, &done);
+}
 
-	TRY_NVL("allocate key nvlist", nvlist_alloc(&props, NV_UNIQUE_NAME, 0));
-	TRY_NVL("add back-end to key nvlist", nvlist_add_string(props, PROPNAME_BACKEND, backend));
-	TRY_NVL("add handle to key nvlist", nvlist_add_string(props, PROPNAME_KEY, handle));
+int set_key_props(zfs_handle_t ** on, size_t on_len, const char * backend, const char * const * handles, bool * done) {
+	key_props_program(set_key_props_program, on, on_len, backend, handles, done);
 
-	TRY("set tzpfms.{backend,key}", zfs_prop_set_list(on, props));
+	int err{};
+	for(size_t i = 0; i < on_len; ++i)
+		if(!done[i])
+			if(auto e = [&] {
+				   nvlist_t * props{};
+				   quickscope_wrapper props_deleter{[&] { nvlist_free(props); }};
 
-	return 0;
+				   TRY_NVL("allocate key nvlist", nvlist_alloc(&props, NV_UNIQUE_NAME, 0));
+				   TRY_NVL("add back-end to key nvlist", nvlist_add_string(props, PROPNAME_BACKEND, backend));
+				   TRY_NVL("add handle to key nvlist", nvlist_add_string(props, PROPNAME_KEY, handles[i]));
+
+				   TRY("set tzpfms.{backend,key}", zfs_prop_set_list(on[i], props));
+				   return done[i] = true, 0;
+			   }())
+				err = e;
+	return err;
 }
 
 
 int clear_key_props(zfs_handle_t * from) {
-	bool ok = false;
-	quickscope_wrapper props_deleter{[&] {
-		if(!ok)
-			fprintf(stderr, "You might need to run \"zfs inherit %s %s\" and \"zfs inherit %s %s\" to fully clear metadata!\n", PROPNAME_BACKEND, zfs_get_name(from),
-			        PROPNAME_KEY, zfs_get_name(from));
-	}};
+	bool done{};
+	return clear_key_props(&from, 1, &done);
+}
+
+int clear_key_props(zfs_handle_t ** from, size_t from_len, bool * done) {
+	key_props_program(clear_key_props_program, from, from_len, nullptr, nullptr, done);
+
+	int err{};
+	for(size_t i = 0; i < from_len; ++i)
+		if(!done[i])
+			if(auto e = [&] {
+				   bool ok = false;
+				   quickscope_wrapper props_deleter{[&] {
+					   if(!ok)
+						   fprintf(stderr, "You might need to run \"zfs inherit %s %s\" and \"zfs inherit %s %s\" to fully clear metadata!\n", PROPNAME_BACKEND,
+						           zfs_get_name(from[i]), PROPNAME_KEY, zfs_get_name(from[i]));
+				   }};
 
-	TRY("delete tzpfms.backend", zfs_prop_inherit(from, PROPNAME_BACKEND, B_FALSE));
-	TRY("delete tzpfms.key", zfs_prop_inherit(from, PROPNAME_KEY, B_FALSE));
-	return ok = true, 0;
+				   TRY("delete tzpfms.backend", zfs_prop_inherit(from[i], PROPNAME_BACKEND, B_FALSE));
+				   TRY("delete tzpfms.key", zfs_prop_inherit(from[i], PROPNAME_KEY, B_FALSE));
+				   return ok = done[i] = true, 0;
+			   }())
+				err = e;
+	return err;
 }
 
 
+int check_key_props(const char * dataset, const char * our_backend, const char * backend, const char * handle) {
+	if(!backend)
+		return fprintf(stderr, "Dataset %s not encrypted with tzpfms!\n", dataset), __LINE__;
+	if(strcmp(backend, our_backend))
+		return fprintf(stderr, "Dataset %s encrypted with tzpfms back-end %s, but we are %s.\n", dataset, backend, our_backend), __LINE__;
+	if(!handle)
+		return fprintf(stderr, "Dataset %s missing key data.\n", dataset), __LINE__;
+
+	return 0;
+}
+
 int parse_key_props(zfs_handle_t * in, const char * our_backend, char *& handle) {
 	char * backend{};
 	TRY_MAIN(lookup_userprop(in, PROPNAME_BACKEND, backend));
+	TRY_MAIN(lookup_userprop(in, PROPNAME_KEY, handle));
 
-	if(!backend)
-		return fprintf(stderr, "Dataset %s not encrypted with tzpfms!\n", zfs_get_name(in)), __LINE__;
-	if(strcmp(backend, our_backend))
-		return fprintf(stderr, "Dataset %s encrypted with tzpfms back-end %s, but we are %s.\n", zfs_get_name(in), backend, our_backend), __LINE__;
+	return check_key_props(zfs_get_name(in), our_backend, backend, handle);
+}
 
-	TRY_MAIN(lookup_userprop(in, PROPNAME_KEY, handle));
-	if(!handle)
-		return fprintf(stderr, "Dataset %s missing key data.\n", zfs_get_name(in)), __LINE__;
 
+/// Same as lookup_userprop(): only properties set on the dataset itself count
+static const char fast_key_props_program[] = R"(
+args = ...
+dataset = args["argv"][1]
+ret = {}
+ret["encryptionroot"] = zfs.get_prop(dataset, "encryptionroot")
+value, source = zfs.get_prop(dataset, ")" PROPNAME_BACKEND R"(")
+if source == dataset then
+	ret["backend"] = value
+end
+value, source = zfs.get_prop(dataset, ")" PROPNAME_KEY R"(")
+if source == dataset then
+	ret["key"] = value
+end
+return ret
+)";
+
+int fast_lookup_key_props(const char * dataset, nvlist_t *& out, char *& backend, char *& handle) {
+	out = nullptr;
+
+	char pool[ZFS_MAX_DATASET_NAME_LEN];
+	auto pool_len = strcspn(dataset, "/@#");
+	if(pool_len >= sizeof(pool))
+		return 0;
+	memcpy(pool, dataset, pool_len);
+	pool[pool_len] = '\0';
+
+	nvlist_t * args{};
+	quickscope_wrapper args_deleter{[&] { nvlist_free(args); }};
+	TRY_NVL("allocate channel program argument nvlist", nvlist_alloc(&args, NV_UNIQUE_NAME, 0));
+	TRY_NVL("add dataset to channel program argument nvlist", nvlist_add_string_array(args, "argv", const_cast<char **>(&dataset), 1));
+
+	/// Read-only, so this doesn't wait for a TXG sync; a handful of property lookups need nowhere near the default limits (10M instructions, 10M memory)
+	nvlist_t * result{};
+	quickscope_wrapper result_deleter{[&] {
+		if(!out)
+			nvlist_free(result);
+	}};
+	if(TRACE("lzc_channel_program_nosync", lzc_channel_program_nosync(pool, fast_key_props_program, 100'000, 1024 * 1024, args, &result)))
+		return 0;  // Channel programs unsupported/forbidden, no such dataset, &c.; libzfs will explain, if need be
+
+	nvlist_t * ret{};
+	char * encryption_root{};
+	if(nvlist_lookup_nvlist(result, "return", &ret) || nvlist_lookup_string(ret, "encryptionroot", &encryption_root) || strcmp(encryption_root, dataset) ||
+	   nvlist_lookup_string(ret, "backend", &backend) || nvlist_lookup_string(ret, "key", &handle))
+		return 0;
+
+	out = result;
 	return 0;
 }
@@ -27,7 +27,7 @@
 	} while(0)
 
 
-/// Static nvlist with {keyformat=raw, keylocation=prompt}
+/// Static nvlist with {keyformat=ZFS_KEYFORMAT_RAW, keylocation=prompt}, for lzc_change_key()
 extern nvlist_t * rewrap_args();
 /// Static nvlist with {keyformat=passphrase, keylocation=prompt}
 extern nvlist_t * clear_rewrap_args();
@@ -39,23 +39,57 @@ extern int lookup_userprop(zfs_handle_t * from, const char * name, char *& out);
 
 /// Set required decoding props on the dataset
 extern int set_key_props(zfs_handle_t * on, const char * backend, const char * handle);
+/// Likewise, on each on[i] to handles[i]; both props on each dataset are set at once, in one channel program per pool, if possible.
+/// done[i] is set for each dataset that succeeded; the ones already done are skipped. Returns the last error.
+///
+/// A channel program doesn't refresh the handles' cached properties, like zfs_prop_set_list() does, so the succeeded ones' are refreshed afterward
+extern int set_key_props(zfs_handle_t ** on, size_t on_len, const char * backend, const char * const * handles, bool * done);
 
 /// Remove decoding props from the dataset
 extern int clear_key_props(zfs_handle_t * from);
+/// Likewise, from all of them, like set_key_props()
+extern int clear_key_props(zfs_handle_t ** from, size_t from_len, bool * done);
 
 /// Read in decoding props from the dataset
 extern int parse_key_props(zfs_handle_t * in, const char * our_backend, char *& handle);
 
+/// Verify decoding props (either may be nullptr if unset) on dataset match our_backend
+extern int check_key_props(const char * dataset, const char * our_backend, const char * backend, const char * handle);
+
+/// Read in decoding props from the dataset with a read-only channel program, without libzfs (libzfs_core must be initialised).
+///
+/// out is nullptr if this couldn't be answered this way (channel programs unsupported or forbidden, no such dataset, &c.),
+/// or if dataset isn't an encryption root with both props set locally; ask libzfs then.
+/// Otherwise, out must be nvlist_free()d, and backend and handle point into it.
+extern int fast_lookup_key_props(const char * dataset, nvlist_t *& out, char *& backend, char *& handle);
+
 
-/// Rewrap key on on to wrap_key.
+/// Rewrap key on on to wrap_key, and refresh on's properties.
 ///
-/// wrap_key must be WRAPPING_KEY_LEN long.
+/// wrap_key must be WRAPPING_KEY_LEN long. Safe to call from many threads at once (with different handles).
 extern int change_key(zfs_handle_t * on, const uint8_t * wrap_key);
+/// Likewise, but without checking the key's loaded first (or refreshing anything); only needs libzfs_core, like load_key()
+extern int change_key(const char * dataset, const uint8_t * wrap_key);
 
-/// (Try to) load key wrap_key for for_d.
+/// (Try to) load key wrap_key for dataset.
 ///
-/// wrap_key must be WRAPPING_KEY_LEN long.
-extern int load_key(zfs_handle_t * for_d, const uint8_t * wrap_key, bool noop);
+/// wrap_key must be WRAPPING_KEY_LEN long. Only needs libzfs_core, and is safe to call from many threads at once;
+/// zfs_refresh_properties() the dataset's handle afterward, if there is one.
+extern int load_key(const char * dataset, const uint8_t * wrap_key, bool noop);
+
+/// With $TZPFMS_KEY_CACHE, unsealed wrapping keys are kept in the user keyring for that many seconds, named after the dataset and the sealed object.
+/// object identifies what the key was sealed in, and mustn't be reusable for a different one: the TPM2 back-end uses the object's name,
+/// not the persistent handle (cf. tpm2_sealed_name()), the TPM1.X one the whole handle property, which is the blobs themselves.
+///
+/// cached_key() fills wrap_key (WRAPPING_KEY_LEN long) with dataset's, and returns false if there's none (or caching is off);
+/// it also checks the key with a no-op load, and drops it and returns false if the dataset won't take it.
+/// cache_key() is a no-op if caching is off.
+extern bool cached_key(const char * dataset, const void * object, size_t object_len, uint8_t * wrap_key);
+/// 0 if caching is off; for skipping working out the object if it is
+extern unsigned key_cache_timeout();
+extern void cache_key(const char * dataset, const void * object, size_t object_len, const uint8_t * wrap_key);
+/// Drop all of dataset's cached keys, whatever they were cached under; this is done even if caching is off for us, since it mightn't've been for whoever cached them
+extern void uncache_key(const char * dataset);
 
 /// Check back-end integrity; if the previous backend matches this_backend, run func(); otherwise warn.
 template <class F>
@@ -64,6 +98,9 @@ int verify_backend(zfs_handle_t * on, const char * this_backend, F && func) {
 	TRY_MAIN(lookup_userprop(on, PROPNAME_BACKEND, previous_backend));
 	TRY_MAIN(lookup_userprop(on, PROPNAME_KEY, previous_handle));
 
+	if(previous_backend || previous_handle)
+		uncache_key(zfs_get_name(on));
+
 	if(!!previous_backend ^ !!previous_handle)
 		fprintf(stderr, "Inconsistent tzpfms metadata for %s: back-end is %s, but handle is %s?\n", zfs_get_name(on), previous_backend, previous_handle);
 	else if(previous_backend && previous_handle) {
@@ -1,49 +1,138 @@
 /* SPDX-License-Identifier: MIT */
 
 
-#include "fd.hpp"
+#include "keyring.hpp"
 #include "main.hpp"
+#include "trace.hpp"
 #include "zfs.hpp"
 
 #include <libzfs.h>
+#include <libzfs_core.h>
+#include <openssl/sha.h>
 // #include <sys/zio_crypt.h>
 #define WRAPPING_KEY_LEN 32
 
 
-template <class F>
-static int with_stdin_at_buffer(const void * buf, size_t buf_len, F && func) {
-	int key_fd;
-	TRY_MAIN(filled_fd(key_fd, buf, buf_len));
-	quickscope_wrapper key_fd_deleter{[=] { close(key_fd); }};
+/// The keys are handed to libzfs_core directly: zfs_crypto_rewrap() and zfs_crypto_load_key() only take them from keylocation,
+/// which would mean either dup()ing a pipe onto stdin (process-global) or going through the filesystem.
+/// The checks and error messages are the ones libzfs would've done/printed.
 
-	return with_stdin_at(key_fd, func);
+
+int change_key(zfs_handle_t * on, const uint8_t * wrap_key) {
+	REQUIRE_KEY_LOADED(on);
+	TRY_MAIN(change_key(zfs_get_name(on), wrap_key));
+	zfs_refresh_properties(on);  // libzfs would've, and keystatus &c. are read from the handle's cache
+	return 0;
 }
 
+int change_key(const char * dataset, const uint8_t * wrap_key) {
+	uint8_t key[WRAPPING_KEY_LEN];  // lzc_change_key() takes non-const
+	memcpy(key, wrap_key, sizeof(key));
+	quickscope_wrapper key_deleter{[&] { explicit_bzero(key, sizeof(key)); }};
 
-int change_key(zfs_handle_t * on, const uint8_t * wrap_key) {
-	/// zfs_crypto_rewrap() with "prompt" reads from stdin, but not if it's a TTY;
-	/// this user-proofs the set-up, and means we don't have to touch the filesysten:
-	/// instead, get an FD, write the raw key data there, dup() it onto stdin,
-	/// let libzfs read it, then restore stdin
+	switch(auto err = TRACE("lzc_change_key", lzc_change_key(dataset, DCP_CMD_NEW_KEY, TRY_PTR("get rewrap args", rewrap_args()), key, sizeof(key)))) {
+		case 0:
+			break;
+		case EPERM:
+			return fprintf(stderr, "Key change error: Permission denied.\n"), __LINE__;
+		case EINVAL:
+			return fprintf(stderr, "Key change error: Invalid properties for key change.\n"), __LINE__;
+		case EACCES:
+			return fprintf(stderr, "Key change error: Key is not currently loaded.\n"), __LINE__;
+		default:
+			return fprintf(stderr, "Key change error: %s\n", strerror(err)), __LINE__;
+	}
+
+	printf("Key for %s changed\n", dataset);
+	return 0;
+}
+
+
+int load_key(const char * dataset, const uint8_t * wrap_key, bool noop) {
+	uint8_t key[WRAPPING_KEY_LEN];  // lzc_load_key() takes non-const
+	memcpy(key, wrap_key, sizeof(key));
+	quickscope_wrapper key_deleter{[&] { explicit_bzero(key, sizeof(key)); }};
+
+	switch(auto err = TRACE("lzc_load_key", lzc_load_key(dataset, noop ? B_TRUE : B_FALSE, key, sizeof(key)))) {
+		case 0:
+			break;
+		case EPERM:
+			return fprintf(stderr, "Key load error: Permission denied.\n"), __LINE__;
+		case EINVAL:
+			return fprintf(stderr, "Key load error: Invalid parameters provided for dataset %s.\n", dataset), __LINE__;
+		case EEXIST:
+			return fprintf(stderr, "Key load error: Key already loaded for '%s'.\n", dataset), __LINE__;
+		case EBUSY:
+			return fprintf(stderr, "Key load error: '%s' is busy.\n", dataset), __LINE__;
+		case EACCES:
+			return fprintf(stderr, "Key load error: Incorrect key provided for '%s'.\n", dataset), __LINE__;
+		default:
+			return fprintf(stderr, "Key load error: %s\n", strerror(err)), __LINE__;
+	}
+
+	printf("Key for %s %s\n", dataset, noop ? "OK" : "loaded");
+	return 0;
+}
 
-	return with_stdin_at_buffer(wrap_key, WRAPPING_KEY_LEN, [&] {
-		if(zfs_crypto_rewrap(on, TRY_PTR("get rewrap args", rewrap_args()), B_FALSE))
-			return __LINE__;  // Error printed by libzfs
-		else
-			printf("Key for %s changed\n", zfs_get_name(on));
 
-		return 0;
-	});
+unsigned key_cache_timeout() {
+	static int timeout = -1;
+	if(timeout == -1)
+		timeout = keyring_timeout("TZPFMS_KEY_CACHE");
+	return timeout;
 }
 
+static const constexpr size_t key_cache_description_len = 11 + ZFS_MAX_DATASET_NAME_LEN + 1 + SHA256_DIGEST_LENGTH * 2 + 1;
 
-int load_key(zfs_handle_t * for_d, const uint8_t * wrap_key, bool noop) {
-	return with_stdin_at_buffer(wrap_key, WRAPPING_KEY_LEN, [&] {
-		if(zfs_crypto_load_key(for_d, noop ? B_TRUE : B_FALSE, nullptr))
-			return __LINE__;  // Error printed by libzfs
-		else
-			printf("Key for %s %s\n", zfs_get_name(for_d), noop ? "OK" : "loaded");
+/// tzpfms-key:dataset:SHA-256 of object; the object changes with the key, so a stale one is never found, even if it weren't uncached
+static bool key_cache_description(const char * dataset, const void * object, size_t object_len, char (&into)[key_cache_description_len]) {
+	uint8_t object_hash[SHA256_DIGEST_LENGTH];
+	SHA256(static_cast<const uint8_t *>(object), object_len, object_hash);
+
+	auto cur = into + snprintf(into, sizeof(into) - SHA256_DIGEST_LENGTH * 2, "tzpfms-key:%s:", dataset);
+	if(cur >= into + sizeof(into) - SHA256_DIGEST_LENGTH * 2)
+		return false;
+	for(auto b : object_hash)
+		cur += sprintf(cur, "%02hhx", b);
+	return true;
+}
+
+bool cached_key(const char * dataset, const void * object, size_t object_len, uint8_t * wrap_key) {
+	char desc[key_cache_description_len];
+	if(!key_cache_timeout() || !key_cache_description(dataset, object, object_len, desc))
+		return false;
+
+	uint8_t * buf{};
+	size_t len{};
+	if(!TRACE("keyring_read", keyring_read(desc, buf, len)))
+		return false;
+	quickscope_wrapper buf_deleter{[&] {
+		explicit_bzero(buf, len);
+		free(buf);
+	}};
+
+	if(len != WRAPPING_KEY_LEN)
+		return keyring_drop(desc), false;
+
+	/// If the dataset doesn't take it after all (EACCES), it's dropped, and it's up to the TPM; any other error is left for the real load to report
+	memcpy(wrap_key, buf, WRAPPING_KEY_LEN);
+	if(TRACE("lzc_load_key", lzc_load_key(dataset, B_TRUE, wrap_key, WRAPPING_KEY_LEN)) == EACCES) {
+		explicit_bzero(wrap_key, WRAPPING_KEY_LEN);
+		return keyring_drop(desc), false;
+	}
+	return true;
+}
+
+void cache_key(const char * dataset, const void * object, size_t object_len, const uint8_t * wrap_key) {
+	char desc[key_cache_description_len];
+	if(!key_cache_timeout() || !key_cache_description(dataset, object, object_len, desc))
+		return;
+	if(!keyring_write(desc, wrap_key, WRAPPING_KEY_LEN, key_cache_timeout()))
+		fprintf(stderr, "Couldn't cache key for %s: %s\n", dataset, strerror(errno));
+}
 
-		return 0;
-	});
+void uncache_key(const char * dataset) {
+	char prefix[key_cache_description_len];
+	if(snprintf(prefix, sizeof(prefix), "tzpfms-key:%s:", dataset) < static_cast<int>(sizeof(prefix)))
+		keyring_drop_prefixed(prefix, SHA256_DIGEST_LENGTH * 2);
 }